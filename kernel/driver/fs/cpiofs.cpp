@@ -2,6 +2,9 @@
 #include <cstdint>
 #include <cstring>
 #include <stdexcept>
+#include <string>
+#include <vector>
+#include <algorithm>
 
 #include "libcpio/libcpio.h"
 #include "k_vfs.h"
@@ -24,6 +27,7 @@ class CPIOFS : public BasicFS
 
         _archive = new uint8_t[len];
         memcpy(_archive, archive, len);
+        _buildCache();
     }
     ~CPIOFS()
     {
@@ -34,20 +38,20 @@ class CPIOFS : public BasicFS
 
     int open(const char *path, int flags, int mode) override
     {
-        unsigned long size = 0;
-        const void *file = cpio_get_file(_archive, _archive_len, path, &size);
-        if (!file)
-        {
+        auto ino = _find(path);
+        if (ino < 0)
             return K_ENOENT;
-        }
+        if (S_ISDIR(_inodes[ino].mode))
+            return K_EINVAL;
         for (int i = 0; i < MAX_FILES; i++)
         {
             if (!_fcb[i].used)
             {
                 _fcb[i].used = true;
-                _fcb[i].file = (void *)file;
-                _fcb[i].size = size;
+                _fcb[i].file = (void *)_inodes[ino].data;
+                _fcb[i].size = _inodes[ino].size;
                 _fcb[i].lpos = 0;
+                _fcb[i].ino = ino;
                 return i;
             }
         }
@@ -83,6 +87,50 @@ class CPIOFS : public BasicFS
     {
         return -1; // No write should be made to a CPIO archive
     }
+    // Copy straight out of the archive, lpos is not involved so concurrent readers do not race on it
+    int preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset) override
+    {
+        if (fd >= MAX_FILES || fd < 0)
+            return K_ENOENT;
+        if (!_fcb[fd].used)
+            return K_ENOENT;
+        if (iovcnt < 0 || offset < 0)
+            return K_EINVAL;
+        unsigned long pos = offset;
+        int total = 0;
+        for (int i = 0; i < iovcnt && pos < _fcb[fd].size; i++)
+        {
+            size_t count = iov[i].iov_len;
+            if (pos + count > _fcb[fd].size)
+                count = _fcb[fd].size - pos;
+            memcpy(iov[i].iov_base, (uint8_t *)_fcb[fd].file + pos, count);
+            pos += count;
+            total += count;
+        }
+        return total;
+    }
+
+    int pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) override
+    {
+        return -1; // No write should be made to a CPIO archive
+    }
+
+    int readahead(int fd, off_t offset, size_t count) override
+    {
+        if (fd >= MAX_FILES || fd < 0)
+            return K_ENOENT;
+        if (!_fcb[fd].used)
+            return K_ENOENT;
+        if (offset < 0)
+            return K_EINVAL;
+        if ((unsigned long)offset >= _fcb[fd].size)
+            return K_OK;
+        if (offset + count > _fcb[fd].size)
+            count = _fcb[fd].size - offset;
+        _prefetch((uint8_t *)_fcb[fd].file + offset, count);
+        return K_OK;
+    }
+
     int lseek(int fd, off_t offset, int whence) override
     {
         if (fd >= MAX_FILES || fd < 0)
@@ -117,29 +165,234 @@ class CPIOFS : public BasicFS
         {
             return K_EINVAL;
         }
-        return K_OK;
+        return _fcb[fd].lpos;
     }
     int fstat(int fd, struct stat *buf) override
     {
-        return -1;
+        if (fd >= MAX_FILES || fd < 0)
+            return K_ENOENT;
+        if (!_fcb[fd].used)
+            return K_ENOENT;
+        _fill(_inodes[_fcb[fd].ino], buf);
+        return K_OK;
+    }
+
+    int stat(const char *path, struct stat *buf) override
+    {
+        auto ino = _find(path);
+        if (ino >= 0)
+        {
+            _fill(_inodes[ino], buf);
+            return K_OK;
+        }
+        // Archives may leave out the entries of parent directories
+        if (*path && !_isParent(path))
+            return K_ENOENT;
+        inode_t dir;
+        dir.mode = S_IFDIR | 0555;
+        dir.nlink = 2;
+        _fill(dir, buf);
+        return K_OK;
+    }
+
+    int opendir(const char *path) override
+    {
+        auto ino = _find(path);
+        if (ino >= 0 ? !S_ISDIR(_inodes[ino].mode) : (*path && !_isParent(path)))
+            return K_ENOENT;
+        for (int i = 0; i < MAX_DIRS; i++)
+        {
+            if (!_dcb[i].used)
+            {
+                _dcb[i].used = true;
+                _dcb[i].prefix = *path ? std::string(path) + "/" : "";
+                _dcb[i].pos = std::lower_bound(_inodes.begin(), _inodes.end(), _dcb[i].prefix, _less) - _inodes.begin();
+                _dcb[i].last.clear();
+                return i;
+            }
+        }
+        return K_ENOMEM;
+    }
+
+    // Walk the sorted inodes sharing the directory prefix, children with deeper paths
+    // stand for parent directories missing from the archive
+    int readdir(int dd, dirent_t *dirp) override
+    {
+        if (dd >= MAX_DIRS || dd < 0 || !_dcb[dd].used)
+            return K_ENOENT;
+        auto &d = _dcb[dd];
+        for (; d.pos < _inodes.size(); d.pos++)
+        {
+            auto &in = _inodes[d.pos];
+            if (in.name.compare(0, d.prefix.size(), d.prefix) != 0)
+                break;
+            std::string_view name = std::string_view(in.name).substr(d.prefix.size());
+            if (name.empty())
+                continue;
+            auto slash = name.find('/');
+            mode_t mode = in.mode;
+            if (slash != std::string_view::npos)
+            {
+                name = name.substr(0, slash);
+                if (name == d.last || _find(d.prefix + std::string(name)) >= 0)
+                    continue; // already listed, or listed by its own entry
+                mode = S_IFDIR;
+            }
+            if (name.size() >= sizeof(dirp->d_name))
+                continue;
+            d.last = name;
+            dirp->d_ino = slash == std::string_view::npos ? in.ino : 0;
+            dirp->d_mode = mode & S_IFMT;
+            memcpy(dirp->d_name, name.data(), name.size());
+            dirp->d_name[name.size()] = 0;
+            d.pos++;
+            return 1;
+        }
+        return 0;
+    }
+
+    int closedir(int dd) override
+    {
+        if (dd >= MAX_DIRS || dd < 0 || !_dcb[dd].used)
+            return K_ENOENT;
+        _dcb[dd].used = false;
+        _dcb[dd].prefix.clear();
+        _dcb[dd].last.clear();
+        return K_OK;
     }
 
   private:
     static constexpr int MAX_FILES = 1024;
+    static constexpr int MAX_DIRS = 64;
 
     uint8_t *_archive = NULL;
     size_t _archive_len = 0;
     struct cpio_info _info;
 
+    // Metadata of one archive entry, parsed once from its newc header
+    struct inode_t
+    {
+        std::string name; // without leading "./" or "/"
+        const uint8_t *data = nullptr;
+        unsigned long size = 0;
+        unsigned long ino = 0;
+        mode_t mode = 0;
+        uid_t uid = 0;
+        gid_t gid = 0;
+        nlink_t nlink = 1;
+        time_t mtime = 0;
+    };
+
     struct fcb_t
     {
         bool used = false;
         void *file = nullptr;
         unsigned long size = 0;
         unsigned long lpos = 0;
+        int ino = 0; // index into _inodes
+    };
+
+    struct dcb_t
+    {
+        bool used = false;
+        std::string prefix; // "dir/", "" for the root
+        size_t pos = 0;     // next index into _inodes
+        std::string last;   // last name returned
     };
 
+    std::vector<inode_t> _inodes; // sorted by name
     std::array<fcb_t, MAX_FILES> _fcb;
+    std::array<dcb_t, MAX_DIRS> _dcb;
+
+    static bool _less(const inode_t &a, const std::string &b)
+    {
+        return a.name < b;
+    }
+
+    static unsigned long _hex(const char *s)
+    {
+        unsigned long v = 0;
+        for (int i = 0; i < 8; i++)
+        {
+            char c = s[i];
+            v = (v << 4) | (c >= '0' && c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+        }
+        return v;
+    }
+
+    void _buildCache()
+    {
+        constexpr size_t hdr_sz = sizeof(cpio_header);
+        auto align4 = [](size_t v) { return (v + 3) & ~(size_t)3; };
+        _inodes.reserve(_info.file_count);
+
+        size_t off = 0;
+        while (off + hdr_sz <= _archive_len)
+        {
+            auto hdr = (const cpio_header *)(_archive + off);
+            if (memcmp(hdr->c_magic, CPIO_HEADER_MAGIC, sizeof(hdr->c_magic)))
+                break;
+            size_t namesize = _hex(hdr->c_namesize), filesize = _hex(hdr->c_filesize);
+            size_t data = align4(off + hdr_sz + namesize);
+            if (!namesize || data + filesize > _archive_len)
+                break;
+            std::string_view name((const char *)hdr + hdr_sz, namesize - 1);
+            if (name == CPIO_FOOTER_MAGIC)
+                break;
+            off = align4(data + filesize);
+
+            while (name.substr(0, 2) == "./")
+                name.remove_prefix(2);
+            while (!name.empty() && name.front() == '/')
+                name.remove_prefix(1);
+            if (name.empty() || name == ".")
+                continue;
+
+            inode_t in;
+            in.name = name;
+            in.data = _archive + data;
+            in.size = filesize;
+            in.ino = _hex(hdr->c_ino);
+            in.mode = _hex(hdr->c_mode);
+            in.uid = _hex(hdr->c_uid);
+            in.gid = _hex(hdr->c_gid);
+            in.nlink = _hex(hdr->c_nlink);
+            in.mtime = _hex(hdr->c_mtime);
+            _inodes.push_back(std::move(in));
+        }
+        std::stable_sort(_inodes.begin(), _inodes.end(),
+                         [](const inode_t &a, const inode_t &b) { return a.name < b.name; });
+    }
+
+    int _find(const std::string &name)
+    {
+        auto it = std::lower_bound(_inodes.begin(), _inodes.end(), name, _less);
+        if (it == _inodes.end() || it->name != name)
+            return -1;
+        return it - _inodes.begin();
+    }
+
+    // Some entry lives below path
+    bool _isParent(const char *path)
+    {
+        std::string prefix = std::string(path) + "/";
+        auto it = std::lower_bound(_inodes.begin(), _inodes.end(), prefix, _less);
+        return it != _inodes.end() && it->name.compare(0, prefix.size(), prefix) == 0;
+    }
+
+    void _fill(const inode_t &in, struct stat *buf)
+    {
+        memset(buf, 0, sizeof(*buf));
+        buf->st_ino = in.ino;
+        buf->st_mode = in.mode;
+        buf->st_nlink = in.nlink;
+        buf->st_uid = in.uid;
+        buf->st_gid = in.gid;
+        buf->st_size = in.size;
+        buf->st_mtime = in.mtime;
+        buf->st_blksize = 4096;
+        buf->st_blocks = (in.size + 511) / 512;
+    }
 };
 
 // Register the filesystem
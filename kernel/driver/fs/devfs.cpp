@@ -1,58 +1,326 @@
-
 #include <cstdint>
-#include <cpio.h>
-
+#include <cstring>
+#include <map>
+#include <array>
+#include <string>
+#include <string_view>
 
+#include "k_main.h"
+#include "k_drvif.h"
 #include "k_vfs.h"
 #include "k_defs.h"
 
+// Exposes every installed char/block device by its DeviceTree node name, e.g. /dev/serial@10000000.
+// An open fd is bound to the driver handle, so I/O goes straight to the driver.
 class DEVFS : public BasicFS
 {
   public:
-    DEVFS() {
-
-    }
-    ~DEVFS(){
-
+    DEVFS()
+    {
+        _scan();
     }
 
     int open(const char *path, int flags, int mode) override
     {
-        return -1;
+        node_t dev;
+        if (!_lookup(path, dev))
+            return K_ENOENT;
+
+        if (dev.drv->getDeviceType() == DEV_TYPE_CHAR)
+        {
+            auto rc = ((DriverChar *)dev.drv)->open(dev.hdl);
+            if (rc < 0)
+                return rc;
+        }
+
+        _lock.lock();
+        for (int i = 0; i < MAX_FILES; i++)
+        {
+            if (!_fcb[i].used)
+            {
+                _fcb[i].used = true;
+                _fcb[i].dev = dev;
+                _fcb[i].lpos = 0;
+                _lock.unlock();
+                return i;
+            }
+        }
+        _lock.unlock();
+        if (dev.drv->getDeviceType() == DEV_TYPE_CHAR)
+            ((DriverChar *)dev.drv)->close(dev.hdl);
+        return K_ENOMEM;
     }
+
     int close(int fd) override
     {
-        return -1;
+        if (!_valid(fd))
+            return K_ENOENT;
+        auto &f = _fcb[fd];
+        if (_isChar(f))
+            ((DriverChar *)f.dev.drv)->close(f.dev.hdl);
+        f.used = false;
+        return K_OK;
     }
+
     int read(int fd, void *buf, size_t count) override
     {
-        return -1;
+        if (!_valid(fd))
+            return K_ENOENT;
+        auto &f = _fcb[fd];
+        if (_isChar(f))
+            return ((DriverChar *)f.dev.drv)->read(f.dev.hdl, buf, count);
+        auto rc = ((DriverBlock *)f.dev.drv)->read(f.dev.hdl, buf, count, f.lpos);
+        if (rc > 0)
+            f.lpos += rc;
+        return rc;
     }
+
     int write(int fd, const void *buf, size_t count) override
     {
-        return -1;
+        if (!_valid(fd))
+            return K_ENOENT;
+        auto &f = _fcb[fd];
+        if (_isChar(f))
+            return ((DriverChar *)f.dev.drv)->write(f.dev.hdl, buf, count);
+        auto rc = ((DriverBlock *)f.dev.drv)->write(f.dev.hdl, buf, count, f.lpos);
+        if (rc > 0)
+            f.lpos += rc;
+        return rc;
+    }
+
+    // Block devices only, char devices are streams
+    int preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset) override
+    {
+        return _rwv(fd, iov, iovcnt, offset, false);
+    }
+
+    int pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) override
+    {
+        return _rwv(fd, iov, iovcnt, offset, true);
     }
+
     int lseek(int fd, off_t offset, int whence) override
     {
-        return -1;
+        if (!_valid(fd))
+            return K_ENOENT;
+        auto &f = _fcb[fd];
+        if (_isChar(f))
+            return K_ENOTSUPP;
+        if (whence == SEEK_SET && offset >= 0)
+            f.lpos = offset;
+        else if (whence == SEEK_CUR && (off_t)f.lpos + offset >= 0)
+            f.lpos += offset;
+        else
+            return K_EINVAL; // the size of a block device is not known here
+        return f.lpos;
     }
+
     int fstat(int fd, struct stat *buf) override
     {
-        return -1;
+        if (!_valid(fd))
+            return K_ENOENT;
+        _fill(_fcb[fd].dev, buf);
+        return K_OK;
+    }
+
+    // Overridden so that stat does not open (and claim) the device
+    int stat(const char *path, struct stat *buf) override
+    {
+        if (!*path)
+        {
+            memset(buf, 0, sizeof(*buf));
+            buf->st_mode = S_IFDIR | 0755;
+            buf->st_nlink = 2;
+            return K_OK;
+        }
+        node_t dev;
+        if (!_lookup(path, dev))
+            return K_ENOENT;
+        _fill(dev, buf);
+        return K_OK;
+    }
+
+    int opendir(const char *path) override
+    {
+        if (*path)
+            return K_ENOENT; // flat namespace
+        _scan();
+        _lock.lock();
+        for (int i = 0; i < MAX_DIRS; i++)
+        {
+            if (!_dcb[i].used)
+            {
+                _dcb[i].used = true;
+                _dcb[i].resume.clear();
+                _lock.unlock();
+                return i;
+            }
+        }
+        _lock.unlock();
+        return K_ENOMEM;
+    }
+
+    int readdir(int dd, dirent_t *dirp) override
+    {
+        if (dd >= MAX_DIRS || dd < 0 || !_dcb[dd].used)
+            return K_ENOENT;
+        auto &d = _dcb[dd];
+        _lock.lock();
+        auto it = _nodes.lower_bound(d.resume);
+        for (; it != _nodes.end() && it->first.size() >= sizeof(dirp->d_name); ++it)
+            ;
+        if (it == _nodes.end())
+        {
+            _lock.unlock();
+            return 0;
+        }
+        d.resume = it->first + '\0';
+        dirp->d_ino = it->second.node;
+        dirp->d_mode = it->second.drv->getDeviceType() == DEV_TYPE_CHAR ? S_IFCHR : S_IFBLK;
+        memcpy(dirp->d_name, it->first.c_str(), it->first.size() + 1);
+        _lock.unlock();
+        return 1;
+    }
+
+    int closedir(int dd) override
+    {
+        if (dd >= MAX_DIRS || dd < 0 || !_dcb[dd].used)
+            return K_ENOENT;
+        _dcb[dd].used = false;
+        return K_OK;
     }
 
   private:
+    static constexpr int MAX_FILES = 256;
+    static constexpr int MAX_DIRS = 16;
+
+    struct node_t
+    {
+        DriverBase *drv = nullptr;
+        long hdl = 0;
+        int node = 0; // FDT offset, doubles as the inode number
+    };
+
+    struct fcb_t
+    {
+        bool used = false;
+        node_t dev;
+        unsigned long lpos = 0;
+    };
+
+    struct dcb_t
+    {
+        bool used = false;
+        std::string resume; // first name not returned yet
+    };
+
+    std::map<std::string, node_t, std::less<>> _nodes;
+    std::array<fcb_t, MAX_FILES> _fcb;
+    std::array<dcb_t, MAX_DIRS> _dcb;
+    lock_t _lock;
+
+    void _scan()
+    {
+        _lock.lock();
+        DriverManager::forEachDevice([this](int node, DriverBase *drv, long hdl) {
+            auto type = drv->getDeviceType();
+            if (type != DEV_TYPE_CHAR && type != DEV_TYPE_BLOCK)
+                return;
+            auto name = fdt_get_name(k_fdt, node, nullptr);
+            if (!name)
+                return;
+            std::string key = name;
+            auto it = _nodes.find(key);
+            if (it != _nodes.end() && (it->second.drv != drv || it->second.hdl != hdl))
+                key += "." + std::to_string(node); // same name under another parent
+            _nodes[key] = node_t{drv, hdl, node};
+        });
+        _lock.unlock();
+    }
+
+    // Copy of the node at path, under _lock: _scan may be inserting from another hart
+    bool _find(const char *path, node_t &out)
+    {
+        _lock.lock();
+        auto it = _nodes.find(path);
+        bool found = it != _nodes.end();
+        if (found)
+            out = it->second;
+        _lock.unlock();
+        return found;
+    }
+
+    // Rescans once on a miss, devices may have been installed since the last scan
+    bool _lookup(const char *path, node_t &out)
+    {
+        if (_find(path, out))
+            return true;
+        _scan();
+        return _find(path, out);
+    }
 
+    bool _valid(int fd)
+    {
+        return fd >= 0 && fd < MAX_FILES && _fcb[fd].used;
+    }
+
+    static void _fill(const node_t &dev, struct stat *buf)
+    {
+        memset(buf, 0, sizeof(*buf));
+        buf->st_ino = dev.node;
+        buf->st_mode = (dev.drv->getDeviceType() == DEV_TYPE_CHAR ? S_IFCHR : S_IFBLK) | 0660;
+        buf->st_nlink = 1;
+        buf->st_rdev = dev.node;
+    }
+
+    static bool _isChar(const fcb_t &f)
+    {
+        return f.dev.drv->getDeviceType() == DEV_TYPE_CHAR;
+    }
+
+    int _rwv(int fd, const struct iovec *iov, int iovcnt, off_t offset, bool wr)
+    {
+        if (!_valid(fd))
+            return K_ENOENT;
+        auto &f = _fcb[fd];
+        if (_isChar(f))
+            return K_ENOTSUPP;
+        if (iovcnt < 0 || offset < 0)
+            return K_EINVAL;
+        auto drv = (DriverBlock *)f.dev.drv;
+        int total = 0;
+        for (int i = 0; i < iovcnt; i++)
+        {
+            auto rc = wr ? drv->write(f.dev.hdl, iov[i].iov_base, iov[i].iov_len, offset + total)
+                         : drv->read(f.dev.hdl, iov[i].iov_base, iov[i].iov_len, offset + total);
+            if (rc < 0)
+            {
+                if (!total)
+                    total = rc;
+                break;
+            }
+            total += rc;
+            if ((size_t)rc < iov[i].iov_len)
+                break;
+        }
+        return total;
+    }
 };
 
 // Register the filesystem
 FS_INSTALL_FUNC(K_PR_FS_BEGIN) static void fs_register()
 {
     VirtualFS::registerFS(
-        "cpio", [](const char *devicePath) -> std::pair<int, BasicFS *> { return {0, new DEVFS()}; },
+        "devfs",
+        [](const char *devicePath) -> std::pair<int, BasicFS *> {
+            using namespace std::string_view_literals;
+            if (!devicePath || (devicePath != "devfs"sv && devicePath != "none"sv))
+                return {K_ENOTSUPP, nullptr};
+            return {0, new DEVFS()};
+        },
         [](BasicFS *fs) -> int {
             delete fs;
             return 0;
         });
     printf("FS DevFS installed\n");
-}
\ No newline at end of file
+}
@@ -0,0 +1,392 @@
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cstdarg>
+#include <cstdio>
+#include <algorithm>
+#include <array>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <malloc.h>
+#include <fcntl.h>
+
+#include "k_main.h"
+#include "k_vfs.h"
+#include "k_defs.h"
+#include "k_stats.h"
+#include "k_perf.h"
+#include "k_thread.h"
+#include "k_lockstat.h"
+
+extern "C" unsigned long k_heap_max;
+
+// Read-only kernel state as text, e.g. `cat /proc/stats` on the serial console.
+// A file is rendered when opened, so reads of one fd see a single consistent snapshot.
+class PROCFS : public BasicFS
+{
+  public:
+    int open(const char *path, int flags, int mode) override
+    {
+        if ((flags & O_ACCMODE) != O_RDONLY)
+            return K_EDENIED;
+        auto gen = _find(path);
+        if (!gen)
+            return K_ENOENT;
+
+        std::string data;
+        (this->*gen->render)(data);
+        _lock.lock();
+        for (int i = 0; i < MAX_FILES; i++)
+        {
+            if (!_fcb[i].used)
+            {
+                _fcb[i].used = true;
+                _fcb[i].data = std::move(data);
+                _fcb[i].lpos = 0;
+                _lock.unlock();
+                return i;
+            }
+        }
+        _lock.unlock();
+        return K_ENOMEM;
+    }
+
+    int close(int fd) override
+    {
+        if (!_valid(fd))
+            return K_ENOENT;
+        _fcb[fd].data.clear();
+        _fcb[fd].data.shrink_to_fit();
+        _fcb[fd].used = false;
+        return K_OK;
+    }
+
+    int read(int fd, void *buf, size_t count) override
+    {
+        if (!_valid(fd))
+            return K_ENOENT;
+        auto &f = _fcb[fd];
+        if (f.lpos >= f.data.size())
+            return 0;
+        count = std::min(count, f.data.size() - f.lpos);
+        memcpy(buf, f.data.data() + f.lpos, count);
+        f.lpos += count;
+        return count;
+    }
+
+    int write(int fd, const void *buf, size_t count) override
+    {
+        return _valid(fd) ? K_EDENIED : K_ENOENT;
+    }
+
+    int lseek(int fd, off_t offset, int whence) override
+    {
+        if (!_valid(fd))
+            return K_ENOENT;
+        auto &f = _fcb[fd];
+        off_t base = whence == SEEK_SET ? 0 : whence == SEEK_CUR ? f.lpos : whence == SEEK_END ? f.data.size() : -1;
+        if (base < 0 || base + offset < 0)
+            return K_EINVAL;
+        f.lpos = base + offset;
+        return f.lpos;
+    }
+
+    int fstat(int fd, struct stat *buf) override
+    {
+        if (!_valid(fd))
+            return K_ENOENT;
+        _fill(fd + 1, _fcb[fd].data.size(), buf);
+        return K_OK;
+    }
+
+    // Size is unknown until rendered, like on Linux
+    int stat(const char *path, struct stat *buf) override
+    {
+        if (!*path)
+        {
+            memset(buf, 0, sizeof(*buf));
+            buf->st_mode = S_IFDIR | 0555;
+            buf->st_nlink = 2;
+            return K_OK;
+        }
+        auto gen = _find(path);
+        if (!gen)
+            return K_ENOENT;
+        _fill(gen - _files + 1, 0, buf);
+        return K_OK;
+    }
+
+    int opendir(const char *path) override
+    {
+        if (*path)
+            return K_ENOENT;
+        _lock.lock();
+        for (int i = 0; i < MAX_DIRS; i++)
+        {
+            if (!_dcb[i].used)
+            {
+                _dcb[i].used = true;
+                _dcb[i].next = 0;
+                _lock.unlock();
+                return i;
+            }
+        }
+        _lock.unlock();
+        return K_ENOMEM;
+    }
+
+    int readdir(int dd, dirent_t *dirp) override
+    {
+        if (dd >= MAX_DIRS || dd < 0 || !_dcb[dd].used)
+            return K_ENOENT;
+        auto &d = _dcb[dd];
+        if (d.next >= NUM_FILES)
+            return 0;
+        dirp->d_ino = d.next + 1;
+        dirp->d_mode = S_IFREG;
+        strcpy(dirp->d_name, _files[d.next].name);
+        d.next++;
+        return 1;
+    }
+
+    int closedir(int dd) override
+    {
+        if (dd >= MAX_DIRS || dd < 0 || !_dcb[dd].used)
+            return K_ENOENT;
+        _dcb[dd].used = false;
+        return K_OK;
+    }
+
+  private:
+    static constexpr int MAX_FILES = 32;
+    static constexpr int MAX_DIRS = 8;
+
+    struct file_t
+    {
+        const char *name;
+        void (PROCFS::*render)(std::string &out);
+    };
+
+    struct fcb_t
+    {
+        bool used = false;
+        std::string data;
+        size_t lpos = 0;
+    };
+
+    struct dcb_t
+    {
+        bool used = false;
+        int next = 0;
+    };
+
+    static const file_t _files[];
+    static const int NUM_FILES;
+
+    std::array<fcb_t, MAX_FILES> _fcb;
+    std::array<dcb_t, MAX_DIRS> _dcb;
+    lock_t _lock;
+
+    bool _valid(int fd)
+    {
+        return fd >= 0 && fd < MAX_FILES && _fcb[fd].used;
+    }
+
+    static const file_t *_find(std::string_view path)
+    {
+        for (int i = 0; i < NUM_FILES; i++)
+            if (path == _files[i].name)
+                return &_files[i];
+        return nullptr;
+    }
+
+    static void _fill(ino_t ino, size_t size, struct stat *buf)
+    {
+        memset(buf, 0, sizeof(*buf));
+        buf->st_ino = ino;
+        buf->st_mode = S_IFREG | 0444;
+        buf->st_nlink = 1;
+        buf->st_size = size;
+    }
+
+    __attribute__((format(printf, 2, 3))) static void _printf(std::string &out, const char *fmt, ...)
+    {
+        char line[256];
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(line, sizeof(line), fmt, ap);
+        va_end(ap);
+        out.append(line, std::min(n, (int)sizeof(line) - 1));
+    }
+
+    // One row per counter: total, then each hart
+    void _row(std::string &out, const char *name, const kstats_t *harts, int nharts, size_t off)
+    {
+        uint64_t total = 0;
+        for (int h = 0; h < nharts; h++)
+            total += *(const uint64_t *)((const char *)&harts[h] + off);
+        if (!total)
+            return;
+        _printf(out, "%-20s %12lu", name, total);
+        for (int h = 0; h < nharts; h++)
+            _printf(out, " %10lu", *(const uint64_t *)((const char *)&harts[h] + off));
+        out += '\n';
+    }
+
+    void _renderStats(std::string &out)
+    {
+        static const char *irqs[K_STATS_CAUSES] = {nullptr, "irq.ssoft", nullptr, nullptr, nullptr, "irq.stimer",
+                                                   nullptr, nullptr, nullptr, "irq.sext",  nullptr, nullptr,
+                                                   nullptr, "irq.pmu"};
+        static const char *excs[K_STATS_CAUSES] = {
+            "exc.misaligned_fetch", "exc.fetch_access",    "exc.illegal_insn",   "exc.breakpoint",
+            "exc.misaligned_load",  "exc.load_access",     "exc.misaligned_st",  "exc.store_access",
+            "exc.ecall_u",          "exc.ecall_s",         nullptr,              nullptr,
+            "exc.fetch_pagefault",  "exc.load_pagefault",  nullptr,              "exc.store_pagefault"};
+
+        auto &cpus = syscpu->CPUs();
+        std::vector<kstats_t> harts(cpus.size());
+        _printf(out, "%-20s %12s", "counter", "total");
+        for (size_t i = 0; i < cpus.size(); i++)
+        {
+            k_stats_hart(cpus[i].hid, harts[i]);
+            _printf(out, "   hart%-4lu", cpus[i].hid);
+        }
+        out += '\n';
+
+        char name[32];
+        for (int c = 0; c < K_STATS_CAUSES; c++)
+        {
+            if (!irqs[c])
+                snprintf(name, sizeof(name), "irq.%d", c);
+            _row(out, irqs[c] ? irqs[c] : name, harts.data(), harts.size(),
+                 offsetof(kstats_t, irq) + c * sizeof(uint64_t));
+        }
+        for (int c = 0; c < K_STATS_CAUSES; c++)
+        {
+            if (!excs[c])
+                snprintf(name, sizeof(name), "exc.%d", c);
+            _row(out, excs[c] ? excs[c] : name, harts.data(), harts.size(),
+                 offsetof(kstats_t, exc) + c * sizeof(uint64_t));
+        }
+        _row(out, "syscalls", harts.data(), harts.size(), offsetof(kstats_t, syscalls));
+        _row(out, "ctx_switches", harts.data(), harts.size(), offsetof(kstats_t, ctx_switches));
+        _row(out, "heap_ops", harts.data(), harts.size(), offsetof(kstats_t, heap_ops));
+        _row(out, "mmu_map", harts.data(), harts.size(), offsetof(kstats_t, mmu_map));
+        _row(out, "mmu_map_pages", harts.data(), harts.size(), offsetof(kstats_t, mmu_map_pages));
+        _row(out, "mmu_unmap", harts.data(), harts.size(), offsetof(kstats_t, mmu_unmap));
+        _row(out, "mmu_unmap_pages", harts.data(), harts.size(), offsetof(kstats_t, mmu_unmap_pages));
+    }
+
+    void _renderPerf(std::string &out)
+    {
+        _printf(out, "%-8s", "hart");
+        for (auto name : k_perf_names)
+            _printf(out, " %14s", name);
+        out += '\n';
+        for (auto &cpu : syscpu->CPUs())
+        {
+            perf_counters_t c;
+            k_perf_hart(cpu.hid, c);
+            _printf(out, "%-8lu", cpu.hid);
+            for (auto v : c.v)
+                _printf(out, " %14lu", v);
+            out += '\n';
+        }
+    }
+
+    // Deadline columns in us: runtime/deadline/period, jobs, misses, release to dispatch jitter (avg, max)
+    void _renderThreads(std::string &out)
+    {
+        _printf(out, "%6s %-12s %4s %5s %10s %s\n", "tid", "name", "hart", "state", "ticks", "deadline");
+        k_thread_foreach(
+            [](const thread_t *t, void *arg) {
+                static const char states[] = "NQRSZ"; // new, queued, running, sleeping, zombie
+                auto &out = *(std::string *)arg;
+                int st = t->state;
+                _printf(out, "%6u %-12.12s %4d %5c %10lu", t->tid, t->name ? t->name : "-", t->hart,
+                        st >= 0 && st < 5 ? states[st] : '?', t->ticks);
+                auto dl = t->dl;
+                if (dl && dl->runtime)
+                {
+                    auto us = [](uint64_t v) { return k_cpuclock ? v * 1000000 / k_cpuclock : 0; };
+                    _printf(out, " %lu/%lu/%lu jobs=%lu miss=%lu jitter=%lu/%lu", us(dl->runtime), us(dl->deadline),
+                            us(dl->period), dl->jobs, dl->misses, dl->jobs ? us(dl->jitter_sum / dl->jobs) : 0,
+                            us(dl->jitter_max));
+                }
+                out += '\n';
+            },
+            &out);
+    }
+
+#if K_CONFIG_LOCKSTAT
+    // Classes by time waited, then their sites; times in us. A class without a name shows its first site.
+    void _renderLockstat(std::string &out)
+    {
+        std::vector<const lockstat_class_t *> cls;
+        k_lockstat_foreach([](const lockstat_class_t *c, void *arg) { ((decltype(cls) *)arg)->push_back(c); }, &cls);
+        std::sort(cls.begin(), cls.end(), [](auto a, auto b) { return a->wait.load() > b->wait.load(); });
+
+        auto us = [](uint64_t v) { return k_cpuclock ? v * 1000000 / k_cpuclock : 0; };
+        _printf(out, "%-24s %10s %10s %10s %8s %10s %8s\n", "class", "acquired", "contended", "wait", "wait-max",
+                "hold", "hold-max");
+        for (auto c : cls)
+        {
+            if (!c->acquired.load())
+                continue;
+            char name[32];
+            if (c->name)
+                snprintf(name, sizeof(name), "%s", c->name);
+            else if (c->key.load())
+                snprintf(name, sizeof(name), "lock@%lx", c->site);
+            else
+                snprintf(name, sizeof(name), "(other)");
+            _printf(out, "%-24s %10lu %10lu %10lu %8lu %10lu %8lu\n", name, c->acquired.load(), c->contended.load(),
+                    us(c->wait.load()), us(c->wait_max.load()), us(c->hold.load()), us(c->hold_max.load()));
+            for (auto &s : c->sites)
+                if (s.ra.load() && s.acquired.load())
+                    _printf(out, "  from %-17lx %10lu %10lu %10lu\n", s.ra.load(), s.acquired.load(),
+                            s.contended.load(), us(s.wait.load()));
+        }
+    }
+#endif
+
+    void _renderMeminfo(std::string &out)
+    {
+        auto mi = mallinfo();
+        _printf(out, "HeapArena:  %10lu\n", (unsigned long)mi.arena);
+        _printf(out, "HeapUsed:   %10lu\n", (unsigned long)mi.uordblks);
+        _printf(out, "HeapFree:   %10lu\n", (unsigned long)mi.fordblks);
+        _printf(out, "HeapPeak:   %10lu\n", k_heap_max);
+    }
+};
+
+const PROCFS::file_t PROCFS::_files[] = {
+    {"stats", &PROCFS::_renderStats},
+    {"perf", &PROCFS::_renderPerf},
+    {"meminfo", &PROCFS::_renderMeminfo},
+    {"threads", &PROCFS::_renderThreads},
+#if K_CONFIG_LOCKSTAT
+    {"lockstat", &PROCFS::_renderLockstat},
+#endif
+};
+const int PROCFS::NUM_FILES = sizeof(PROCFS::_files) / sizeof(PROCFS::_files[0]);
+
+// Register the filesystem
+FS_INSTALL_FUNC(K_PR_FS_BEGIN) static void fs_register()
+{
+    VirtualFS::registerFS(
+        "procfs",
+        [](const char *devicePath) -> std::pair<int, BasicFS *> {
+            using namespace std::string_view_literals;
+            if (!devicePath || (devicePath != "procfs"sv && devicePath != "none"sv))
+                return {K_ENOTSUPP, nullptr};
+            return {0, new PROCFS()};
+        },
+        [](BasicFS *fs) -> int {
+            delete fs;
+            return 0;
+        });
+    printf("FS ProcFS installed\n");
+}
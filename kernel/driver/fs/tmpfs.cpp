@@ -0,0 +1,525 @@
+/**
+ * @file tmpfs.cpp
+ * @brief In-memory writable filesystem
+ *
+ * Every file keeps a list of page-granular extents, holes read back as zeros. Pages handed out by getpage pin
+ * their extent: truncating the file takes it off the file, the memory is freed once the last putpage comes.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <array>
+#include <string_view>
+#include <fcntl.h>
+
+#include "k_vfs.h"
+#include "k_defs.h"
+#include "k_mem.hpp"
+
+class TMPFS : public BasicFS
+{
+  public:
+    ~TMPFS()
+    {
+        for (auto &f : _files)
+            _truncate(f.second, 0); // extents still mapped are leaked, they outlive the filesystem
+    }
+
+    int open(const char *path, int flags, int mode) override
+    {
+        _lock.lock();
+        auto it = _files.find(path);
+        if (it == _files.end())
+        {
+            if (!(flags & O_CREAT))
+            {
+                _lock.unlock();
+                return K_ENOENT;
+            }
+            it = _files.emplace(path, node_t()).first;
+        }
+        else if ((flags & O_CREAT) && (flags & O_EXCL))
+        {
+            _lock.unlock();
+            return K_EALREADY;
+        }
+
+        for (int i = 0; i < MAX_FILES; i++)
+        {
+            if (!_fcb[i].used)
+            {
+                if ((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY)
+                    _truncate(it->second, 0);
+                _fcb[i].used = true;
+                _fcb[i].node = &it->second;
+                _fcb[i].flags = flags;
+                _fcb[i].lpos = 0;
+                _lock.unlock();
+                return i;
+            }
+        }
+        _lock.unlock();
+        return K_ENOMEM;
+    }
+
+    int close(int fd) override
+    {
+        if (!_valid(fd))
+            return K_ENOENT;
+        _lock.lock();
+        _fcb[fd].used = false;
+        _fcb[fd].node = nullptr;
+        _fcb[fd].lpos = 0;
+        _lock.unlock();
+        return K_OK;
+    }
+
+    int read(int fd, void *buf, size_t count) override
+    {
+        if (!_valid(fd))
+            return K_ENOENT;
+        _lock.lock();
+        auto rc = _rw(*_fcb[fd].node, buf, count, _fcb[fd].lpos, false);
+        if (rc > 0)
+            _fcb[fd].lpos += rc;
+        _lock.unlock();
+        return rc;
+    }
+
+    int write(int fd, const void *buf, size_t count) override
+    {
+        if (!_valid(fd))
+            return K_ENOENT;
+        if ((_fcb[fd].flags & O_ACCMODE) == O_RDONLY)
+            return K_EDENIED;
+        _lock.lock();
+        if (_fcb[fd].flags & O_APPEND)
+            _fcb[fd].lpos = _fcb[fd].node->size;
+        auto rc = _rw(*_fcb[fd].node, (void *)buf, count, _fcb[fd].lpos, true);
+        if (rc > 0)
+            _fcb[fd].lpos += rc;
+        _lock.unlock();
+        return rc;
+    }
+
+    int preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset) override
+    {
+        return _rwv(fd, iov, iovcnt, offset, false);
+    }
+
+    int pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) override
+    {
+        if (_valid(fd) && (_fcb[fd].flags & O_ACCMODE) == O_RDONLY)
+            return K_EDENIED;
+        return _rwv(fd, iov, iovcnt, offset, true);
+    }
+
+    // Warm the extents of the range, holes have nothing to fetch
+    int readahead(int fd, off_t offset, size_t count) override
+    {
+        if (!_valid(fd))
+            return K_ENOENT;
+        if (offset < 0)
+            return K_EINVAL;
+        if (!_lock.try_lock())
+            return K_OK; // a hint, not worth waiting for
+        auto &n = *_fcb[fd].node;
+        size_t pos = offset, end = pos + count < n.size ? pos + count : n.size;
+        while (pos < end)
+        {
+            size_t off = pos % PAGE_SIZE;
+            size_t len = PAGE_SIZE - off < end - pos ? PAGE_SIZE - off : end - pos;
+            if (auto p = _page(n, pos / PAGE_SIZE, false))
+                _prefetch(p + off, len);
+            pos += len;
+        }
+        _lock.unlock();
+        return K_OK;
+    }
+
+    // Seeking past the end is allowed, the gap becomes a hole on the next write
+    int lseek(int fd, off_t offset, int whence) override
+    {
+        if (!_valid(fd))
+            return K_ENOENT;
+        off_t base = 0;
+        if (whence == SEEK_CUR)
+            base = _fcb[fd].lpos;
+        else if (whence == SEEK_END)
+            base = _fcb[fd].node->size;
+        else if (whence != SEEK_SET)
+            return K_EINVAL;
+        if (base + offset < 0)
+            return K_EINVAL;
+        _fcb[fd].lpos = base + offset;
+        return _fcb[fd].lpos;
+    }
+
+    int fstat(int fd, struct stat *buf) override
+    {
+        if (!_valid(fd))
+            return K_ENOENT;
+        _lock.lock();
+        _fill(*_fcb[fd].node, buf);
+        _lock.unlock();
+        return K_OK;
+    }
+
+    // Directories are implicit: any path prefix of a file is one
+    int stat(const char *path, struct stat *buf) override
+    {
+        _lock.lock();
+        auto it = _files.find(path);
+        if (it != _files.end())
+        {
+            _fill(it->second, buf);
+            _lock.unlock();
+            return K_OK;
+        }
+        bool dir = !*path || _isParent(path);
+        _lock.unlock();
+        if (!dir)
+            return K_ENOENT;
+        memset(buf, 0, sizeof(*buf));
+        buf->st_mode = S_IFDIR | 0777;
+        buf->st_nlink = 2;
+        buf->st_blksize = PAGE_SIZE;
+        return K_OK;
+    }
+
+    int opendir(const char *path) override
+    {
+        _lock.lock();
+        if (*path && !_isParent(path))
+        {
+            _lock.unlock();
+            return K_ENOENT;
+        }
+        for (int i = 0; i < MAX_DIRS; i++)
+        {
+            if (!_dcb[i].used)
+            {
+                _dcb[i].used = true;
+                _dcb[i].prefix = *path ? std::string(path) + "/" : "";
+                _dcb[i].resume = _dcb[i].prefix;
+                _lock.unlock();
+                return i;
+            }
+        }
+        _lock.unlock();
+        return K_ENOMEM;
+    }
+
+    // Resumes from a key rather than an iterator, files may come and go between calls
+    int readdir(int dd, dirent_t *dirp) override
+    {
+        if (dd >= MAX_DIRS || dd < 0 || !_dcb[dd].used)
+            return K_ENOENT;
+        auto &d = _dcb[dd];
+        _lock.lock();
+        for (auto it = _files.lower_bound(d.resume); it != _files.end(); ++it)
+        {
+            if (it->first.compare(0, d.prefix.size(), d.prefix) != 0)
+                break;
+            std::string_view name = std::string_view(it->first).substr(d.prefix.size());
+            auto slash = name.find('/');
+            if (name.empty() || (slash != std::string_view::npos ? slash : name.size()) >= sizeof(dirp->d_name))
+                continue;
+            if (slash != std::string_view::npos)
+            {
+                name = name.substr(0, slash);
+                d.resume = d.prefix + std::string(name) + char('/' + 1); // skip the rest of the subtree
+                dirp->d_mode = S_IFDIR;
+            }
+            else
+            {
+                d.resume = it->first + '\0';
+                dirp->d_mode = S_IFREG;
+            }
+            dirp->d_ino = slash == std::string_view::npos ? (ino_t)(uintptr_t)&it->second : 0;
+            memcpy(dirp->d_name, name.data(), name.size());
+            dirp->d_name[name.size()] = 0;
+            _lock.unlock();
+            return 1;
+        }
+        _lock.unlock();
+        return 0;
+    }
+
+    int closedir(int dd) override
+    {
+        if (dd >= MAX_DIRS || dd < 0 || !_dcb[dd].used)
+            return K_ENOENT;
+        _lock.lock();
+        _dcb[dd].used = false;
+        _dcb[dd].prefix.clear();
+        _dcb[dd].resume.clear();
+        _lock.unlock();
+        return K_OK;
+    }
+
+    int ftruncate(int fd, off_t length) override
+    {
+        if (!_valid(fd))
+            return K_ENOENT;
+        if (length < 0)
+            return K_EINVAL;
+        if ((_fcb[fd].flags & O_ACCMODE) == O_RDONLY)
+            return K_EDENIED;
+        _lock.lock();
+        _truncate(*_fcb[fd].node, length);
+        _lock.unlock();
+        return K_OK;
+    }
+
+    int getpage(int fd, off_t offset, uintptr_t *page) override
+    {
+        if (!_valid(fd))
+            return K_ENOENT;
+        if (offset < 0 || (offset & (PAGE_SIZE - 1)) || !page)
+            return K_EINVAL;
+        auto &n = *_fcb[fd].node;
+        size_t pg = offset / PAGE_SIZE;
+        _lock.lock();
+        auto p = _page(n, pg, true);
+        if (p)
+        {
+            auto &ext = std::prev(n.extents.upper_bound(pg))->second;
+            _pins.try_emplace(ext.base).first->second.maps++;
+        }
+        _lock.unlock();
+        if (!p)
+            return K_ENOMEM;
+        *page = (uintptr_t)p;
+        return K_OK;
+    }
+
+    int putpage(uintptr_t page) override
+    {
+        _lock.lock();
+        auto it = _pins.upper_bound((uint8_t *)page);
+        if (it == _pins.begin())
+        {
+            _lock.unlock();
+            return K_EINVAL;
+        }
+        --it;
+        if (--it->second.maps == 0)
+        {
+            if (it->second.dropped)
+                alignedFree(it->first);
+            _pins.erase(it);
+        }
+        _lock.unlock();
+        return K_OK;
+    }
+
+  private:
+    static constexpr int MAX_FILES = 1024;
+    static constexpr int MAX_DIRS = 64;
+    static constexpr size_t PAGE_SIZE = 4096;
+    static constexpr size_t MAX_EXTENT_PAGES = 64; // 256K per allocation at most
+
+    struct extent_t
+    {
+        uint8_t *base;
+        size_t npages;
+    };
+
+    struct node_t
+    {
+        size_t size = 0;
+        std::map<size_t, extent_t> extents; // first page index => extent
+    };
+
+    struct fcb_t
+    {
+        bool used = false;
+        node_t *node = nullptr;
+        int flags = 0;
+        unsigned long lpos = 0;
+    };
+
+    struct dcb_t
+    {
+        bool used = false;
+        std::string prefix; // "dir/", "" for the root
+        std::string resume; // first key not returned yet
+    };
+
+    // Extents with pages mapped somewhere, by base
+    struct pin_t
+    {
+        uint32_t maps = 0;    // getpage calls not matched by putpage yet
+        bool dropped = false; // truncated off its file, freed with the last putpage
+    };
+
+    std::map<std::string, node_t, std::less<>> _files;
+    std::map<uint8_t *, pin_t> _pins;
+    std::array<fcb_t, MAX_FILES> _fcb;
+    std::array<dcb_t, MAX_DIRS> _dcb;
+    lock_t _lock;
+
+    bool _valid(int fd)
+    {
+        return fd >= 0 && fd < MAX_FILES && _fcb[fd].used;
+    }
+
+    bool _isParent(const char *path)
+    {
+        std::string prefix = std::string(path) + "/";
+        auto it = _files.lower_bound(prefix);
+        return it != _files.end() && it->first.compare(0, prefix.size(), prefix) == 0;
+    }
+
+    void _fill(const node_t &n, struct stat *buf)
+    {
+        memset(buf, 0, sizeof(*buf));
+        buf->st_ino = (ino_t)(uintptr_t)&n;
+        buf->st_mode = S_IFREG | 0666;
+        buf->st_nlink = 1;
+        buf->st_size = n.size;
+        buf->st_blksize = PAGE_SIZE;
+        size_t pages = 0;
+        for (auto &e : n.extents)
+            pages += e.second.npages;
+        buf->st_blocks = pages * (PAGE_SIZE / 512);
+    }
+
+    // Find the page with index pg, or allocate it (with the following hole up to `want` pages) on demand
+    uint8_t *_page(node_t &n, size_t pg, bool alloc, size_t want = 1)
+    {
+        auto it = n.extents.upper_bound(pg);
+        if (it != n.extents.begin())
+        {
+            auto prev = std::prev(it);
+            if (pg < prev->first + prev->second.npages)
+                return prev->second.base + (pg - prev->first) * PAGE_SIZE;
+        }
+        if (!alloc)
+            return nullptr;
+
+        // Fill as much of the hole as the caller is going to touch with one allocation
+        size_t npages = want < MAX_EXTENT_PAGES ? want : MAX_EXTENT_PAGES;
+        if (!npages)
+            npages = 1;
+        if (it != n.extents.end() && pg + npages > it->first)
+            npages = it->first - pg;
+        auto base = alignedMalloc<uint8_t>(npages * PAGE_SIZE, PAGE_SIZE);
+        if (!base)
+            return nullptr;
+        memset(base, 0, npages * PAGE_SIZE);
+        n.extents.emplace(pg, extent_t{base, npages});
+        return base;
+    }
+
+    int _rw(node_t &n, void *buf, size_t count, size_t pos, bool wr)
+    {
+        if (!wr)
+        {
+            if (pos >= n.size)
+                return 0;
+            if (pos + count > n.size)
+                count = n.size - pos;
+        }
+        size_t done = 0;
+        while (done < count)
+        {
+            size_t pg = (pos + done) / PAGE_SIZE;
+            size_t off = (pos + done) % PAGE_SIZE;
+            size_t len = PAGE_SIZE - off < count - done ? PAGE_SIZE - off : count - done;
+            auto p = _page(n, pg, wr, (off + count - done + PAGE_SIZE - 1) / PAGE_SIZE);
+            if (wr)
+            {
+                if (!p)
+                    break;
+                memcpy(p + off, (uint8_t *)buf + done, len);
+            }
+            else if (p)
+                memcpy((uint8_t *)buf + done, p + off, len);
+            else
+                memset((uint8_t *)buf + done, 0, len); // hole
+            done += len;
+        }
+        if (wr && pos + done > n.size)
+            n.size = pos + done;
+        if (wr && !done && count)
+            return K_ENOMEM;
+        return done;
+    }
+
+    int _rwv(int fd, const struct iovec *iov, int iovcnt, off_t offset, bool wr)
+    {
+        if (!_valid(fd))
+            return K_ENOENT;
+        if (iovcnt < 0 || offset < 0)
+            return K_EINVAL;
+        int total = 0;
+        _lock.lock();
+        for (int i = 0; i < iovcnt; i++)
+        {
+            auto rc = _rw(*_fcb[fd].node, iov[i].iov_base, iov[i].iov_len, offset + total, wr);
+            if (rc < 0)
+            {
+                if (!total)
+                    total = rc;
+                break;
+            }
+            total += rc;
+            if ((size_t)rc < iov[i].iov_len)
+                break;
+        }
+        _lock.unlock();
+        return total;
+    }
+
+    void _truncate(node_t &n, size_t length)
+    {
+        size_t keep = (length + PAGE_SIZE - 1) / PAGE_SIZE; // pages still in use
+        for (auto it = n.extents.begin(); it != n.extents.end();)
+        {
+            auto &ext = it->second;
+            if (it->first >= keep)
+            {
+                auto pin = _pins.find(ext.base);
+                if (pin != _pins.end())
+                    pin->second.dropped = true; // still mapped
+                else
+                    alignedFree(ext.base);
+                it = n.extents.erase(it);
+                continue;
+            }
+            if (it->first + ext.npages > keep)
+                ext.npages = keep - it->first; // the tail stays allocated until the whole extent goes
+            ++it;
+        }
+        // Zero the rest of the last page, so that growing the file again reads zeros
+        if (length % PAGE_SIZE)
+        {
+            auto p = _page(n, length / PAGE_SIZE, false);
+            if (p)
+                memset(p + length % PAGE_SIZE, 0, PAGE_SIZE - length % PAGE_SIZE);
+        }
+        n.size = length;
+    }
+};
+
+// Register the filesystem
+FS_INSTALL_FUNC(K_PR_FS_BEGIN) static void fs_register()
+{
+    VirtualFS::registerFS(
+        "tmpfs",
+        [](const char *devicePath) -> std::pair<int, BasicFS *> {
+            using namespace std::string_view_literals;
+            if (!devicePath || (devicePath != "tmpfs"sv && devicePath != "none"sv))
+                return {K_ENOTSUPP, nullptr};
+            return {0, new TMPFS()};
+        },
+        [](BasicFS *fs) -> int {
+            delete fs;
+            return 0;
+        });
+    printf("FS TMPFS installed\n");
+}
@@ -0,0 +1,228 @@
+/**
+ * @file plic.cpp
+ * @brief RISC-V Platform-Level Interrupt Controller driver
+ *
+ * Only the S-mode context of each hart is used, the M-mode ones belong to the SBI.
+ */
+
+#include <string_view>
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+
+#include "k_irq.h"
+#include "k_lock.h"
+
+#include "sbi/riscv_io.h"
+
+#define PLIC_PRIORITY_BASE 0x0000
+#define PLIC_ENABLE_BASE 0x2000
+#define PLIC_ENABLE_STRIDE 0x80
+#define PLIC_CONTEXT_BASE 0x200000
+#define PLIC_CONTEXT_STRIDE 0x1000
+#define PLIC_CONTEXT_THRESHOLD 0x0
+#define PLIC_CONTEXT_CLAIM 0x4
+
+class Drv_Plic : public DriverIntc
+{
+  private:
+    struct action_t
+    {
+        irq_handler_t fn = nullptr;
+        void *ctx = nullptr;
+        unsigned long affinity = 0;
+    };
+
+    struct plic_t
+    {
+        char *base;
+        uint32_t ndev;
+        int sctx[K_CONFIG_MAX_PROCESSORS]; // S-mode context of each hart, -1 if none
+        std::vector<action_t> actions;     // indexed by source id, 0 is reserved
+        lock_t lock;                       // enable bits are read-modify-write
+    };
+
+    static uint32_t *enable_reg(plic_t &p, int ctx, uint32_t hwirq)
+    {
+        return (uint32_t *)(p.base + PLIC_ENABLE_BASE + ctx * PLIC_ENABLE_STRIDE + (hwirq / 32) * 4);
+    }
+
+    static char *context_reg(plic_t &p, int ctx, uint32_t off)
+    {
+        return p.base + PLIC_CONTEXT_BASE + ctx * PLIC_CONTEXT_STRIDE + off;
+    }
+
+    // Set the enable bit of hwirq for every hart in mask and clear it for the others, p.lock held
+    static void route(plic_t &p, uint32_t hwirq, unsigned long mask)
+    {
+        for (int h = 0; h < K_CONFIG_MAX_PROCESSORS; h++)
+        {
+            if (p.sctx[h] < 0)
+                continue;
+            auto reg = enable_reg(p, p.sctx[h], hwirq);
+            uint32_t v = readl(reg);
+            if (h < (int)sizeof(mask) * 8 && (mask >> h) & 1)
+                v |= 1U << (hwirq % 32);
+            else
+                v &= ~(1U << (hwirq % 32));
+            writel(v, reg);
+        }
+    }
+
+    plic_t *get(long handler)
+    {
+        return handler >= 0 && handler < (long)_plics.size() ? _plics[handler] : nullptr;
+    }
+
+  public:
+    int probe(const char *name, const char *compatible) override
+    {
+        using namespace std::string_view_literals;
+        return (compatible == "riscv,plic0"sv || compatible == "sifive,plic-1.0.0"sv) ? DRV_CAP_THIS : DRV_CAP_NONE;
+    }
+
+    long addDevice(const void *fdt, int node) override
+    {
+        uint64_t base, size;
+        int len;
+        if (fdt_get_node_addr_size(fdt, node, 0, &base, &size) < 0 || !base || !size)
+            return K_ENODEV;
+
+        auto val = (const fdt32_t *)fdt_getprop(fdt, node, "riscv,ndev", &len);
+        if (!val || len < (int)sizeof(fdt32_t))
+            return K_ENODEV;
+
+        auto p = new plic_t();
+        p->base = (char *)(base + 0xFFFFFFC000000000);
+        p->ndev = fdt32_to_cpu(*val);
+        p->actions.resize(p->ndev + 1);
+        for (auto &c : p->sctx)
+            c = -1;
+
+        // Context n is the n-th entry of interrupts-extended, pointing at a hart's local controller
+        struct fdt_phandle_args args;
+        for (int i = 0;; i++)
+        {
+            if (fdt_parse_phandle_with_args(fdt, node, "interrupts-extended", "#interrupt-cells", i, &args) < 0)
+                break;
+            if (args.args_count < 1 || args.args[0] != IRQ_S_EXT)
+                continue;
+            int cpu = fdt_parent_offset(fdt, args.node_offset);
+            auto reg = (const fdt32_t *)fdt_getprop(fdt, cpu, "reg", &len);
+            if (!reg)
+                continue;
+            uint32_t hart = fdt32_to_cpu(*reg);
+            if (hart < K_CONFIG_MAX_PROCESSORS)
+                p->sctx[hart] = i;
+        }
+
+        // Everything masked, threshold 0 so that any enabled source with a priority gets through
+        for (uint32_t id = 1; id <= p->ndev; id++)
+            writel(0, p->base + PLIC_PRIORITY_BASE + id * 4);
+        for (int h = 0; h < K_CONFIG_MAX_PROCESSORS; h++)
+        {
+            if (p->sctx[h] < 0)
+                continue;
+            for (uint32_t w = 0; w <= p->ndev / 32; w++)
+                writel(0, enable_reg(*p, p->sctx[h], w * 32));
+            writel(0, context_reg(*p, p->sctx[h], PLIC_CONTEXT_THRESHOLD));
+        }
+
+        _plics.push_back(p);
+        return _plics.size() - 1;
+    }
+
+    void removeDevice(long handler) override
+    {
+    }
+
+    int attach(long handler, uint32_t hwirq, irq_handler_t fn, void *ctx, uint32_t prio) override
+    {
+        auto p = get(handler);
+        if (!p)
+            return K_ENODEV;
+        if (!hwirq || hwirq > p->ndev || !fn || !prio)
+            return K_EINVAL;
+        p->lock.lock();
+        auto &act = p->actions[hwirq];
+        if (act.fn)
+        {
+            p->lock.unlock();
+            return K_EALREADY; // no shared lines
+        }
+        act.ctx = ctx;
+        act.fn = fn;
+        writel(prio, p->base + PLIC_PRIORITY_BASE + hwirq * 4);
+        p->lock.unlock();
+        return K_OK;
+    }
+
+    int detach(long handler, uint32_t hwirq) override
+    {
+        auto p = get(handler);
+        if (!p)
+            return K_ENODEV;
+        if (!hwirq || hwirq > p->ndev)
+            return K_EINVAL;
+        p->lock.lock();
+        route(*p, hwirq, 0);
+        writel(0, p->base + PLIC_PRIORITY_BASE + hwirq * 4);
+        p->actions[hwirq] = action_t();
+        p->lock.unlock();
+        return K_OK;
+    }
+
+    int setAffinity(long handler, uint32_t hwirq, unsigned long mask) override
+    {
+        auto p = get(handler);
+        if (!p)
+            return K_ENODEV;
+        if (!hwirq || hwirq > p->ndev)
+            return K_EINVAL;
+        p->lock.lock();
+        p->actions[hwirq].affinity = mask;
+        route(*p, hwirq, mask);
+        p->lock.unlock();
+        return K_OK;
+    }
+
+    int setThreshold(long handler, int hart, uint32_t threshold) override
+    {
+        auto p = get(handler);
+        if (!p)
+            return K_ENODEV;
+        if (hart < 0 || hart >= K_CONFIG_MAX_PROCESSORS || p->sctx[hart] < 0)
+            return K_EINVAL;
+        writel(threshold, context_reg(*p, p->sctx[hart], PLIC_CONTEXT_THRESHOLD));
+        return K_OK;
+    }
+
+    // Claim until the context has nothing pending, so back-to-back IRQs cost one trap
+    int dispatch(long handler, int hart) override
+    {
+        auto p = get(handler);
+        if (!p || hart < 0 || hart >= K_CONFIG_MAX_PROCESSORS || p->sctx[hart] < 0)
+            return 0;
+        auto claim = context_reg(*p, p->sctx[hart], PLIC_CONTEXT_CLAIM);
+        int n = 0;
+        uint32_t id;
+        while ((id = readl(claim)) != 0)
+        {
+            if (id <= p->ndev && p->actions[id].fn)
+                p->actions[id].fn(p->actions[id].ctx);
+            writel(id, claim);
+            n++;
+        }
+        return n;
+    }
+
+  private:
+    std::vector<plic_t *> _plics;
+};
+
+static DRV_INSTALL_FUNC(300) void drv_register()
+{
+    static Drv_Plic drv;
+    DriverManager::addDriver(drv);
+    printf("Driver PLIC installed\n");
+}
@@ -0,0 +1,347 @@
+#include <new>
+
+#include "k_main.h"
+#include "k_sysdev.h"
+#include "k_mem.hpp"
+#include "k_lock.h"
+#include "k_trace.h"
+
+/**
+ * @brief Earliest deadline first, selected with -use-scheduler-edf
+ *
+ * Deadline tasks (task_t::dl set through setDeadline) always run before the others, which are handed to the
+ * K_CONFIG_SCHED_DL_LOWER scheduler. Among them the earliest absolute deadline wins.
+ * Admission control keeps the sum of runtime / period of each hart under K_CONFIG_SCHED_DL_UTIL_PCT.
+ * Budgets are enforced as a hard constant bandwidth server: a job that used up its runtime is throttled until
+ * its deadline and comes back with a fresh budget and a deadline one relative deadline later. A task waking up
+ * with more budget left than its bandwidth allows before the deadline gets a fresh budget and deadline.
+ * Releases and budget ends are timer events (nextEvent), so they preempt through the timer ISR without waiting
+ * for a scheduler tick. Deadline tasks stay on their hart.
+ */
+class DeadlineScheduler : public SysScheduler
+{
+  public:
+    int probe(const char *name, const char *compatible) override
+    {
+        if (strcmp(name, "scheduler-edf") == 0 && strcmp(compatible, "sys,scheduler") == 0)
+            return DRV_CAP_THIS;
+        return DRV_CAP_NONE;
+    }
+
+    // node must be the hart id, it is also the handle, the same as the one of the lower scheduler
+    long addDevice(const void *fdt, int node) override
+    {
+        if (node < 0 || node >= K_CONFIG_MAX_PROCESSORS)
+            return K_EINVAL;
+        if (_rq[node])
+            return K_EALREADY;
+        if (!_lower)
+            _lower = (SysScheduler *)DriverManager::getDriverByProbe(K_CONFIG_SCHED_DL_LOWER, "sys,scheduler");
+        if (!_lower || _lower == this)
+            return K_ENODEV;
+        auto rc = _lower->addDevice(fdt, node);
+        if (rc != node)
+            return rc < 0 ? rc : K_EINVAL;
+        auto mem = alignedMalloc<void>(sizeof(runq_t), alignof(runq_t));
+        if (!mem)
+        {
+            _lower->removeDevice(node);
+            return K_ENOMEM;
+        }
+        _rq[node] = new (mem) runq_t();
+        return node;
+    }
+
+    void removeDevice(long handler) override
+    {
+        if (!_valid(handler))
+            return;
+        auto rq = _rq[handler];
+        _rq[handler] = nullptr;
+        rq->~runq_t();
+        alignedFree(rq);
+        _lower->removeDevice(handler);
+    }
+
+    int addTask(long hdl, task_t *task) override
+    {
+        if (!_valid(hdl))
+            return K_EINVAL;
+        if (!_isDl(task))
+            return _lower->addTask(hdl, task);
+
+        auto &rq = *_rq[hdl];
+        auto dl = task->dl;
+        uint64_t now = csr_read(CSR_TIME);
+        rq.lock.lock();
+        if (dl->done)
+        {
+            // Next job one period after the current one, released right away when it is already late
+            dl->done = false;
+            dl->started = false;
+            if (now > dl->abs_deadline)
+                dl->misses++;
+            dl->release += dl->period;
+            rq.throttledq.insert(task);
+        }
+        else if (dl->throttled)
+        {
+            dl->throttled = false;
+            dl->release = dl->abs_deadline;
+            rq.throttledq.insert(task);
+        }
+        else
+        {
+            // Not coming back from a preemption (still on_cpu) but from a wakeup: CBS admission of the remaining
+            // budget, the task may not use more than its bandwidth until the deadline
+            if (!task->on_cpu &&
+                (now >= dl->abs_deadline || dl->budget * dl->period > (dl->abs_deadline - now) * dl->runtime))
+                _replenish(dl, now);
+            rq.ready.insert(task);
+        }
+        rq.lock.unlock();
+        K_TRACE(sched_add, hdl, task->tid, task->priority);
+        return K_OK;
+    }
+
+    int removeTask(long hdl, task_t *task) override
+    {
+        if (!_valid(hdl))
+            return K_EINVAL;
+        auto &rq = *_rq[hdl];
+        rq.lock.lock();
+        int rc = K_EALREADY;
+        if (rq.ready.contains(task))
+            rq.ready.erase(task), rc = K_OK;
+        else if (rq.throttledq.contains(task))
+            rq.throttledq.erase(task), rc = K_OK;
+        rq.lock.unlock();
+        if (rc == K_EALREADY)
+            return _lower->removeTask(hdl, task);
+        K_TRACE(sched_remove, hdl, task->tid);
+        return rc;
+    }
+
+    task_t *pickNext(long hdl) override
+    {
+        if (!_valid(hdl))
+            return nullptr;
+        auto &rq = *_rq[hdl];
+        uint64_t now = csr_read(CSR_TIME);
+        rq.lock.lock();
+        _update(rq, now);
+        auto curr = rq.curr;
+        auto best = rq.ready.first();
+        if (curr && _isDl(curr) && !_stopped(curr) && (!best || !deadline_less()(*best, *curr)))
+        {
+            rq.lock.unlock();
+            return nullptr; // still the earliest deadline
+        }
+        if (best)
+        {
+            rq.ready.erase(best);
+            rq.curr = best;
+            rq.exec_start = now;
+            auto dl = best->dl;
+            if (!dl->started)
+            {
+                auto jitter = now > dl->release ? now - dl->release : 0;
+                dl->started = true;
+                dl->jobs++;
+                dl->jitter_sum += jitter;
+                if (jitter > dl->jitter_max)
+                    dl->jitter_max = jitter;
+            }
+            rq.lock.unlock();
+            return best;
+        }
+        rq.lock.unlock();
+        auto t = _lower->pickNext(hdl);
+        if (t)
+            rq.curr = t;
+        return t;
+    }
+
+    bool tick(long hdl, task_t *curr) override
+    {
+        if (!_valid(hdl))
+            return true;
+        auto &rq = *_rq[hdl];
+        if (_isDl(curr))
+        {
+            curr->ticks++;
+            rq.lock.lock();
+            _update(rq, csr_read(CSR_TIME));
+            bool resched = _stopped(curr) || (rq.ready.first() && deadline_less()(*rq.ready.first(), *curr));
+            rq.lock.unlock();
+            return resched;
+        }
+        if (!rq.ready.empty())
+            return true;
+        return _lower->tick(hdl, curr);
+    }
+
+    // Throttled deadline tasks are not waiting, their release is a timer event
+    size_t queued(long hdl) override
+    {
+        if (!_valid(hdl))
+            return 0;
+        return _rq[hdl]->ready.size() + _lower->queued(hdl);
+    }
+
+    bool stealsWork() override
+    {
+        return _lower->stealsWork();
+    }
+
+    bool throttled(long hdl, task_t *curr) override
+    {
+        return _isDl(curr) && _stopped(curr);
+    }
+
+    uint64_t nextEvent(long hdl) override
+    {
+        if (!_valid(hdl))
+            return 0;
+        auto &rq = *_rq[hdl];
+        rq.lock.lock();
+        uint64_t ev = 0;
+        if (auto t = rq.throttledq.first())
+            ev = t->dl->release;
+        if (rq.curr && _isDl(rq.curr) && !_stopped(rq.curr))
+        {
+            uint64_t end = rq.exec_start + rq.curr->dl->budget;
+            if (!ev || end < ev)
+                ev = end;
+        }
+        rq.lock.unlock();
+        return ev;
+    }
+
+    int setDeadline(long hdl, task_t *task, uint64_t runtime, uint64_t deadline, uint64_t period) override
+    {
+        if (!_valid(hdl) || !task->dl)
+            return K_EINVAL;
+        if (runtime && (runtime > deadline || deadline > period))
+            return K_EINVAL;
+        auto &rq = *_rq[hdl];
+        auto dl = task->dl;
+        uint64_t now = csr_read(CSR_TIME);
+        uint64_t old = dl->runtime ? _util(dl->runtime, dl->period) : 0;
+        uint64_t util = runtime ? _util(runtime, period) : 0;
+        rq.lock.lock();
+        if (rq.util - old + util > _util(K_CONFIG_SCHED_DL_UTIL_PCT, 100))
+        {
+            rq.lock.unlock();
+            return K_ENOSPC;
+        }
+        rq.util = rq.util - old + util;
+        dl->runtime = runtime;
+        dl->deadline = deadline;
+        dl->period = period;
+        dl->throttled = dl->done = false;
+        dl->release = now;
+        _replenish(dl, now);
+        rq.curr = task; // the caller, a boot task may not have been picked so far
+        rq.exec_start = now;
+        dl->started = true;
+        dl->jobs++;
+        rq.lock.unlock();
+        return K_OK;
+    }
+
+  private:
+    struct deadline_less
+    {
+        bool operator()(const task_t &a, const task_t &b) const
+        {
+            return (int64_t)(a.dl->abs_deadline - b.dl->abs_deadline) < 0;
+        }
+    };
+
+    struct release_less
+    {
+        bool operator()(const task_t &a, const task_t &b) const
+        {
+            return (int64_t)(a.dl->release - b.dl->release) < 0;
+        }
+    };
+
+    struct alignas(64) runq_t
+    {
+        lock_t lock;
+        RBTree<task_t, &task_t::rb, deadline_less> ready;
+        RBTree<task_t, &task_t::rb, release_less> throttledq; // throttled or done, by release time
+        task_t *curr = nullptr;                                // picked last, any class
+        uint64_t exec_start = 0;
+        uint64_t util = 0; // admitted bandwidth, 1 << 20 is one hart
+    };
+
+    SysScheduler *_lower = nullptr;
+    runq_t *_rq[K_CONFIG_MAX_PROCESSORS] = {}; // filled before the harts start
+
+    bool _valid(long hdl) const
+    {
+        return hdl >= 0 && hdl < K_CONFIG_MAX_PROCESSORS && _rq[hdl];
+    }
+
+    static uint64_t _util(uint64_t runtime, uint64_t period)
+    {
+        return (runtime << 20) / period;
+    }
+
+    static bool _isDl(const task_t *t)
+    {
+        return t->dl && t->dl->runtime;
+    }
+
+    static bool _stopped(const task_t *t)
+    {
+        return t->dl->throttled || t->dl->done;
+    }
+
+    static void _replenish(dl_t *dl, uint64_t now)
+    {
+        dl->budget = dl->runtime;
+        dl->abs_deadline = now + dl->deadline;
+    }
+
+    // Charge the running deadline task and release the throttled ones that are due, locked
+    static void _update(runq_t &rq, uint64_t now)
+    {
+        auto curr = rq.curr;
+        if (curr && curr->state != TASK_RUNNING)
+            rq.curr = curr = nullptr; // blocked or exited
+        if (curr && _isDl(curr) && !_stopped(curr))
+        {
+            auto dl = curr->dl;
+            auto used = now - rq.exec_start;
+            dl->budget = used < dl->budget ? dl->budget - used : 0;
+            if (!dl->budget)
+            {
+                dl->throttled = true;
+                if (now > dl->abs_deadline)
+                    dl->misses++;
+            }
+        }
+        rq.exec_start = now;
+
+        while (auto t = rq.throttledq.first())
+        {
+            auto dl = t->dl;
+            if ((int64_t)(dl->release - now) > 0)
+                break;
+            rq.throttledq.erase(t);
+            dl->budget = dl->runtime;
+            dl->abs_deadline = dl->release + dl->deadline;
+            rq.ready.insert(t);
+        }
+    }
+};
+
+DRV_INSTALL_FUNC(K_PR_DEV_SYSSCHED_END) static void drv_install()
+{
+    static DeadlineScheduler scheduler;
+    DriverManager::addDriver(scheduler);
+    printf("Scheduler EDF installed\n");
+}
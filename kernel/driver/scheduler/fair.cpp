@@ -0,0 +1,211 @@
+#include <new>
+
+#include "k_main.h"
+#include "k_sysdev.h"
+#include "k_mem.hpp"
+#include "k_lock.h"
+#include "k_trace.h"
+
+/**
+ * @brief Fair share scheduler, selected with -use-scheduler-fair
+ *
+ * Every hart keeps its runnable tasks in a red-black tree ordered by virtual runtime: CSR_TIME ticks spent running,
+ * scaled by NICE_0 / weight. The leftmost task runs next. task_t::priority is a nice value with the sign flipped
+ * (clamped to [-19, 20]), each step is worth ~1.25x of CPU share as on Linux.
+ * A task that slept is placed at most K_CONFIG_SCHED_FAIR_LATENCY_US / 2 behind the hart's min_vruntime, so
+ * interactive tasks run soon after a wakeup without being able to bank credit while blocked.
+ * Tasks do not migrate, they stay on the hart they were created for.
+ */
+class FairScheduler : public SysScheduler
+{
+  public:
+    int probe(const char *name, const char *compatible) override
+    {
+        if (strcmp(name, "scheduler-fair") == 0 && strcmp(compatible, "sys,scheduler") == 0)
+            return DRV_CAP_THIS;
+        return DRV_CAP_NONE;
+    }
+
+    // node must be the hart id, it is also the handle
+    long addDevice(const void *fdt, int node) override
+    {
+        (void)fdt;
+        if (node < 0 || node >= K_CONFIG_MAX_PROCESSORS)
+            return K_EINVAL;
+        if (_rq[node])
+            return K_EALREADY;
+        auto mem = alignedMalloc<void>(sizeof(runq_t), alignof(runq_t));
+        if (!mem)
+            return K_ENOMEM;
+        _rq[node] = new (mem) runq_t();
+        return node;
+    }
+
+    void removeDevice(long handler) override
+    {
+        if (!_valid(handler))
+            return;
+        auto rq = _rq[handler];
+        _rq[handler] = nullptr;
+        rq->~runq_t();
+        alignedFree(rq);
+    }
+
+    int addTask(long hdl, task_t *task) override
+    {
+        if (!_valid(hdl))
+            return K_EINVAL;
+        auto &rq = *_rq[hdl];
+        rq.lock.lock();
+        if (!task->ticks && !task->vruntime)
+            task->vruntime = rq.min_vruntime; // new task, no credit
+        else
+        {
+            uint64_t credit = _cycles(K_CONFIG_SCHED_FAIR_LATENCY_US) / 2;
+            uint64_t floor = rq.min_vruntime > credit ? rq.min_vruntime - credit : 0;
+            if (task->vruntime < floor)
+                task->vruntime = floor;
+        }
+        rq.tree.insert(task);
+        rq.lock.unlock();
+        K_TRACE(sched_add, hdl, task->tid, task->priority);
+        return K_OK;
+    }
+
+    int removeTask(long hdl, task_t *task) override
+    {
+        if (!_valid(hdl))
+            return K_EINVAL;
+        auto &rq = *_rq[hdl];
+        rq.lock.lock();
+        if (!rq.tree.contains(task))
+        {
+            rq.lock.unlock();
+            return K_EALREADY;
+        }
+        rq.tree.erase(task);
+        rq.lock.unlock();
+        K_TRACE(sched_remove, hdl, task->tid);
+        return K_OK;
+    }
+
+    task_t *pickNext(long hdl) override
+    {
+        if (!_valid(hdl))
+            return nullptr;
+        auto &rq = *_rq[hdl];
+        uint64_t now = csr_read(CSR_TIME);
+        rq.lock.lock();
+        if (rq.curr)
+        {
+            _charge(rq, rq.curr, now);
+            if (rq.curr->state != TASK_RUNNING) // blocked or exited, not on the hart any more
+                rq.curr = nullptr;
+        }
+        auto t = rq.tree.first();
+        if (t)
+        {
+            rq.tree.erase(t);
+            rq.curr = t;
+            rq.exec_start = now;
+        }
+        _updateMin(rq);
+        rq.lock.unlock();
+        return t;
+    }
+
+    // Give the hart up once a queued task is K_CONFIG_SCHED_FAIR_GRAN_US of weighted run time behind
+    bool tick(long hdl, task_t *curr) override
+    {
+        curr->ticks++;
+        if (!_valid(hdl))
+            return true;
+        auto &rq = *_rq[hdl];
+        if (rq.curr != curr) // boot task, never picked so far
+            return true;
+        rq.lock.lock();
+        _charge(rq, curr, csr_read(CSR_TIME));
+        _updateMin(rq);
+        auto first = rq.tree.first();
+        bool resched = first && curr->vruntime > first->vruntime + _cycles(K_CONFIG_SCHED_FAIR_GRAN_US);
+        rq.lock.unlock();
+        return resched;
+    }
+
+    size_t queued(long hdl) override
+    {
+        return _valid(hdl) ? _rq[hdl]->tree.size() : 0;
+    }
+
+  private:
+    static constexpr uint64_t NICE_0 = 1024;
+
+    // Linux sched_prio_to_weight, index is nice + 20
+    static constexpr uint32_t _weights[40] = {
+        88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705, 14949, 11916, 9548, 7620, 6100, 4904,
+        3906,  3121,  2501,  1991,  1586,  1277,  1024,  820,   655,   526,   423,   335,  272,  215,
+        172,   137,   110,   87,    70,    56,    45,    36,    29,    23,    18,    15};
+
+    struct vruntime_less
+    {
+        bool operator()(const task_t &a, const task_t &b) const
+        {
+            return (int64_t)(a.vruntime - b.vruntime) < 0;
+        }
+    };
+
+    struct alignas(64) runq_t
+    {
+        lock_t lock;
+        RBTree<task_t, &task_t::rb, vruntime_less> tree;
+        uint64_t min_vruntime = 0; // never goes back, new and woken tasks are placed against it
+        task_t *curr = nullptr;    // picked last, charged on the next pick or tick
+        uint64_t exec_start = 0;
+    };
+
+    runq_t *_rq[K_CONFIG_MAX_PROCESSORS] = {}; // filled before the harts start
+
+    bool _valid(long hdl) const
+    {
+        return hdl >= 0 && hdl < K_CONFIG_MAX_PROCESSORS && _rq[hdl];
+    }
+
+    static uint64_t _cycles(uint64_t us)
+    {
+        return k_cpuclock * us / 1000000;
+    }
+
+    static uint64_t _weight(const task_t *t)
+    {
+        int nice = -t->priority;
+        nice = nice < -20 ? -20 : nice > 19 ? 19 : nice;
+        return _weights[nice + 20];
+    }
+
+    static void _charge(runq_t &rq, task_t *t, uint64_t now)
+    {
+        t->vruntime += (now - rq.exec_start) * NICE_0 / _weight(t);
+        rq.exec_start = now;
+    }
+
+    static void _updateMin(runq_t &rq)
+    {
+        auto first = rq.tree.first();
+        uint64_t v = rq.min_vruntime;
+        if (rq.curr && first)
+            v = vruntime_less()(*rq.curr, *first) ? rq.curr->vruntime : first->vruntime;
+        else if (rq.curr)
+            v = rq.curr->vruntime;
+        else if (first)
+            v = first->vruntime;
+        if ((int64_t)(v - rq.min_vruntime) > 0)
+            rq.min_vruntime = v;
+    }
+};
+
+DRV_INSTALL_FUNC(K_PR_DEV_SYSSCHED_END) static void drv_install()
+{
+    static FairScheduler scheduler;
+    DriverManager::addDriver(scheduler);
+    printf("Scheduler Fair installed\n");
+}
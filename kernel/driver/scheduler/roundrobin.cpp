@@ -1,7 +1,20 @@
-#include <map>
+#include <new>
+#include <atomic>
 
+#include "k_main.h"
 #include "k_sysdev.h"
+#include "k_mem.hpp"
+#include "k_trace.h"
 
+/**
+ * @brief Round robin over per-hart run queues
+ *
+ * Every hart owns a lock-free ring of K_CONFIG_SCHED_RUNQ tasks: only the owner pushes at tail, the owner and
+ * thieves take from head with a CAS. Overflow goes to a private spill list of the owner, tasks queued from other
+ * harts (wakeups, k_thread_create on another hart) land in an MPSC inbox the owner drains on pickNext.
+ * A hart without work steals half of the ring of the busiest peer, and every K_CONFIG_SCHED_BALANCE_TICKS the
+ * tick pulls from a peer that has at least 2 tasks more. Both respect task_t::affinity.
+ */
 class RoundRobinScheduler : public SysScheduler
 {
   public:
@@ -12,54 +25,279 @@ class RoundRobinScheduler : public SysScheduler
         return DRV_CAP_NONE;
     }
 
-    // node should be the hart id
+    // node must be the hart id, it is also the handle
     long addDevice(const void *fdt, int node) override
     {
         (void)fdt;
-        _taskgroups[_hdl_count] = taskgroup_t();
-        return _hdl_count++;
+        if (node < 0 || node >= K_CONFIG_MAX_PROCESSORS)
+            return K_EINVAL;
+        if (_rq[node])
+            return K_EALREADY;
+        auto mem = alignedMalloc<void>(sizeof(runq_t), alignof(runq_t));
+        if (!mem)
+            return K_ENOMEM;
+        _rq[node] = new (mem) runq_t();
+        return node;
     }
 
     void removeDevice(long handler) override
     {
-        _taskgroups.erase(handler);
+        if (!_valid(handler))
+            return;
+        auto rq = _rq[handler];
+        _rq[handler] = nullptr;
+        rq->~runq_t();
+        alignedFree(rq);
     }
 
-    uint32_t addTask(long hdl, const task_t &task) override
+    int addTask(long hdl, task_t *task) override
     {
-        auto tg = _taskgroups.find(hdl);
-        if(tg == _taskgroups.end())
-            return 0;
-        if(tg->second.tasks.size() == (uint32_t)-1) // already full
-            return 0;
-        while( tg->second.tasks.find(tg->second.next_task_id) != tg->second.tasks.end()){
-            tg->second.next_task_id++; // until found an empty slot
-        }
-        tg->second.tasks[tg->second.next_task_id] = task;
-        return tg->second.next_task_id++;
+        if (!_valid(hdl))
+            return K_EINVAL;
+        if (k_current_hart() == hdl)
+            _push(*_rq[hdl], task);
+        else
+            _post(*_rq[hdl], task);
+        K_TRACE(sched_add, hdl, task->tid, task->priority);
+        return K_OK;
     }
 
-    int removeTask(long hdl, uint32_t task_id) override
+    // Tasks sitting in a ring can not be taken out of the middle, only spilled ones of the calling hart can
+    int removeTask(long hdl, task_t *task) override
     {
-        auto tg = _taskgroups.find(hdl);
-        if(tg == _taskgroups.end())
+        if (!_valid(hdl) || k_current_hart() != hdl)
             return K_EINVAL;
-        auto task = tg->second.tasks.find(task_id);
-        if(task == tg->second.tasks.end())
-            return K_EALREADY;
-        tg->second.tasks.erase(task);
-        return 0;
+        auto &rq = *_rq[hdl];
+        task_t *prev = nullptr;
+        for (auto t = rq.spill_head; t; prev = t, t = t->next)
+        {
+            if (t != task)
+                continue;
+            (prev ? prev->next : rq.spill_head) = t->next;
+            if (rq.spill_tail == t)
+                rq.spill_tail = prev;
+            K_TRACE(sched_remove, hdl, task->tid);
+            return K_OK;
+        }
+        return K_EALREADY;
+    }
+
+    task_t *pickNext(long hdl) override
+    {
+        if (!_valid(hdl))
+            return nullptr;
+        auto &rq = *_rq[hdl];
+        _drainInbox(rq);
+        while (auto t = _pop(rq))
+        {
+            if (_allowed(t, hdl))
+                return t;
+            _forward(t); // affinity changed while it was queued here
+        }
+        return _steal(hdl, true);
+    }
+
+    // Every task runs for a slice of K_CONFIG_SCHED_RR_SLICE ticks
+    bool tick(long hdl, task_t *curr) override
+    {
+        if (_valid(hdl) && ++_rq[hdl]->balance % K_CONFIG_SCHED_BALANCE_TICKS == 0)
+            _steal(hdl, false);
+        return ++curr->ticks % K_CONFIG_SCHED_RR_SLICE == 0;
+    }
+
+    size_t queued(long hdl) override
+    {
+        if (!_valid(hdl))
+            return 0;
+        auto &rq = *_rq[hdl];
+        return rq.size() + (rq.spill_head != nullptr) + (rq.inbox.load(std::memory_order_relaxed) != nullptr);
+    }
+
+    bool stealsWork() override
+    {
+        return true;
     }
 
   private:
-    long _hdl_count = 0;
-    struct taskgroup_t
+    static constexpr uint32_t N = K_CONFIG_SCHED_RUNQ;
+    static constexpr uint32_t STEAL_BATCH = 16; // bounded, a steal may run on a thread stack from the timer ISR
+    static_assert(N && (N & (N - 1)) == 0, "K_CONFIG_SCHED_RUNQ must be a power of 2");
+
+    struct runq_t
     {
-        uint32_t next_task_id = 1;
-        std::map<uint32_t, task_t> tasks;
+        alignas(64) std::atomic<uint32_t> head = 0; // owner and thieves, CAS
+        alignas(64) std::atomic<uint32_t> tail = 0; // owner only
+        std::atomic<task_t *> inbox = nullptr;      // LIFO pushed by other harts, linked through next
+        task_t *spill_head = nullptr;               // owner only, FIFO behind the ring
+        task_t *spill_tail = nullptr;
+        uint32_t balance = 0;
+        alignas(64) std::atomic<task_t *> slots[N] = {};
+
+        uint32_t size() const
+        {
+            return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+        }
     };
 
-    std::map<long, taskgroup_t> _taskgroups;
+    runq_t *_rq[K_CONFIG_MAX_PROCESSORS] = {}; // filled before the harts start
+
+    bool _valid(long hdl) const
+    {
+        return hdl >= 0 && hdl < K_CONFIG_MAX_PROCESSORS && _rq[hdl];
+    }
+
+    static bool _allowed(const task_t *t, long hart)
+    {
+        return !t->affinity || (t->affinity & (1UL << hart));
+    }
+
+    // Owner side: ring first, the spill list once it is full or not empty (keeps FIFO order)
+    static void _push(runq_t &rq, task_t *t)
+    {
+        auto tl = rq.tail.load(std::memory_order_relaxed);
+        if (!rq.spill_head && tl - rq.head.load(std::memory_order_acquire) < N)
+        {
+            rq.slots[tl & (N - 1)].store(t, std::memory_order_relaxed);
+            rq.tail.store(tl + 1, std::memory_order_release);
+            return;
+        }
+        t->next = nullptr;
+        if (rq.spill_tail)
+            rq.spill_tail->next = t;
+        else
+            rq.spill_head = t;
+        rq.spill_tail = t;
+    }
+
+    // Owner side
+    static task_t *_pop(runq_t &rq)
+    {
+        while (true)
+        {
+            auto h = rq.head.load(std::memory_order_acquire);
+            if (h == rq.tail.load(std::memory_order_relaxed))
+                break;
+            auto t = rq.slots[h & (N - 1)].load(std::memory_order_relaxed);
+            if (rq.head.compare_exchange_weak(h, h + 1, std::memory_order_release, std::memory_order_relaxed))
+                return t;
+        }
+        // Ring is empty, refill it from the spill list
+        auto t = rq.spill_head;
+        if (!t)
+            return nullptr;
+        rq.spill_head = t->next;
+        if (!rq.spill_head)
+            rq.spill_tail = nullptr;
+        auto tl = rq.tail.load(std::memory_order_relaxed);
+        while (rq.spill_head && tl - rq.head.load(std::memory_order_acquire) < N)
+        {
+            rq.slots[tl++ & (N - 1)].store(rq.spill_head, std::memory_order_relaxed);
+            rq.spill_head = rq.spill_head->next;
+        }
+        if (!rq.spill_head)
+            rq.spill_tail = nullptr;
+        rq.tail.store(tl, std::memory_order_release);
+        return t;
+    }
+
+    // Any hart
+    static void _post(runq_t &rq, task_t *t)
+    {
+        auto old = rq.inbox.load(std::memory_order_relaxed);
+        do
+            t->next = old;
+        while (!rq.inbox.compare_exchange_weak(old, t, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    // Owner side: move the inbox into the queue in arrival order
+    static void _drainInbox(runq_t &rq)
+    {
+        auto t = rq.inbox.exchange(nullptr, std::memory_order_acquire);
+        task_t *fifo = nullptr;
+        while (t)
+        {
+            auto next = t->next;
+            t->next = fifo;
+            fifo = t;
+            t = next;
+        }
+        while (fifo)
+        {
+            auto next = fifo->next;
+            _push(rq, fifo);
+            fifo = next;
+        }
+    }
+
+    // Hand a task to the first hart it may run on
+    void _forward(task_t *t)
+    {
+        for (long h = 0; h < K_CONFIG_MAX_PROCESSORS; h++)
+        {
+            if (_rq[h] && _allowed(t, h))
+            {
+                t->hart = h;
+                _post(*_rq[h], t);
+                return;
+            }
+        }
+        t->affinity = 0; // no hart left, let it run anywhere
+        _post(*_rq[k_current_hart()], t);
+    }
+
+    // Take half of the ring of the busiest peer. Idle (pickNext) steals from any non empty peer and returns one
+    // of the tasks, balancing only from a peer at least 2 tasks longer and queues all of them locally.
+    task_t *_steal(long thief, bool idle)
+    {
+        auto &rq = *_rq[thief];
+        uint32_t mine = rq.size(), best = 0;
+        long victim = -1;
+        for (long h = 0; h < K_CONFIG_MAX_PROCESSORS; h++)
+        {
+            if (h == thief || !_rq[h])
+                continue;
+            auto n = _rq[h]->size();
+            if (n > best)
+                best = n, victim = h;
+        }
+        if (victim < 0 || (!idle && best < mine + 2))
+            return nullptr;
+
+        auto &v = *_rq[victim];
+        task_t *batch[STEAL_BATCH];
+        uint32_t n;
+        while (true)
+        {
+            auto h = v.head.load(std::memory_order_acquire);
+            auto tl = v.tail.load(std::memory_order_acquire);
+            n = tl - h;
+            if (n > N || (!idle && n < mine + 2))
+                return nullptr;
+            n = idle ? n - n / 2 : (n - mine) / 2;
+            if (n == 0)
+                return nullptr;
+            n = n < STEAL_BATCH ? n : STEAL_BATCH;
+            for (uint32_t i = 0; i < n; i++)
+                batch[i] = v.slots[(h + i) & (N - 1)].load(std::memory_order_relaxed);
+            // The owner does not reuse these slots before head moves past them, a changed head means retry
+            if (v.head.compare_exchange_weak(h, h + n, std::memory_order_acq_rel, std::memory_order_relaxed))
+                break;
+        }
+
+        task_t *ret = nullptr;
+        for (uint32_t i = 0; i < n; i++)
+        {
+            auto t = batch[i];
+            if (!_allowed(t, thief) || !t->stack)
+                _post(v, t); // pinned elsewhere or a boot task, give it back
+            else if (idle && !ret)
+                ret = t;
+            else
+                _push(rq, t);
+        }
+        K_TRACE(sched_steal, victim, thief, n);
+        return ret;
+    }
 };
 
 DRV_INSTALL_FUNC(K_PR_DEV_SYSSCHED_END) static void drv_install()
@@ -67,4 +305,4 @@ DRV_INSTALL_FUNC(K_PR_DEV_SYSSCHED_END) static void drv_install()
     static RoundRobinScheduler scheduler;
     DriverManager::addDriver(scheduler);
     printf("Scheduler RoundRobin installed\n");
-}
\ No newline at end of file
+}
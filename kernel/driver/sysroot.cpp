@@ -97,7 +97,7 @@ class GenericRoot : public SysRoot
                             if (rc)
                             {
                                 _scheduler = (SysScheduler *)rc;
-                                printf("[Using scheduler = %s] ", _bootargs.substr(st,end).c_str());
+                                printf("[Using scheduler = %s] ", _bootargs.substr(st,end-st).c_str());
                             }
                         }
                     }
@@ -13,7 +13,11 @@
 #include <cstdio>
 // #include <string>
 #include <cstdint>
+#include <atomic>
 #include "k_drvif.h"
+#include "k_irq.h"
+#include "k_ring.hpp"
+#include "k_lock.h"
 
 #include "sbi/riscv_io.h"
 
@@ -41,12 +45,38 @@
 #define UART_LSR_DR 0x01             /* Receiver data ready */
 #define UART_LSR_BRK_ERROR_BITS 0x1E /* BI, FE, PE, OE bits */
 
+#define UART_IER_RDI 0x01  /* Enable receiver data interrupt */
+#define UART_IER_THRI 0x02 /* Enable transmitter holding register empty interrupt */
+
+#define UART_IIR_NO_INT 0x01 /* No interrupts pending */
+
+#define UART_FCR_ENABLE_FIFO 0x01 /* Enable the FIFO */
+#define UART_FCR_CLEAR_RCVR 0x02  /* Clear the RCVR FIFO */
+#define UART_FCR_CLEAR_XMIT 0x04  /* Clear the XMIT FIFO */
+
+#define UART_MCR_OUT2 0x08 /* Out2 complement, gates the IRQ line on PC-style boards */
+
+#define UART_TX_RING 4096 /* bytes queued for transmission, 2^n */
+#define UART_RX_RING 1024 /* bytes received but not read yet, 2^n */
+
 static void drv_register();
 
 class Drv_Uart8250 : public DriverChar
 {
 
   private:
+    // Lives outside uart8250_t, atomics do not move with the map
+    struct buffers_t
+    {
+        SPSCRing<char, UART_TX_RING> tx;
+        SPSCRing<char, UART_RX_RING> rx;
+        lock_t tx_lock;                              // writers, the TX ring has a single producer
+        lock_t rx_lock;                              // readers, the RX ring has a single consumer
+        std::atomic_flag tx_busy = ATOMIC_FLAG_INIT; // whoever feeds the FIFO
+        std::atomic_flag rx_busy = ATOMIC_FLAG_INIT; // whoever empties the FIFO
+        uint8_t ier = 0;                             // shadow of IER, changed under tx_busy only
+    };
+
     struct uart8250_t
     {
         char *base;
@@ -55,8 +85,11 @@ class Drv_Uart8250 : public DriverChar
         uint32_t reg_width;
         uint32_t reg_shift;
         // uint32_t reg_offset;
+        uint32_t fifo_depth;
 
         bool opened = false;
+        bool irq = false; // interrupts get delivered, otherwise the rings are drained by polling
+        buffers_t *buf = nullptr;
     };
 
     const uint32_t default_freq = 0;
@@ -64,6 +97,7 @@ class Drv_Uart8250 : public DriverChar
     const uint32_t default_reg_shift = 0;
     const uint32_t default_reg_width = 1;
     const uint32_t default_reg_offset = 0;
+    const uint32_t default_fifo_depth = 16;
 
     static u32 get_reg(const uart8250_t &u, u32 num)
     {
@@ -89,6 +123,59 @@ class Drv_Uart8250 : public DriverChar
             writel(val, u.base + offset);
     }
 
+    // Refill the TX FIFO in bursts while it is empty. Only one feeder at a time;
+    // a writer that loses the race leaves its bytes to the current feeder, which loops until the ring is empty
+    // or THRI is armed to continue from the interrupt.
+    static void tx_kick(uart8250_t &u)
+    {
+        auto b = u.buf;
+        do
+        {
+            if (b->tx_busy.test_and_set(std::memory_order_acquire))
+                return;
+            char c;
+            while (!b->tx.empty() && (get_reg(u, UART_LSR_OFFSET) & UART_LSR_THRE))
+            {
+                for (uint32_t i = 0; i < u.fifo_depth && b->tx.pop(c); i++)
+                    set_reg(u, UART_THR_OFFSET, c);
+                if (u.irq)
+                    break; // the rest goes from the THRE interrupt
+            }
+            if (u.irq)
+            {
+                uint8_t ier = b->tx.empty() ? (b->ier & ~UART_IER_THRI) : (b->ier | UART_IER_THRI);
+                if (ier != b->ier)
+                    set_reg(u, UART_IER_OFFSET, b->ier = ier);
+            }
+            b->tx_busy.clear(std::memory_order_release);
+        } while (!b->tx.empty() && (!u.irq || !(b->ier & UART_IER_THRI)));
+    }
+
+    // Move everything the FIFO holds into the RX ring, dropping bytes when it is full
+    static void rx_pull(uart8250_t &u)
+    {
+        auto b = u.buf;
+        if (b->rx_busy.test_and_set(std::memory_order_acquire))
+            return;
+        while (get_reg(u, UART_LSR_OFFSET) & UART_LSR_DR)
+            b->rx.push(get_reg(u, UART_RBR_OFFSET));
+        b->rx_busy.clear(std::memory_order_release);
+    }
+
+    static void isr(uart8250_t &u)
+    {
+        while (!(get_reg(u, UART_IIR_OFFSET) & UART_IIR_NO_INT))
+        {
+            rx_pull(u);
+            tx_kick(u);
+        }
+    }
+
+    static void irq_entry(void *ctx)
+    {
+        isr(*(uart8250_t *)ctx);
+    }
+
   public:
     int probe(const char *name, const char *compatible) override
     {
@@ -140,6 +227,14 @@ class Drv_Uart8250 : public DriverChar
         else
             uart.base += default_reg_offset;
 
+        val = (fdt32_t *)fdt_getprop(fdt, node, "fifo-size", &len);
+        if (len > 0 && val)
+            uart.fifo_depth = fdt32_to_cpu(*val);
+        else
+            uart.fifo_depth = default_fifo_depth;
+        if (!uart.fifo_depth)
+            uart.fifo_depth = 1;
+
         uart.base += 0xFFFFFFC000000000;
         u16 bdiv = 0;
 
@@ -161,10 +256,10 @@ class Drv_Uart8250 : public DriverChar
 
         /* 8 bits, no parity, one stop bit */
         set_reg(uart, UART_LCR_OFFSET, 0x03);
-        /* Enable FIFO */
-        set_reg(uart, UART_FCR_OFFSET, 0x01);
-        /* No modem control DTR RTS */
-        set_reg(uart, UART_MCR_OFFSET, 0x00);
+        /* Enable and clear FIFO */
+        set_reg(uart, UART_FCR_OFFSET, UART_FCR_ENABLE_FIFO | UART_FCR_CLEAR_RCVR | UART_FCR_CLEAR_XMIT);
+        /* No modem control DTR RTS, OUT2 lets the IRQ through */
+        set_reg(uart, UART_MCR_OFFSET, UART_MCR_OUT2);
         /* Clear line status */
         get_reg(uart, UART_LSR_OFFSET);
         /* Read receive buffer */
@@ -172,8 +267,18 @@ class Drv_Uart8250 : public DriverChar
         /* Set scratchpad */
         set_reg(uart, UART_SCR_OFFSET, 0x00);
 
+        uart.buf = new buffers_t();
+        /* RX interrupt stays on, THRI is armed only while the TX ring has data */
+        uart.buf->ier = UART_IER_RDI;
+        set_reg(uart, UART_IER_OFFSET, uart.buf->ier);
+
         hdl.insert(std::pair<long, uart8250_t>(++hdl_count, uart));
 
+        // Map nodes do not move, so the entry itself is the IRQ context
+        auto &dev = hdl[hdl_count];
+        if (IRQManager::request_irq(fdt, node, irq_entry, &dev) == K_OK)
+            dev.irq = true;
+
         // Test send here
         // write(hdl_count, "TEST UART8250\n", 14);
 
@@ -226,19 +331,24 @@ class Drv_Uart8250 : public DriverChar
             return K_ENODEV;
 
         auto &uart = u->second;
-
-        for (int i = 0; i < len; ++i)
-        {
-            if (get_reg(uart, UART_LSR_OFFSET) & UART_LSR_DR)
-                ((char *)buf)[i] = get_reg(uart, UART_RBR_OFFSET);
-            else
-                return i;
-        }
+        bool sie = csr_read_clear(CSR_SSTATUS, SSTATUS_SIE) & SSTATUS_SIE;
+        if (!uart.irq || !sie)
+            rx_pull(uart);
+
+        uart.buf->rx_lock.lock();
+        int i = 0;
+        for (; i < len && uart.buf->rx.pop(((char *)buf)[i]); ++i)
+            ;
+        uart.buf->rx_lock.unlock();
+        if (sie)
+            csr_set(CSR_SSTATUS, SSTATUS_SIE);
 
         // printf("UART8250 read\n");
-        return len;
+        return i;
     }
 
+    // Returns once everything is queued. Without interrupts the caller drains the ring itself.
+    // Interrupts are off while the lock is held, so that a print from an ISR cannot deadlock on its own hart.
     int write(long handler, const void *buf, int len) override
     {
         auto u = hdl.find(handler);
@@ -246,21 +356,55 @@ class Drv_Uart8250 : public DriverChar
             return K_ENODEV;
 
         auto &uart = u->second;
+        auto b = uart.buf;
 
-        for (int i = 0; i < len; ++i)
+        bool sie = csr_read_clear(CSR_SSTATUS, SSTATUS_SIE) & SSTATUS_SIE;
+        b->tx_lock.lock();
+        for (int i = 0; i < len;)
         {
-            while ((get_reg(uart, UART_LSR_OFFSET) & UART_LSR_THRE) == 0)
-                ;
-
-            set_reg(uart, UART_THR_OFFSET, ((const char *)buf)[i]);
+            if (b->tx.push(((const char *)buf)[i]))
+                i++;
+            else
+                tx_kick(uart); // ring full, make room
         }
+        tx_kick(uart);
+        if (!uart.irq || !sie)
+        {
+            while (!b->tx.empty())
+                tx_kick(uart);
+        }
+        b->tx_lock.unlock();
+        if (sie)
+            csr_set(CSR_SSTATUS, SSTATUS_SIE);
 
         // printf("UART8250 write\n");
         return len;
     }
 
+    // Service the device, bound to its interrupt line
+    void handleIRQ(long handler)
+    {
+        auto u = hdl.find(handler);
+        if (u != hdl.end())
+            isr(u->second);
+    }
+
     int ioctl(long handler, int cmd, void *arg) override
     {
+        auto u = hdl.find(handler);
+        if (u == hdl.end())
+            return K_ENODEV;
+
+        auto &uart = u->second;
+        if (cmd == DRV_IOCTL_FLUSH)
+        {
+            while (!uart.buf->tx.empty())
+                tx_kick(uart);
+            while (!(get_reg(uart, UART_LSR_OFFSET) & UART_LSR_TEMT))
+                ;
+            return 0;
+        }
+
         printf("UART8250 ioctl -- not supported\n");
         return 0;
     }
@@ -12,6 +12,47 @@
 #define K_CONFIG_CPU_DEFAULT_CLOCK 10000000
 
 #define K_CONFIG_DEFAULT_SCHEDULER "scheduler-rr"
+#define K_CONFIG_SCHED_HZ 100         // scheduler ticks per second
+#define K_CONFIG_SCHED_RR_SLICE 2     // ticks a task runs before round robin moves on
+#define K_CONFIG_SCHED_RUNQ 256       // tasks in the lock-free ring of a hart, power of 2, overflow spills
+#define K_CONFIG_SCHED_BALANCE_TICKS 4 // scheduler ticks between load balancing passes of a hart
+#define K_CONFIG_SCHED_FAIR_LATENCY_US 6000 // fair: most a woken task is placed behind min_vruntime, doubled
+#define K_CONFIG_SCHED_FAIR_GRAN_US 1000    // fair: lead in vruntime a queued task needs to preempt
+#define K_CONFIG_SCHED_DL_LOWER "scheduler-rr" // edf: scheduler of the tasks without a deadline
+#define K_CONFIG_SCHED_DL_UTIL_PCT 95       // edf: bandwidth of a hart deadline tasks may reserve
+#define K_CONFIG_IDLE_SUSPEND 1             // idle harts park with an SBI HSM retentive suspend, wfi without HSM
+#define K_CONFIG_TIMER_WHEEL_US 1000        // timeout wheel resolution (a jiffy)
+#define K_CONFIG_TIMER_WHEEL_LEVELS 4       // 64 buckets each, 4 levels cover 64^4 jiffies
+#define K_CONFIG_LOCK_QUEUED 0             // lock_t is an MCS queue lock (qlock_t) instead of a ticket lock
+#define K_CONFIG_LOCKSTAT 0                 // lock contention statistics in /proc/lockstat, 0 compiles them out
+#define K_CONFIG_LOCKSTAT_CLASSES 256       // lock classes told apart, the rest share one
+#define K_CONFIG_LOCKSTAT_SITES 4           // acquiring call sites kept per class
+#define K_CONFIG_FUTEX_BUCKETS 64           // futex wait queues, power of 2, hashed by physical address
+#define K_CONFIG_RCU_POLL_US 10000          // harts with RCU callbacks pending check for the grace period this often
+#ifdef __riscv_flen
+#define K_CONFIG_THREAD_FP 1          // switch FP registers with threads, follows the target ISA
+#else
+#define K_CONFIG_THREAD_FP 0
+#endif
+
+#define K_CONFIG_VFS_READAHEAD_MIN 4096   // initial readahead window, in bytes
+#define K_CONFIG_VFS_READAHEAD_MAX 131072 // the window doubles on sequential hits up to this
+#define K_CONFIG_VFS_MAX_FILES 1024       // open files and directories, system wide
+
+#define K_CONFIG_LOG_RECORDS 32      // records buffered per hart, must be 2^n
+#define K_CONFIG_LOG_RECORD_SIZE 128 // bytes per record, longer messages take several
+
+#define K_CONFIG_TRACE 1              // 0 compiles every K_TRACE point out
+#define K_CONFIG_TRACE_RECORDS 256    // records kept per hart, older ones are overwritten, must be 2^n
+
+#define K_CONFIG_PROF_HZ 997        // default sampling rate, prime so it does not beat with periodic work
+#define K_CONFIG_PROF_SAMPLES 2048  // samples kept per hart, profiling stops filling a full buffer
+#define K_CONFIG_PROF_DEPTH 8       // frames per sample, pc and ra included
+#define K_CONFIG_PROF_FP_WALK 0     // walk s0 frame records, needs -fno-omit-frame-pointer
+
+#define K_CONFIG_IORING_MAX 64           // rings alive at the same time
+#define K_CONFIG_IORING_SQ_ENTRIES 2048  // must be 2^n
+#define K_CONFIG_IORING_CQ_ENTRIES 4096  // must be 2^n
 
 // END CONFIG
 
@@ -82,6 +123,7 @@
 #define K_ENOMEM -1006
 #define K_EUNKNOWN -1007
 #define K_ENOENT -1008
+#define K_EAGAIN -1009
 
 #endif // __ASSEMBLER__
 
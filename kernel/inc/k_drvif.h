@@ -6,6 +6,9 @@
 #define DRV_CAP_THIS 1
 #define DRV_CAP_COVER 2
 
+// Generic ioctl commands
+#define DRV_IOCTL_FLUSH 1 // wait until queued output has left the device
+
 typedef enum
 {
     DEV_TYPE_NONE = 0,
@@ -13,12 +16,16 @@ typedef enum
     DEV_TYPE_PERIP = 0x80,
     DEV_TYPE_CHAR,
     DEV_TYPE_BLOCK,
+    DEV_TYPE_INTC,
 } dev_type_t;
 
 #ifdef __cplusplus
 
 #include <vector>
 #include <map>
+#include <functional>
+
+#include "k_rwlock.h"
 
 extern "C"
 {
@@ -70,6 +77,7 @@ class DriverManager
   public:
     static void addDriver(DriverBase &drv)
     {
+        rw_write_guard_t g(_lock);
         _drvlist.push_back(&drv);
     }
 
@@ -78,7 +86,10 @@ class DriverManager
         auto rc = fdt_get_name(fdt, node, NULL);
         if (!rc)
             return -1;
-        _devhdl.insert(std::make_pair(node, std::make_tuple(drv, drv_cap, handler)));
+        {
+            rw_write_guard_t g(_lock);
+            _devhdl.insert(std::make_pair(node, std::make_tuple(drv, drv_cap, handler)));
+        }
         extern int printf(const char *fmt, ...);
         printf("(#%i [%s] => %ld) ", node, rc, handler);
         return 0;
@@ -87,6 +98,7 @@ class DriverManager
     // The function would not delete the device, so the handler is still valid
     static void removeDriver(DriverBase &drv)
     {
+        rw_write_guard_t g(_lock);
         for (auto it = _drvlist.begin(); it != _drvlist.end(); ++it)
         {
             if (*it == &drv)
@@ -99,6 +111,7 @@ class DriverManager
 
     static DriverBase *getDriverByProbe(const char *name, const char *compatible)
     {
+        rw_read_guard_t g(_lock);
         for (auto &drv : _drvlist)
         {
             if (drv->probe(name, compatible) > 0)
@@ -107,6 +120,25 @@ class DriverManager
         return nullptr;
     }
 
+    // Returns the handler of the device installed at node, or K_ENODEV
+    static long getDrvByNode(int node, void **drv)
+    {
+        rw_read_guard_t g(_lock);
+        auto ret = _devhdl.find(node);
+        if (ret == _devhdl.end())
+            return K_ENODEV;
+        *drv = std::get<0>(ret->second);
+        return std::get<2>(ret->second);
+    }
+
+    // Walk over installed devices as (node, driver, handler), read locked: fn must not install or remove any
+    static void forEachDevice(const std::function<void(int, DriverBase *, long)> &fn)
+    {
+        rw_read_guard_t g(_lock);
+        for (auto &dev : _devhdl)
+            fn(dev.first, std::get<0>(dev.second), std::get<2>(dev.second));
+    }
+
     // static long find
     static int probe(const void *fdt, dev_type_t type = DEV_TYPE_PERIP, int node = 0);
     static long getDrvByPath(const void *fdt, const char *path, void **drv);
@@ -114,6 +146,7 @@ class DriverManager
   private:
     static std::vector<DriverBase *> _drvlist;
     static std::map<int, std::tuple<DriverBase *, int, long>> _devhdl; // node, <drv,rc,hdl>
+    static rwlock_t _lock; // both tables: read on every lookup, written while drivers and devices come and go
     static int _try(const void *fdt, int node, dev_type_t type);
 };
 
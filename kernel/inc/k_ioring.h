@@ -0,0 +1,116 @@
+#ifndef __K_IORING_H__
+#define __K_IORING_H__
+
+#include <atomic>
+
+#include "k_defs.h"
+#include "k_ring.hpp"
+#include "k_wait.h"
+
+// Operations, on VirtualFS fds (devices are reached through their VFS fds)
+enum io_op_t : uint8_t
+{
+    IO_OP_NOP = 0,
+    IO_OP_READ,   // addr = buffer, len = bytes
+    IO_OP_WRITE,  // addr = buffer, len = bytes
+    IO_OP_READV,  // addr = struct iovec array, len = count
+    IO_OP_WRITEV, // addr = struct iovec array, len = count
+};
+
+// Submission queue entry
+struct io_sqe_t
+{
+    uint8_t op;
+    uint8_t flags;
+    uint16_t reserved0;
+    int32_t fd;
+    int64_t off; // -1 to use (and advance) the file position
+    uint64_t addr;
+    uint32_t len;
+    uint32_t reserved1;
+    uint64_t user_data; // copied to the completion untouched
+};
+
+// Completion queue entry
+struct io_cqe_t
+{
+    uint64_t user_data;
+    int32_t res; // same as the synchronous call would return
+    uint32_t flags;
+};
+
+/**
+ * @brief io_uring-like submission/completion ring pair
+ *
+ * The owner fills the SQ and reaps the CQ without entering the kernel I/O path.
+ * Any hart may service a ring with process(): it consumes SQEs, performs them and posts CQEs.
+ * A ring is serviced by one hart at a time, so both queues stay single-producer single-consumer.
+ * Submitting starts the "ioring" worker thread when none runs, it services every ring and exits once none has
+ * work it can complete (so k_thread_drain is not held up). SQEs behind a full CQ wait for the owner: reaping
+ * starts the worker again. Without threads, wait() services the ring itself.
+ * The shared block is page aligned to be mapped into U-mode later on.
+ */
+class IORing
+{
+  public:
+    struct shared_t
+    {
+        SPSCRing<io_sqe_t, K_CONFIG_IORING_SQ_ENTRIES> sq;
+        SPSCRing<io_cqe_t, K_CONFIG_IORING_CQ_ENTRIES> cq;
+    };
+
+    static IORing *create();
+    static int destroy(IORing *ring);
+
+    // Service every live ring, returns the number of SQEs completed. Run by the worker.
+    static int processAll(int budget = -1);
+
+    // Owner side
+    bool submit(const io_sqe_t &sqe)
+    {
+        if (!_sh.load(std::memory_order_relaxed)->sq.push(sqe))
+            return false;
+        _kick();
+        return true;
+    }
+
+    bool reap(io_cqe_t &cqe)
+    {
+        auto sh = _sh.load(std::memory_order_relaxed);
+        if (!sh->cq.pop(cqe))
+            return false;
+        if (!sh->sq.empty())
+            _kick(); // the worker may have left them behind a full CQ
+        return true;
+    }
+
+    // Wait until at least min_complete CQEs are ready, sleeping while the worker is on the ring and servicing it
+    // inline when nobody is
+    int wait(uint32_t min_complete);
+
+    // Service side, returns the number of SQEs completed
+    int process(int budget = -1);
+
+    shared_t *shared()
+    {
+        return _sh.load(std::memory_order_relaxed);
+    }
+
+  private:
+    // Ring objects live in a static pool and are never freed, only their shared block is,
+    // so a servicing hart can always touch _busy safely
+    std::atomic<shared_t *> _sh = nullptr;
+    std::atomic_bool _used = false;
+    std::atomic_flag _busy = ATOMIC_FLAG_INIT;
+    std::atomic<uint32_t> _passes = 0; // service passes over this ring, wait() sleeps until one ends
+    waitq_t _done;
+
+    static int _exec(const io_sqe_t &sqe);
+    static bool _pending();
+    static void _kick();
+    static void _worker(void *);
+    static IORing _pool[K_CONFIG_IORING_MAX];
+    static std::atomic<bool> _worker_on;
+};
+
+#endif
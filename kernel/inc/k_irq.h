@@ -0,0 +1,66 @@
+#ifndef __K_IRQ_H__
+#define __K_IRQ_H__
+
+#include <cstdint>
+#include <vector>
+
+#include "k_drvif.h"
+#include "k_defs.h"
+
+using irq_handler_t = void (*)(void *ctx);
+
+constexpr unsigned long IRQ_AFFINITY_ANY = ~0UL;
+
+// Interrupt controller, handlers are attached per hardware IRQ number of the controller
+class DriverIntc : public DriverBase
+{
+  public:
+    virtual int attach(long handler, uint32_t hwirq, irq_handler_t fn, void *ctx, uint32_t prio) = 0;
+    virtual int detach(long handler, uint32_t hwirq) = 0;
+
+    // Route hwirq to the harts in mask (bit n = hart n), the first hart to claim it handles it
+    virtual int setAffinity(long handler, uint32_t hwirq, unsigned long mask) = 0;
+
+    // Sources with a priority not above the threshold are masked on that hart
+    virtual int setThreshold(long handler, int hart, uint32_t threshold) = 0;
+
+    // Claim and handle everything pending for hart, returns the number of IRQs handled
+    virtual int dispatch(long handler, int hart) = 0;
+
+    virtual dev_type_t getDeviceType() override
+    {
+        return DEV_TYPE_INTC;
+    }
+};
+
+/**
+ * @brief Binds device interrupts described in the DeviceTree to handlers
+ *
+ * The controller is found through interrupts-extended, or interrupts + interrupt-parent (inherited from
+ * ancestors), and probed on demand if the DriverManager has not reached it yet.
+ */
+class IRQManager
+{
+  public:
+    // Attach handler to interrupt `index` of node. By default the IRQ is routed to the calling hart.
+    static int request_irq(const void *fdt, int node, irq_handler_t handler, void *ctx, int index = 0,
+                           uint32_t prio = 1, unsigned long affinity = 0);
+    static int free_irq(const void *fdt, int node, int index = 0);
+    static int setAffinity(const void *fdt, int node, unsigned long mask, int index = 0);
+
+    // Supervisor external interrupt entry, dispatches every controller wired to the hart
+    static void handleExternal();
+
+  private:
+    struct intc_t
+    {
+        DriverIntc *drv;
+        long hdl;
+    };
+
+    static std::vector<intc_t> _intcs;
+
+    static int _resolve(const void *fdt, int node, int index, intc_t &intc, uint32_t &hwirq);
+};
+
+#endif
@@ -3,54 +3,198 @@
 
 #include <atomic>
 #include "k_main.h"
+#include "k_lockstat.h"
+
+/**
+ * @brief Spinlocks
+ *
+ * __lock (lock_t, and newlib's locks) is a ticket lock: FIFO, one fetch_add to take a ticket, then waiters only
+ * read the serving word and back off in proportion to their place in line. For short sections.
+ * qlock_t is an MCS queue lock for contended ones: every waiter spins on its own node, on its own stack, so a
+ * release only touches the cache line of the next waiter. Only the head of the queue polls the lock word.
+ * Neither needs hart locals to work, they are real from the first boot stage. Once K_MULTICORE, a holder is not
+ * preempted (k_preempt_count). K_CONFIG_LOCK_QUEUED makes lock_t a qlock_t.
+ * A name only matters to lockstat, see k_lockstat.h.
+ */
+
+// Raise k_preempt_count when hart locals are usable, true when it did
+inline bool k_lock_preempt_off()
+{
+    if (k_stage != K_MULTICORE)
+        return false;
+    k_preempt_count++;
+    return true;
+}
 
 struct __lock
 {
-    std::atomic<int> owner = -1;
-    std::atomic<int> recursive_count = 0;
+    std::atomic<uint32_t> next = 0;    // next ticket handed out
+    std::atomic<uint32_t> serving = 0; // ticket holding the lock
+    std::atomic<uintptr_t> owner = 0;  // token of the holder, for recursion
+    uint32_t recursive_count = 0;
+    bool preempt = false; // the holder raised k_preempt_count
+    K_LOCKSTAT(lockstat_t stat;)
+
+    __lock() = default;
+    explicit constexpr __lock(const char *name) K_LOCKSTAT(: stat(name))
+    {
+    }
 
-    void lock(bool recursive = false)
+    // tp is unique per hart before threads and per thread after, it is never odd
+    static uintptr_t token()
     {
+        uintptr_t tp;
+        asm volatile("mv %0, tp" : "=r"(tp));
+        return tp | 1;
+    }
 
-        if (k_stage != K_MULTICORE)
+    K_LOCKSTAT_NOINLINE void lock(bool recursive = false)
+    {
+        auto me = token();
+        if (recursive && owner.load(std::memory_order_relaxed) == me)
+        {
+            recursive_count++;
             return;
-        // _write(0, (char*)"PLOCK\n",6);
-        if (recursive)
+        }
+        bool p = k_lock_preempt_off(); // before the ticket: the holder must stay on its hart
+        uint32_t ticket = next.fetch_add(1, std::memory_order_relaxed);
+        K_LOCKSTAT(uint64_t wait = 0;)
+        for (;;)
         {
-            if (owner == hartid)
-            {
-                recursive_count++;
-                return;
-            }
+            uint32_t s = serving.load(std::memory_order_acquire);
+            if (s == ticket)
+                break;
+            K_LOCKSTAT(if (!wait) wait = lockstat_t::now();)
+            for (uint32_t i = (ticket - s) * 8; i; i--)
+                k_cpu_relax();
         }
-        int null_owner = -1; // helper for compare_exchange_weak
-        while (!owner.compare_exchange_weak(null_owner, hartid))
-            null_owner = -1;
+        owner.store(me, std::memory_order_relaxed);
+        recursive_count = 1;
+        preempt = p;
+        K_LOCKSTAT(stat.acquired(__builtin_return_address(0), wait);)
+    }
 
+    K_LOCKSTAT_NOINLINE bool try_lock(bool recursive = false)
+    {
+        auto me = token();
+        if (recursive && owner.load(std::memory_order_relaxed) == me)
+        {
+            recursive_count++;
+            return true;
+        }
+        // Free only when no ticket is out past the serving one
+        uint32_t s = serving.load(std::memory_order_relaxed), n = s;
+        if (!next.compare_exchange_strong(n, s + 1, std::memory_order_acquire))
+            return false;
+        owner.store(me, std::memory_order_relaxed);
         recursive_count = 1;
-        // _write(0, (char *)"LOCK\n", 5);
+        preempt = k_lock_preempt_off();
+        K_LOCKSTAT(stat.acquired(__builtin_return_address(0), 0);)
+        return true;
     }
 
     void unlock(bool recursive = false)
     {
-        if (k_stage != K_MULTICORE)
+        if (owner.load(std::memory_order_relaxed) != token())
             return;
-        if (recursive)
+        if (recursive && --recursive_count)
+            return;
+        K_LOCKSTAT(stat.released();)
+        bool p = preempt;
+        owner.store(0, std::memory_order_relaxed);
+        serving.store(serving.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        if (p)
+            k_preempt_count--;
+    }
+};
+
+struct qlock_t
+{
+    struct node_t
+    {
+        std::atomic<node_t *> next = nullptr;
+        std::atomic<bool> wait = true;
+    };
+
+    std::atomic<bool> locked = false;
+    std::atomic<node_t *> tail = nullptr; // last waiter
+    bool preempt = false;
+    K_LOCKSTAT(lockstat_t stat;)
+
+    qlock_t() = default;
+    explicit constexpr qlock_t(const char *name) K_LOCKSTAT(: stat(name))
+    {
+    }
+
+    K_LOCKSTAT_NOINLINE bool try_lock()
+    {
+        bool free = false;
+        if (tail.load(std::memory_order_relaxed) ||
+            !locked.compare_exchange_strong(free, true, std::memory_order_acquire))
+            return false;
+        preempt = k_lock_preempt_off();
+        K_LOCKSTAT(stat.acquired(__builtin_return_address(0), 0);)
+        return true;
+    }
+
+    K_LOCKSTAT_NOINLINE void lock()
+    {
+        bool p = k_lock_preempt_off();
+        bool free = false;
+        if (!tail.load(std::memory_order_relaxed) &&
+            locked.compare_exchange_strong(free, true, std::memory_order_acquire))
         {
-            if (owner == hartid)
-            {
-                if (--recursive_count == 0)
-                    owner = -1;
-            }
+            preempt = p;
+            K_LOCKSTAT(stat.acquired(__builtin_return_address(0), 0);)
             return;
         }
+        K_LOCKSTAT(uint64_t wait = lockstat_t::now();)
 
-        if (owner == hartid)
-            owner = -1;
+        // Queue up, the node is only needed until this waiter is at the head and passes that on
+        node_t me;
+        auto prev = tail.exchange(&me, std::memory_order_acq_rel);
+        if (prev)
+        {
+            prev->next.store(&me, std::memory_order_release);
+            while (me.wait.load(std::memory_order_acquire))
+                k_cpu_relax();
+        }
+        for (;;)
+        {
+            free = false;
+            if (!locked.load(std::memory_order_relaxed) &&
+                locked.compare_exchange_weak(free, true, std::memory_order_acquire))
+                break;
+            k_cpu_relax();
+        }
+        auto next = me.next.load(std::memory_order_acquire);
+        if (!next)
+        {
+            auto last = &me;
+            if (!tail.compare_exchange_strong(last, nullptr, std::memory_order_acq_rel))
+                while (!(next = me.next.load(std::memory_order_acquire))) // linking in right now
+                    k_cpu_relax();
+        }
+        if (next)
+            next->wait.store(false, std::memory_order_release);
+        preempt = p;
+        K_LOCKSTAT(stat.acquired(__builtin_return_address(0), wait);)
     }
-};
 
+    void unlock()
+    {
+        K_LOCKSTAT(stat.released();)
+        bool p = preempt;
+        locked.store(false, std::memory_order_release);
+        if (p)
+            k_preempt_count--;
+    }
+};
 
+#if K_CONFIG_LOCK_QUEUED
+using lock_t = qlock_t;
+#else
 using lock_t = __lock;
+#endif
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,79 @@
+#ifndef __K_LOCKSTAT_H__
+#define __K_LOCKSTAT_H__
+
+#include <atomic>
+#include <cstdint>
+
+#include "llenv.h"
+
+/**
+ * @brief Lock contention statistics (lockstat), with K_CONFIG_LOCKSTAT
+ *
+ * Both lock_t kinds, the malloc lock and newlib's locks included, account every acquisition to a lock class:
+ * named locks to the class of their name, the others to the class of the call site that took them first, so the
+ * locks of one kind of object share a class. Per class and per acquiring site (__builtin_return_address of the
+ * lock call): acquisitions, contended ones and the time spent waiting for them, in CSR_TIME ticks; per class the
+ * longest wait and hold times too. Only the holder writes the state of a lock, the class counters are relaxed
+ * atomics and the class table is lock-free: lockstat takes no lock and never allocates.
+ * /proc/lockstat lists the classes by time waited. Without K_CONFIG_LOCKSTAT, K_LOCKSTAT() drops its argument:
+ * locks carry no state and the hooks compile to nothing.
+ */
+
+// On the lock calls that pass __builtin_return_address(0): inlined, it would be the return address of the caller
+#if K_CONFIG_LOCKSTAT
+#define K_LOCKSTAT(...) __VA_ARGS__
+#define K_LOCKSTAT_NOINLINE __attribute__((noinline))
+#else
+#define K_LOCKSTAT(...)
+#define K_LOCKSTAT_NOINLINE
+#endif
+
+struct lockstat_site_t
+{
+    std::atomic<uintptr_t> ra = 0; // 0 while the slot is free
+    std::atomic<uint64_t> acquired = 0;
+    std::atomic<uint64_t> contended = 0;
+    std::atomic<uint64_t> wait = 0;
+};
+
+struct lockstat_class_t
+{
+    std::atomic<uintptr_t> key = 0; // name or first site, 0 while the slot is free
+    const char *name = nullptr;
+    uintptr_t site = 0; // first acquisition of the first lock of the class
+    std::atomic<uint64_t> acquired = 0;
+    std::atomic<uint64_t> contended = 0;
+    std::atomic<uint64_t> wait = 0;
+    std::atomic<uint64_t> wait_max = 0;
+    std::atomic<uint64_t> hold = 0;
+    std::atomic<uint64_t> hold_max = 0;
+    lockstat_site_t sites[K_CONFIG_LOCKSTAT_SITES]; // the first ones seen, the others only count in the class
+};
+
+// State of one lock, written by its holder
+struct lockstat_t
+{
+    const char *name = nullptr;
+    lockstat_class_t *cls = nullptr; // looked up on the first acquisition
+    uint64_t since = 0;              // when the holder got it
+
+    constexpr lockstat_t(const char *name = nullptr) : name(name)
+    {
+    }
+
+    static uint64_t now()
+    {
+        return csr_read(CSR_TIME);
+    }
+
+    // Just taken, from ra; wait_start is when it was found held, 0 when it was not
+    void acquired(void *ra, uint64_t wait_start);
+    // About to be released
+    void released();
+};
+
+void k_lockstat_foreach(void (*fn)(const lockstat_class_t *c, void *arg), void *arg);
+// Zero every counter, classes and sites stay
+void k_lockstat_reset();
+
+#endif
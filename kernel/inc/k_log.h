@@ -0,0 +1,30 @@
+#ifndef __K_LOG_H__
+#define __K_LOG_H__
+
+#include "k_defs.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @brief printk-style kernel log
+     *
+     * The message is stamped with CSR_TIME and the hart id and queued in the hart's own ring, so it never waits
+     * for the console. From K_MULTICORE on, idle harts drain every ring in timestamp order, k_printk kicks one
+     * out of its wfi. The caller only writes the console itself when its ring is full (and interrupts are on),
+     * records that still do not fit are dropped and counted. Before K_MULTICORE k_printk flushes right away.
+     */
+    int k_printk(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+    // Drain all queued records to the console, returns at once if another hart is flushing
+    void k_log_flush();
+    // Records are waiting in some ring
+    bool k_log_pending();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -22,11 +22,13 @@ extern "C"
 
     extern volatile k_stage_t k_stage;
     extern bool k_stdout_switched;
+    extern int k_boot_hartid; // valid from k_boot_sysdev on, hart locals are not set up that early
     extern volatile unsigned long k_cpuclock;
 
     extern thread_local _reent hl_reent;
     extern thread_local int hartid;
     extern thread_local volatile void *k_local_resume;
+    extern thread_local int k_preempt_count; // > 0 while the thread must not be preempted (holds a lock_t)
 #endif
 
     int k_boot_sysdev(int, void **);
@@ -45,11 +47,19 @@ extern "C"
 #include <atomic>
 extern std::function<int(const char *, int size)> k_stdout_func;
 
+// Hart id usable in any stage. Hart locals exist from K_BOOT_HARTS on, every hart sets hartid before anything
+// else; before that and in K_CLEARUP only the boot hart runs, on no hart locals.
+inline int k_current_hart()
+{
+    return k_stage < K_BOOT_HARTS || k_stage == K_CLEARUP ? k_boot_hartid : hartid;
+}
+
 #include "k_sysdev.h"
 #include "k_mmu.h"
 #include "k_vmmgr.hpp"
 
 extern std::atomic_int k_hart_state[K_CONFIG_MAX_PROCESSORS];
+
 extern SysRoot *sysroot;
 extern SysCPU *syscpu;
 extern SysMem *sysmem;
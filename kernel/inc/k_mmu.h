@@ -3,6 +3,9 @@
 
 #include "k_sysdev.h"
 #include "k_mem.hpp"
+#include "k_log.h"
+#include "k_trace.h"
+#include "k_stats.h"
 #include "sbi/riscv_asm.h"
 #include "sbi/riscv_encoding.h"
 
@@ -33,6 +36,9 @@ class MMUBase
 
     virtual void apply() = 0;
 
+    // Physical address vaddr maps to, 0 when it is not mapped
+    virtual uintptr_t translate(uintptr_t vaddr) = 0;
+
     /**
      * @brief Get a new instance of MMU, not having any mapping
      *
@@ -288,7 +294,7 @@ template <uint8_t sz> class RV64MMU : public RV64MMUBase
     }
     ~RV64MMU()
     {
-        printf("Freeing ptes at %lx\n", (uintptr_t)_ptes);
+        k_printk("Freeing ptes at %lx\n", (uintptr_t)_ptes);
         alignedFree(_ptes);
     }
 
@@ -323,6 +329,9 @@ template <uint8_t sz> class RV64MMU : public RV64MMUBase
 
     int map(uintptr_t vaddr, uintptr_t paddr, size_t size, int prot) override
     {
+        K_TRACE(mmu_map, vaddr, paddr, size, prot);
+        K_STAT_INC(mmu_map);
+        K_STAT_ADD(mmu_map_pages, size >> 12);
         if (vaddr & 0xFFF || paddr & 0xFFF || size & 0xFFF) // Not aligned
             return K_EINVAL;
         if (size == 0)
@@ -405,12 +414,15 @@ template <uint8_t sz> class RV64MMU : public RV64MMUBase
 
             return K_EINVALID_ADDR;
         }
-        printf("Mapped %lx to %lx with prot %i\n", vaddr, paddr, prot);
+        k_printk("Mapped %lx to %lx with prot %i\n", vaddr, paddr, prot);
         return rc;
     }
 
     int unmap(uintptr_t vaddr, size_t size) override
     {
+        K_TRACE(mmu_unmap, vaddr, size);
+        K_STAT_INC(mmu_unmap);
+        K_STAT_ADD(mmu_unmap_pages, size >> 12);
         if (vaddr & 0xFFF || size & 0xFFF) // Not aligned
             return K_EINVAL;
         if (size == 0)
@@ -482,7 +494,7 @@ template <uint8_t sz> class RV64MMU : public RV64MMUBase
 
             return K_EINVALID_ADDR;
         }
-        printf("Unmapped %lx\n", vaddr);
+        k_printk("Unmapped %lx\n", vaddr);
         return rc;
     }
 
@@ -493,6 +505,24 @@ template <uint8_t sz> class RV64MMU : public RV64MMUBase
                      "fence.i \n");
     }
 
+    uintptr_t translate(uintptr_t vaddr) override
+    {
+        auto table = _ptes;
+        for (int level = 0; level <= _getMaxLevel(); level++)
+        {
+            auto pte = table + ((vaddr_t *)&vaddr)->getVPN<sz>(level);
+            if (!pte->v)
+                return 0;
+            if (pte->r || pte->x) // leaf, a superpage above the last level
+            {
+                uintptr_t span = 1ULL << (12 + 9 * (_getMaxLevel() - level));
+                return (pte->paddr() & ~(span - 1)) | (vaddr & (span - 1));
+            }
+            table = (pte_t *)(pte->paddr() + 0xFFFFFFC000000000);
+        }
+        return 0;
+    }
+
   protected:
     static constexpr int _getMaxLevel()
     {
@@ -583,7 +613,7 @@ template <uint8_t sz> class RV64MMU : public RV64MMUBase
         { // Next level already unused, free it
 
             auto pteBase = (pte_t *)(pte->paddr());
-            printf("removing pte memory at %lx\n", (uintptr_t)pteBase);
+            k_printk("removing pte memory at %lx\n", (uintptr_t)pteBase);
             alignedFree(pteBase);
         }
         return (level == 0 ? 0 : _removePTE(level - 1, vaddr));
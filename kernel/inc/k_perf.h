@@ -0,0 +1,79 @@
+#ifndef __K_PERF_H__
+#define __K_PERF_H__
+
+#include <cstdint>
+
+#include "k_defs.h"
+
+/**
+ * @brief Hardware performance counters, through the SBI PMU extension
+ *
+ * Every hart configures its own counters in k_perf_init (from k_pre_main), SBI PMU calls only act on the
+ * calling hart. Events the platform cannot count read as 0 and have no bit in k_perf_supported().
+ * Reads are local to the current hart; k_perf_publish() copies them where other harts can see them,
+ * the timer tick does so every second.
+ *
+ * Measuring a region:
+ *     perf_counters_t acc = {};
+ *     {
+ *         PerfRegion r(acc);
+ *         ...
+ *     }
+ */
+
+enum perf_event_t
+{
+    PERF_CYCLES = 0,
+    PERF_INSTRET,
+    PERF_CACHE_REFS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_L1D_MISSES,
+    PERF_L1I_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_ITLB_MISSES,
+    PERF_EVENT_MAX
+};
+
+struct perf_counters_t
+{
+    uint64_t v[PERF_EVENT_MAX];
+};
+
+extern const char *const k_perf_names[PERF_EVENT_MAX];
+
+// Configure and start the counters of this hart
+int k_perf_init(int hartid);
+// Bit n is set when event n is counted on this hart
+unsigned k_perf_supported();
+
+uint64_t k_perf_read(perf_event_t ev);
+void k_perf_read(perf_counters_t &c);
+
+// Per hart view, as of the last k_perf_publish() of that hart
+void k_perf_publish();
+int k_perf_hart(int hart, perf_counters_t &c);
+
+// Adds the counts of its lifetime to acc, the region must not migrate to another hart
+class PerfRegion
+{
+  public:
+    PerfRegion(perf_counters_t &acc) : _acc(acc)
+    {
+        k_perf_read(_start);
+    }
+
+    ~PerfRegion()
+    {
+        perf_counters_t end;
+        k_perf_read(end);
+        for (int i = 0; i < PERF_EVENT_MAX; i++)
+            _acc.v[i] += end.v[i] - _start.v[i];
+    }
+
+  private:
+    perf_counters_t &_acc;
+    perf_counters_t _start;
+};
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef __K_PROF_H__
+#define __K_PROF_H__
+
+#include <cstdint>
+#include <atomic>
+
+#include "k_defs.h"
+#include "k_umode.h"
+
+/**
+ * @brief Sampling profiler
+ *
+ * While running, the supervisor timer of every hart also fires at the sampling rate and k_isr_timer
+ * records the interrupted pc, ra and, with K_CONFIG_PROF_FP_WALK, the callers found through the s0
+ * frame records. Samples go to a per-hart buffer only that hart writes; a full buffer drops samples.
+ * k_prof_dump writes them in the folded format ("caller;callee count" per line, addresses in hex)
+ * that flamegraph.pl and speedscope read after symbolizing with addr2line.
+ */
+
+struct prof_sample_t
+{
+    uint16_t depth;
+    uint16_t flags; // PROF_SAMPLE_*
+    uint32_t reserved;
+    uintptr_t frames[K_CONFIG_PROF_DEPTH]; // innermost first
+};
+
+#define PROF_SAMPLE_USER 1 // interrupted in U-mode, frames are user addresses
+
+extern std::atomic_bool k_prof_on;
+
+// Allocate the buffers of every hart and start sampling at hz (0 for K_CONFIG_PROF_HZ)
+int k_prof_start(unsigned hz = 0);
+void k_prof_stop();
+// Drop the samples taken so far
+void k_prof_reset();
+// Write folded stacks to path, or to the console when path is nullptr
+int k_prof_dump(const char *path = nullptr);
+
+// Called by the timer ISR: records a sample if one is due, returns the time of the next one (0 when off)
+uint64_t k_prof_tick(umode_basic_ctx_t *uctx, uint64_t now);
+
+#endif
@@ -0,0 +1,314 @@
+#ifndef __K_RBTREE_HPP__
+#define __K_RBTREE_HPP__
+
+#include <cstddef>
+
+/**
+ * @brief Intrusive red-black tree
+ *
+ * The node lives in the element, so insert and erase never allocate and are safe with interrupts off.
+ * Equal keys go right of the existing ones (FIFO among equals). The leftmost node is cached, first() is O(1).
+ * Not synchronized, callers lock.
+ */
+struct rb_node_t
+{
+    rb_node_t *parent = nullptr;
+    rb_node_t *left = nullptr;
+    rb_node_t *right = nullptr;
+    bool red = false;
+};
+
+// Less(a, b) orders two elements, Node is the member holding the links
+template <typename T, rb_node_t T::*Node, typename Less> class RBTree
+{
+  public:
+    bool empty() const
+    {
+        return !_root;
+    }
+
+    size_t size() const
+    {
+        return _count;
+    }
+
+    bool contains(const T *e) const
+    {
+        auto n = &(e->*Node);
+        return n->parent || _root == n;
+    }
+
+    T *first() const
+    {
+        return _first ? entry(_first) : nullptr;
+    }
+
+    T *next(T *e) const
+    {
+        auto n = _next(&(e->*Node));
+        return n ? entry(n) : nullptr;
+    }
+
+    void insert(T *e)
+    {
+        auto n = &(e->*Node);
+        rb_node_t *p = nullptr, **link = &_root;
+        bool leftmost = true;
+        while (*link)
+        {
+            p = *link;
+            if (Less()(*e, *entry(p)))
+                link = &p->left;
+            else
+            {
+                link = &p->right;
+                leftmost = false;
+            }
+        }
+        n->parent = p;
+        n->left = n->right = nullptr;
+        n->red = true;
+        *link = n;
+        if (leftmost)
+            _first = n;
+        _count++;
+        _insertFixup(n);
+    }
+
+    void erase(T *e)
+    {
+        auto z = &(e->*Node);
+        if (_first == z)
+            _first = _next(z);
+
+        rb_node_t *x, *xp;
+        bool red = z->red;
+        if (!z->left || !z->right)
+        {
+            x = z->left ? z->left : z->right;
+            xp = z->parent;
+            _transplant(z, x);
+        }
+        else
+        {
+            auto y = z->right;
+            while (y->left)
+                y = y->left;
+            red = y->red;
+            x = y->right;
+            if (y->parent == z)
+                xp = y;
+            else
+            {
+                xp = y->parent;
+                _transplant(y, y->right);
+                y->right = z->right;
+                y->right->parent = y;
+            }
+            _transplant(z, y);
+            y->left = z->left;
+            y->left->parent = y;
+            y->red = z->red;
+        }
+        if (!red)
+            _eraseFixup(x, xp);
+        z->parent = z->left = z->right = nullptr;
+        _count--;
+    }
+
+    static T *entry(rb_node_t *n)
+    {
+        return (T *)((char *)n - (size_t) & (((T *)nullptr)->*Node));
+    }
+
+  private:
+    rb_node_t *_root = nullptr;
+    rb_node_t *_first = nullptr;
+    size_t _count = 0;
+
+    static bool _red(const rb_node_t *n)
+    {
+        return n && n->red;
+    }
+
+    static rb_node_t *_next(rb_node_t *n)
+    {
+        if (n->right)
+        {
+            n = n->right;
+            while (n->left)
+                n = n->left;
+            return n;
+        }
+        auto p = n->parent;
+        while (p && n == p->right)
+        {
+            n = p;
+            p = p->parent;
+        }
+        return p;
+    }
+
+    void _replaceChild(rb_node_t *parent, rb_node_t *old, rb_node_t *n)
+    {
+        if (!parent)
+            _root = n;
+        else if (parent->left == old)
+            parent->left = n;
+        else
+            parent->right = n;
+    }
+
+    void _transplant(rb_node_t *u, rb_node_t *v)
+    {
+        _replaceChild(u->parent, u, v);
+        if (v)
+            v->parent = u->parent;
+    }
+
+    void _rotateLeft(rb_node_t *x)
+    {
+        auto y = x->right;
+        x->right = y->left;
+        if (y->left)
+            y->left->parent = x;
+        y->parent = x->parent;
+        _replaceChild(x->parent, x, y);
+        y->left = x;
+        x->parent = y;
+    }
+
+    void _rotateRight(rb_node_t *x)
+    {
+        auto y = x->left;
+        x->left = y->right;
+        if (y->right)
+            y->right->parent = x;
+        y->parent = x->parent;
+        _replaceChild(x->parent, x, y);
+        y->right = x;
+        x->parent = y;
+    }
+
+    void _insertFixup(rb_node_t *z)
+    {
+        rb_node_t *p;
+        while ((p = z->parent) && p->red)
+        {
+            auto g = p->parent; // p is red, so not the root
+            if (p == g->left)
+            {
+                auto u = g->right;
+                if (_red(u))
+                {
+                    p->red = u->red = false;
+                    g->red = true;
+                    z = g;
+                    continue;
+                }
+                if (z == p->right)
+                {
+                    _rotateLeft(p);
+                    z = p;
+                    p = z->parent;
+                }
+                p->red = false;
+                g->red = true;
+                _rotateRight(g);
+            }
+            else
+            {
+                auto u = g->left;
+                if (_red(u))
+                {
+                    p->red = u->red = false;
+                    g->red = true;
+                    z = g;
+                    continue;
+                }
+                if (z == p->left)
+                {
+                    _rotateRight(p);
+                    z = p;
+                    p = z->parent;
+                }
+                p->red = false;
+                g->red = true;
+                _rotateLeft(g);
+            }
+        }
+        _root->red = false;
+    }
+
+    // x took the place of a removed black node, xp is its parent (x may be null)
+    void _eraseFixup(rb_node_t *x, rb_node_t *xp)
+    {
+        while (x != _root && !_red(x))
+        {
+            if (x == xp->left)
+            {
+                auto w = xp->right;
+                if (w->red)
+                {
+                    w->red = false;
+                    xp->red = true;
+                    _rotateLeft(xp);
+                    w = xp->right;
+                }
+                if (!_red(w->left) && !_red(w->right))
+                {
+                    w->red = true;
+                    x = xp;
+                    xp = x->parent;
+                    continue;
+                }
+                if (!_red(w->right))
+                {
+                    w->left->red = false;
+                    w->red = true;
+                    _rotateRight(w);
+                    w = xp->right;
+                }
+                w->red = xp->red;
+                xp->red = false;
+                w->right->red = false;
+                _rotateLeft(xp);
+                x = _root;
+            }
+            else
+            {
+                auto w = xp->left;
+                if (w->red)
+                {
+                    w->red = false;
+                    xp->red = true;
+                    _rotateRight(xp);
+                    w = xp->left;
+                }
+                if (!_red(w->left) && !_red(w->right))
+                {
+                    w->red = true;
+                    x = xp;
+                    xp = x->parent;
+                    continue;
+                }
+                if (!_red(w->left))
+                {
+                    w->right->red = false;
+                    w->red = true;
+                    _rotateLeft(w);
+                    w = xp->left;
+                }
+                w->red = xp->red;
+                xp->red = false;
+                w->left->red = false;
+                _rotateRight(xp);
+                x = _root;
+            }
+        }
+        if (x)
+            x->red = false;
+    }
+};
+
+#endif
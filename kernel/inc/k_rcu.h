@@ -0,0 +1,71 @@
+#ifndef __K_RCU_H__
+#define __K_RCU_H__
+
+#include <cstdint>
+
+#include "k_lock.h"
+
+/**
+ * @brief Read-copy-update
+ *
+ * Readers of an RCU protected structure load its pointer (acquire) between rcu_read_lock and rcu_read_unlock,
+ * which only keep the thread from being preempted, and write nothing shared. An updater publishes a new copy
+ * (release store) and frees the old one after a grace period: once every hart went through a quiescent state,
+ * no reader can still see it. synchronize_rcu waits for one, call_rcu frees from a callback later on.
+ *
+ * A hart is quiescent when it switches tasks, when its timer ISR interrupts code outside any read section
+ * (k_preempt_count is 0) and for as long as it idles. Grace periods are numbered, all callbacks queued while one
+ * runs wait for the next one together. Callbacks run on the hart that queued them, from its timer ISR or idle
+ * loop with interrupts off: free memory, do not block. A read section must not block or sleep either.
+ * Before K_MULTICORE there is a single hart without interrupts: readers cost nothing and updates are immediate.
+ */
+
+struct rcu_head_t
+{
+    rcu_head_t *next = nullptr;
+    void (*fn)(rcu_head_t *) = nullptr;
+    uint64_t gp = 0; // grace period it waits for
+};
+
+inline void rcu_read_lock()
+{
+    k_lock_preempt_off();
+}
+
+inline void rcu_read_unlock()
+{
+    if (k_stage == K_MULTICORE)
+        k_preempt_count--;
+}
+
+struct rcu_read_guard_t
+{
+    rcu_read_guard_t()
+    {
+        rcu_read_lock();
+    }
+    ~rcu_read_guard_t()
+    {
+        rcu_read_unlock();
+    }
+};
+
+// Wait until every reader that may have seen what the caller unpublished is done. Sleeps on threads.
+void synchronize_rcu();
+// Run fn(head) after a grace period, head usually lives in the object to free
+void call_rcu(rcu_head_t *head, void (*fn)(rcu_head_t *));
+
+// Every hart, from k_pre_main: takes part in grace periods from K_MULTICORE on
+void k_rcu_hart_init(int hartid);
+// Stop taking part, once the callbacks of the hart ran: from k_after_main
+void k_rcu_hart_offline();
+// Quiescent state of the calling hart, outside any read section
+void k_rcu_qs();
+// From the timer ISR: quiescent state unless it interrupted a read section, due callbacks. Returns when the hart
+// wants to look again (callbacks pending), 0 for never.
+uint64_t k_rcu_tick(uint64_t now);
+// Around the wait of an idle hart, interrupts off: quiescent meanwhile
+void k_rcu_idle_enter();
+void k_rcu_idle_exit();
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef __K_RING_HPP__
+#define __K_RING_HPP__
+
+#include <cstdint>
+#include <atomic>
+
+/**
+ * @brief Single-producer single-consumer ring
+ *
+ * Indexes are free running and wrap at 2^32, N must be a power of 2.
+ * head and tail sit on their own cache lines so the two sides do not bounce each other.
+ * The layout is plain data, so a ring may be placed in memory shared with U-mode.
+ */
+template <typename T, uint32_t N> struct SPSCRing
+{
+    static_assert(N && (N & (N - 1)) == 0, "SPSCRing size must be a power of 2");
+
+    alignas(64) std::atomic<uint32_t> head = 0; // written by the consumer
+    alignas(64) std::atomic<uint32_t> tail = 0; // written by the producer
+    alignas(64) T entries[N];
+
+    static constexpr uint32_t capacity()
+    {
+        return N;
+    }
+
+    uint32_t size() const
+    {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    bool full() const
+    {
+        return size() >= N;
+    }
+
+    // Producer side
+    bool push(const T &v)
+    {
+        auto t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) >= N)
+            return false;
+        entries[t & (N - 1)] = v;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side
+    bool peek(T &v) const
+    {
+        auto h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+        v = entries[h & (N - 1)];
+        return true;
+    }
+
+    bool pop(T &v)
+    {
+        auto h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+        v = entries[h & (N - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+#endif
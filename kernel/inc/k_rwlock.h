@@ -0,0 +1,114 @@
+#ifndef __K_RWLOCK_H__
+#define __K_RWLOCK_H__
+
+#include <atomic>
+#include <cstdint>
+
+#include "llenv.h"
+
+/**
+ * @brief Locks for read-mostly data
+ *
+ * rwlock_t gives each hart its own reader counter on its own cache line, so readers on different harts never
+ * write a shared word. A writer raises the writer flag, which holds off new readers, then waits for the counters
+ * to drain. Reads nest on a hart; a reader is not preempted. Writers must not wait for readers interrupted on
+ * their own hart: read sides in ISRs need writers with interrupts off.
+ * Kept free of k_main.h so k_drvif.h can use it, the lock calls live in k_rwlock.cpp.
+ *
+ * seqcount_t / seqlock_t are for small snapshots copied as a whole (counters, time): readers never write, they
+ * retry when a write ran meanwhile. Fields are accessed with relaxed atomics. seqcount_t has a single writer,
+ * seqlock_t serializes writers.
+ */
+
+struct rwlock_t
+{
+    struct alignas(64) readers_t
+    {
+        std::atomic<int> n = 0;
+    };
+
+    readers_t readers[K_CONFIG_MAX_PROCESSORS];
+    std::atomic<bool> writer = false;
+
+    void read_lock();
+    void read_unlock();
+    void write_lock();
+    void write_unlock();
+};
+
+struct rw_read_guard_t
+{
+    rwlock_t &l;
+    rw_read_guard_t(rwlock_t &l) : l(l)
+    {
+        l.read_lock();
+    }
+    ~rw_read_guard_t()
+    {
+        l.read_unlock();
+    }
+};
+
+struct rw_write_guard_t
+{
+    rwlock_t &l;
+    rw_write_guard_t(rwlock_t &l) : l(l)
+    {
+        l.write_lock();
+    }
+    ~rw_write_guard_t()
+    {
+        l.write_unlock();
+    }
+};
+
+struct seqcount_t
+{
+    std::atomic<uint32_t> seq = 0; // odd while a write is in progress
+
+    uint32_t read_begin() const
+    {
+        uint32_t s;
+        while ((s = seq.load(std::memory_order_acquire)) & 1)
+            k_cpu_relax();
+        return s;
+    }
+
+    // True when the reads since read_begin may be torn, start over
+    bool read_retry(uint32_t s) const
+    {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return seq.load(std::memory_order_relaxed) != s;
+    }
+
+    void write_begin()
+    {
+        seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    void write_end()
+    {
+        seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+};
+
+struct seqlock_t : seqcount_t
+{
+    std::atomic<bool> busy = false;
+
+    void write_lock()
+    {
+        while (busy.exchange(true, std::memory_order_acquire))
+            k_cpu_relax();
+        write_begin();
+    }
+
+    void write_unlock()
+    {
+        write_end();
+        busy.store(false, std::memory_order_release);
+    }
+};
+
+#endif
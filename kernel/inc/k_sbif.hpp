@@ -199,6 +199,124 @@ class SBIF
         // Hypervisor related not implemented
     };
 
+    class PMU : public impl_helper<SBI_EXT_PMU>
+    {
+      public:
+        // Decoded counter_get_info value
+        struct counter_info_t
+        {
+            unsigned long csr;   // CSR number of a hardware counter
+            unsigned long width; // bits - 1
+            bool firmware;       // read with fwRead() instead of the CSR
+        };
+
+        static constexpr unsigned long eventHW(sbi_pmu_hw_generic_events_t code)
+        {
+            return (SBI_PMU_EVENT_TYPE_HW << SBI_PMU_EVENT_IDX_TYPE_OFFSET) | code;
+        }
+
+        static constexpr unsigned long eventCache(sbi_pmu_hw_cache_id cache, sbi_pmu_hw_cache_op_id op,
+                                                  sbi_pmu_hw_cache_op_result_id result)
+        {
+            return (SBI_PMU_EVENT_TYPE_HW_CACHE << SBI_PMU_EVENT_IDX_TYPE_OFFSET) |
+                   (cache << SBI_PMU_EVENT_HW_CACHE_ID_OFFSET) | (op << SBI_PMU_EVENT_HW_CACHE_OPS_ID_OFFSET) | result;
+        }
+
+        static constexpr unsigned long eventFW(sbi_pmu_fw_event_code_id code)
+        {
+            return (SBI_PMU_EVENT_TYPE_FW << SBI_PMU_EVENT_IDX_TYPE_OFFSET) | code;
+        }
+
+        static long numCounters()
+        {
+            return CSBI(SBI_EXT_PMU_NUM_COUNTERS).value;
+        }
+
+        static long getInfo(unsigned long idx, counter_info_t &info)
+        {
+            auto ret = CSBI(SBI_EXT_PMU_COUNTER_GET_INFO, idx);
+            if (ret.error)
+                return ret.error;
+            info.csr = ret.value & 0xFFF;
+            info.width = (ret.value >> 12) & 0x3F;
+            info.firmware = (long)ret.value < 0;
+            return SBI_SUCCESS;
+        }
+
+        // Find a counter in base + mask able to count event_idx and configure it, returns its index or an error
+        static long configMatch(unsigned long base, unsigned long mask, unsigned long flags, unsigned long event_idx,
+                                uint64_t event_data = 0)
+        {
+            auto ret = CSBI(SBI_EXT_PMU_COUNTER_CFG_MATCH, base, mask, flags, event_idx, event_data);
+            return ret.error ? ret.error : ret.value;
+        }
+
+        // @todo rv32 passes initial values in two registers
+        static auto start(unsigned long base, unsigned long mask, unsigned long flags = 0, uint64_t init = 0)
+        {
+            return CSBI(SBI_EXT_PMU_COUNTER_START, base, mask, flags, init).error;
+        }
+
+        static auto stop(unsigned long base, unsigned long mask, unsigned long flags = 0)
+        {
+            return CSBI(SBI_EXT_PMU_COUNTER_STOP, base, mask, flags).error;
+        }
+
+        static uint64_t fwRead(unsigned long idx)
+        {
+            return CSBI(SBI_EXT_PMU_COUNTER_FW_READ, idx).value;
+        }
+
+        // Read a hardware counter of this hart, csr is in [CSR_CYCLE, CSR_HPMCOUNTER31]
+        static uint64_t hwRead(unsigned long csr)
+        {
+#define _PMU_CSR_CASE(n)                                                                                               \
+    case CSR_HPMCOUNTER##n:                                                                                            \
+        return csr_read(CSR_HPMCOUNTER##n)
+            switch (csr)
+            {
+            case CSR_CYCLE:
+                return csr_read(CSR_CYCLE);
+            case CSR_TIME:
+                return csr_read(CSR_TIME);
+            case CSR_INSTRET:
+                return csr_read(CSR_INSTRET);
+                _PMU_CSR_CASE(3);
+                _PMU_CSR_CASE(4);
+                _PMU_CSR_CASE(5);
+                _PMU_CSR_CASE(6);
+                _PMU_CSR_CASE(7);
+                _PMU_CSR_CASE(8);
+                _PMU_CSR_CASE(9);
+                _PMU_CSR_CASE(10);
+                _PMU_CSR_CASE(11);
+                _PMU_CSR_CASE(12);
+                _PMU_CSR_CASE(13);
+                _PMU_CSR_CASE(14);
+                _PMU_CSR_CASE(15);
+                _PMU_CSR_CASE(16);
+                _PMU_CSR_CASE(17);
+                _PMU_CSR_CASE(18);
+                _PMU_CSR_CASE(19);
+                _PMU_CSR_CASE(20);
+                _PMU_CSR_CASE(21);
+                _PMU_CSR_CASE(22);
+                _PMU_CSR_CASE(23);
+                _PMU_CSR_CASE(24);
+                _PMU_CSR_CASE(25);
+                _PMU_CSR_CASE(26);
+                _PMU_CSR_CASE(27);
+                _PMU_CSR_CASE(28);
+                _PMU_CSR_CASE(29);
+                _PMU_CSR_CASE(30);
+                _PMU_CSR_CASE(31);
+            default:
+                return 0;
+            }
+#undef _PMU_CSR_CASE
+        }
+    };
+
     static const char *getErrorStr(long err)
     {
         const char *err_str[] = {"SBI_SUCCESS",
@@ -0,0 +1,43 @@
+#ifndef __K_STATS_H__
+#define __K_STATS_H__
+
+#include <cstdint>
+
+#include "k_defs.h"
+
+/**
+ * @brief Per-hart kernel statistics
+ *
+ * Each hart only increments its own cache line, with plain adds: no atomics and no sharing on the hot path.
+ * An interrupt nested in an increment may lose a count, which is fine for monitoring.
+ * Readers sum every hart with k_stats_sum(), /proc/stats shows the result.
+ */
+
+#define K_STATS_CAUSES 16 // scause codes kept apart, higher ones land in the last bucket
+
+struct alignas(64) kstats_t
+{
+    uint64_t irq[K_STATS_CAUSES]; // interrupts by cause
+    uint64_t exc[K_STATS_CAUSES]; // exceptions by cause, page faults included
+    uint64_t syscalls;
+    uint64_t ctx_switches;
+    uint64_t heap_ops; // malloc/free/realloc/calloc/memalign calls, see the --wrap in libc_hooks.cpp
+    uint64_t mmu_map;
+    uint64_t mmu_unmap;
+    uint64_t mmu_map_pages;
+    uint64_t mmu_unmap_pages;
+};
+
+extern kstats_t k_stats[K_CONFIG_MAX_PROCESSORS];
+
+// Accumulate every hart into sum
+void k_stats_sum(kstats_t &sum);
+// Copy the block of one hart
+void k_stats_hart(int hart, kstats_t &out);
+
+// Early boot (hart -1) is accounted to slot 0, users see k_current_hart() through k_main.h
+#define _K_STATS_HART() (k_current_hart() < 0 ? 0 : k_current_hart())
+#define K_STAT_ADD(field, n) (k_stats[_K_STATS_HART()].field += (n))
+#define K_STAT_INC(field) K_STAT_ADD(field, 1)
+
+#endif
@@ -3,7 +3,9 @@
 
 #include <cstdio>
 #include <string>
+#include <atomic>
 #include "k_drvif.h"
+#include "k_rbtree.hpp"
 
 #define __K_PROP_EXPORT__(name, pri)                                                                                   \
     const auto &name() const                                                                                           \
@@ -11,13 +13,63 @@
         return pri;                                                                                                    \
     }
 
+struct umode_basic_ctx_t;
+
 class SysScheduler : public DriverBase
 {
   public:
+    enum task_state_t
+    {
+        TASK_NEW = 0,
+        TASK_READY,   // queued on its hart
+        TASK_RUNNING, // current task of its hart
+        TASK_BLOCKED, // waiting for k_thread_wake
+        TASK_DEAD
+    };
+
+    // Deadline parameters and accounting, times in CSR_TIME ticks
+    struct dl_t
+    {
+        uint64_t runtime = 0;      // budget per period
+        uint64_t deadline = 0;     // relative to the release
+        uint64_t period = 0;
+        uint64_t budget = 0;       // left for the current job
+        uint64_t release = 0;      // start of the current period
+        uint64_t abs_deadline = 0; // release + deadline, pushed back by CBS
+        bool throttled = false;    // out of budget, waits for its deadline
+        bool done = false;         // job finished early, waits for the next period
+        bool started = false;      // current job got the hart at least once
+        uint64_t jobs = 0;
+        uint64_t misses = 0;       // jobs finished or throttled past their deadline
+        uint64_t jitter_sum = 0;   // release to first dispatch of each job
+        uint64_t jitter_max = 0;
+    };
+
+    // A kernel thread. The first two fields are set by the creator, the rest is managed by k_thread.cpp.
     struct task_t
     {
         int priority;
-        uintptr_t start;
+        uintptr_t start; // void (*)(void *arg)
+
+        void *arg = nullptr;
+        const char *name = nullptr;
+        uint32_t tid = 0;
+        int hart = -1;                    // hart whose run queue the task belongs to, or that ran it last
+        unsigned long affinity = ~0UL;    // bit n: may run on hart n
+        std::atomic_bool on_cpu = false;  // a hart is still on its stack
+        std::atomic<int> state = TASK_NEW;
+        umode_basic_ctx_t *ctx = nullptr; // frame to resume, valid while switched out
+        void *stack = nullptr;            // K_CONFIG_STACK_SIZE bytes aligned to their size, nullptr for boot tasks
+        uintptr_t tls = 0;                // tp of the task, hart locals live at the top of its stack
+        void *fp = nullptr;               // FP registers, K_CONFIG_THREAD_FP only
+        bool fp_used = false;             // fp holds a saved state
+        task_t *next = nullptr;           // run queue link, owned by the scheduler
+        rb_node_t rb;                     // run queue tree link, owned by the scheduler
+        uint64_t ticks = 0;               // scheduler ticks spent running
+        uint64_t vruntime = 0;            // weighted CSR_TIME spent running, fair scheduler
+        dl_t *dl = nullptr;               // deadline task when set, see setDeadline
+        task_t *list_prev = nullptr;      // every thread, k_thread_foreach
+        task_t *list_next = nullptr;
     };
 
     dev_type_t getDeviceType() override
@@ -25,8 +77,47 @@ class SysScheduler : public DriverBase
         return DEV_TYPE_SYS;
     }
 
-    virtual uint32_t addTask(long hdl, const task_t &) = 0;
-    virtual int removeTask(long hdl, uint32_t) = 0;
+    // One device per hart, added with the hart id as node; hdl below is what addDevice returned.
+    // Every call is made with interrupts disabled on the calling hart, implementations synchronize with
+    // other harts. A scheduler may migrate a task by handing it to another hart's pickNext.
+
+    // Queue a runnable task
+    virtual int addTask(long hdl, task_t *task) = 0;
+    // Take a queued task off, K_EALREADY when it is not queued
+    virtual int removeTask(long hdl, task_t *task) = 0;
+    // Dequeue the task to run next on the hart, nullptr when nothing is runnable
+    virtual task_t *pickNext(long hdl) = 0;
+    // Scheduler tick for the running task, true when it should give the hart up
+    virtual bool tick(long hdl, task_t *curr)
+    {
+        return true;
+    }
+    // Tasks waiting for the hart, may be approximate but not 0 while one is; the periodic tick stops at 0
+    virtual size_t queued(long hdl)
+    {
+        return 1;
+    }
+    // pickNext of an idle hart takes work queued on others, busy harts then wake parked ones
+    virtual bool stealsWork()
+    {
+        return false;
+    }
+    // True when curr may not keep the hart even if pickNext has nothing else, the hart idles then
+    virtual bool throttled(long hdl, task_t *curr)
+    {
+        return false;
+    }
+    // CSR_TIME at which the scheduler wants the hart to reschedule (a release, a budget running out), 0 for none
+    virtual uint64_t nextEvent(long hdl)
+    {
+        return 0;
+    }
+    // Make task (the caller of this hart) a deadline task, runtime 0 makes it a normal one again.
+    // task->dl is allocated by the caller. K_ENOSPC when admission control rejects it.
+    virtual int setDeadline(long hdl, task_t *task, uint64_t runtime, uint64_t deadline, uint64_t period)
+    {
+        return K_ENOTSUPP;
+    }
 
   protected:
 };
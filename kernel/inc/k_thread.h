@@ -0,0 +1,84 @@
+#ifndef __K_THREAD_H__
+#define __K_THREAD_H__
+
+#include "k_main.h"
+#include "k_sysdev.h"
+
+/**
+ * @brief Preemptive kernel threads
+ *
+ * A thread owns a K_CONFIG_STACK_SIZE stack aligned to its size, with its own copy of the hart locals at the top,
+ * exactly like a hart stack: the ISR entries find tp from sp, so traps taken on a thread stack just work.
+ * A switched-out thread is a full ISR frame (umode_basic_ctx_t) on its stack. The timer ISR switches by
+ * returning another frame, blocking calls by building one and resuming the next task through sret.
+ *
+ * Each hart runs the task that called k_main (its boot task), an idle task and whatever the SysScheduler
+ * hands out for it through pickNext. Holding a lock_t disables preemption, see k_preempt_count.
+ */
+
+using thread_t = SysScheduler::task_t;
+
+// Disables S-mode interrupts of this hart for its lifetime, then puts SIE back exactly as it was: a switch away and
+// back in between resumes with SIE on, the guard turns it off again for a caller that had it off
+struct irq_guard_t
+{
+    unsigned long sstatus;
+
+    irq_guard_t()
+    {
+        sstatus = csr_read_clear(CSR_SSTATUS, SSTATUS_SIE);
+    }
+    ~irq_guard_t()
+    {
+        if (sstatus & SSTATUS_SIE)
+            csr_set(CSR_SSTATUS, SSTATUS_SIE);
+        else
+            csr_clear(CSR_SSTATUS, SSTATUS_SIE);
+    }
+};
+
+// Boot hart, before the other harts start: one scheduler device per hart
+int k_thread_setup();
+// Every hart, from k_pre_main: wraps the running context as the boot task and creates the idle task
+int k_thread_init(int hartid);
+
+// Create a thread queued on hart (-1 for the calling hart), it exits when fn returns
+thread_t *k_thread_create(void (*fn)(void *), void *arg, const char *name = nullptr, int priority = 0,
+                          int hart = -1);
+thread_t *k_thread_self();
+// Give the hart to the next runnable task, if any
+void k_yield();
+// Switch away until k_thread_wake; the caller sets TASK_BLOCKED first, see wait queues. Resumes with SIE as it was.
+void k_thread_block();
+// Block the calling thread for at least us microseconds (hres timeout), spins on harts without threads
+void k_thread_sleep_us(uint64_t us);
+// Make a blocked task runnable again, false when it was not blocked. Any hart, ISRs included.
+bool k_thread_wake(thread_t *t);
+// k_thread_wake in two steps, for wakers holding a lock the task may still take before it blocks: claim it
+// (BLOCKED to READY) under the lock, enqueue it once the lock is released. A claimed task cannot run off, it
+// blocks until enqueued.
+bool k_thread_claim(thread_t *t);
+void k_thread_enqueue(thread_t *t);
+[[noreturn]] void k_thread_exit();
+// Run tasks until every created thread has exited
+void k_thread_drain();
+// Harts the task may run on (bit n = hart n), the load balancer and idle harts respect it
+void k_thread_set_affinity(thread_t *t, unsigned long mask);
+// Make the calling thread a deadline task: runtime every period, done within deadline of each release.
+// All 0 makes it a normal thread again. K_ENOSPC when the hart has not enough bandwidth left,
+// K_ENOTSUPP unless the scheduler is scheduler-edf.
+int k_thread_set_deadline(uint64_t runtime_us, uint64_t deadline_us, uint64_t period_us);
+// Deadline task: the current job is done, sleep until the next period. Other threads: k_yield.
+void k_thread_dl_wait();
+// Wake a hart parked in its idle task, not the calling one: it flushes the log and looks at the run queues. Any
+// context, nothing before K_MULTICORE.
+void k_thread_kick_idle();
+// Call fn for every thread, under a lock: fn must not block or create and reap threads
+void k_thread_foreach(void (*fn)(const thread_t *t, void *arg), void *arg);
+
+// Timer ISR side: account a tick at now, returns when the scheduler wants the next timer interrupt (0: never)
+uint64_t k_thread_tick(uint64_t now);
+// Timer ISR side: returns the frame to resume, uctx or the one of the task switched to
+umode_basic_ctx_t *k_thread_preempt(umode_basic_ctx_t *uctx);
+
+#endif
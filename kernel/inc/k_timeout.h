@@ -0,0 +1,60 @@
+#ifndef __K_TIMEOUT_H__
+#define __K_TIMEOUT_H__
+
+#include <cstdint>
+#include <atomic>
+
+#include "k_defs.h"
+#include "k_rbtree.hpp"
+
+/**
+ * @brief Kernel timeouts
+ *
+ * Each hart has a hierarchical timing wheel for the bulk of timeouts (protocol timers, I/O deadlines): levels of
+ * 64 buckets, each level spanning 64 times the one below, with a resolution of K_CONFIG_TIMER_WHEEL_US (a jiffy).
+ * Add and cancel are O(1). A bucket of an upper level is cascaded into the lower ones when the wheel gets to it.
+ * A wheel timeout never fires early and at most a jiffy late; ones beyond the top level wait there and are placed
+ * again on each cascade.
+ * K_TIMEOUT_HRES timeouts go to a red-black tree ordered by CSR_TIME instead, for deadlines finer than a jiffy.
+ *
+ * Both run from the timer ISR of the hart they were added on, with interrupts off: callbacks must be short and
+ * must not block, they may add timeouts again. The hart's timer is programmed for the next due bucket or
+ * tree entry only, empty buckets cost nothing. Cancel does not reprogram it, an early interrupt finds nothing due.
+ */
+
+struct timeout_t;
+using timeout_fn_t = void (*)(timeout_t *t, void *arg);
+
+struct timeout_t
+{
+    timeout_fn_t fn = nullptr;
+    void *arg = nullptr;
+    uint64_t expires = 0; // CSR_TIME
+
+    // Owned by k_timeout.cpp, under the lock of the hart it is queued on
+    timeout_t *prev = nullptr; // wheel bucket links
+    timeout_t *next = nullptr;
+    rb_node_t rb;
+    volatile int16_t hart = -1; // hart it was added on
+    int16_t slot = -1;          // wheel bucket
+    volatile uint8_t state = 0; // TIMEOUT_*
+};
+
+#define K_TIMEOUT_HRES 1 // exact expiry from the red-black tree instead of the wheel
+
+// Every hart, from k_pre_main
+int k_timeout_hart_init(int hartid);
+
+void k_timeout_init(timeout_t *t, timeout_fn_t fn, void *arg);
+// Queue t to fire at expires (CSR_TIME) on the calling hart, a pending t is moved
+int k_timeout_add(timeout_t *t, uint64_t expires, int flags = 0);
+// K_EALREADY when t was not pending: fired, running or never added
+int k_timeout_cancel(timeout_t *t);
+// Same, then wait for a running callback of t to return. Not from that callback.
+int k_timeout_cancel_sync(timeout_t *t);
+bool k_timeout_pending(const timeout_t *t);
+
+// Timer ISR: run what is due on this hart, returns the CSR_TIME of the next timeout (0: none)
+uint64_t k_timeout_run(uint64_t now);
+
+#endif
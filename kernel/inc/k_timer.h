@@ -0,0 +1,39 @@
+#ifndef __K_TIMER_H__
+#define __K_TIMER_H__
+
+#include <cstdint>
+
+#include "k_defs.h"
+
+/**
+ * @brief Per-hart timer queue, tickless
+ *
+ * Every user of a hart's supervisor timer owns a slot with the CSR_TIME it wants the next interrupt at, 0 for
+ * none. The SBI timer is programmed for the earliest slot, and only when that changes: no slot, no interrupt.
+ * The scheduler only asks for its tick while tasks wait for the hart, housekeeping runs at 1 Hz while the hart
+ * is busy and stops when it idles.
+ * A slot belongs to its hart: the calls below act on the calling hart and need interrupts off.
+ */
+
+enum k_timer_src_t
+{
+    K_TIMER_HOUSEKEEPING = 0, // k_perf_publish, 1 Hz
+    K_TIMER_PROF,             // sampling profiler
+    K_TIMER_SCHED,            // scheduler tick and events (deadline releases and budgets)
+    K_TIMER_TIMEOUTS,         // next due kernel timeout, see k_timeout.h
+    K_TIMER_RCU,              // RCU callbacks waiting for a grace period, see k_rcu.h
+    K_TIMER_SOURCES
+};
+
+void k_timer_set(int src, uint64_t when);
+uint64_t k_timer_get(int src);
+// Program the timer for the earliest slot, nothing when it is already
+void k_timer_program();
+// Park the hart until an interrupt is pending: wfi, or an SBI HSM retentive suspend with K_CONFIG_IDLE_SUSPEND.
+// Housekeeping stops meanwhile. Called with interrupts off, the pending interrupt is taken once they are on.
+void k_timer_idle();
+// Make hart go through its timer ISR (timers, then the scheduler) soon: an IPI, or for the calling hart an
+// immediate timer interrupt. Interrupts off.
+void k_timer_kick(int hart);
+
+#endif
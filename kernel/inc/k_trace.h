@@ -0,0 +1,100 @@
+#ifndef __K_TRACE_H__
+#define __K_TRACE_H__
+
+#include <cstdint>
+#include <atomic>
+
+#include "k_defs.h"
+
+/**
+ * @brief Binary trace events
+ *
+ * Every event has a descriptor placed in the .trace.events section by K_TRACE_EVENT, its id is the index in that
+ * section, so the catalog is built by the linker and a host tool can decode a dump with the kernel ELF alone.
+ * A trace point writes one fixed-size record (CSR_TIME, hart, id, up to 4 arguments) into the hart's own ring,
+ * claiming the slot with a single atomic add so ISRs can nest. Rings overwrite their oldest records.
+ *
+ * Define an event once, at namespace scope of a .cpp:  K_TRACE_EVENT(vfs_open, "fd=%ld");
+ * declare it where it is used:                         K_TRACE_EVENT_DECLARE(vfs_open);
+ * and record it:                                       K_TRACE(vfs_open, fd);
+ */
+
+struct alignas(16) trace_event_t
+{
+    const char *name;
+    const char *fmt; // printf format of the arguments, for the decoder
+};
+
+struct trace_rec_t
+{
+    uint64_t time;
+    uint32_t seq; // slot sequence + 1, written last, a reader drops records whose seq does not match
+    uint16_t hart;
+    uint16_t event;
+    uint64_t args[4];
+};
+
+// Dump layout: header, then `harts` rings of `records` trace_rec_t each
+struct trace_dump_hdr_t
+{
+    uint32_t magic; // K_TRACE_MAGIC
+    uint16_t version;
+    uint16_t rec_size;
+    uint32_t harts;
+    uint32_t records;
+    uint64_t catalog; // address of the first descriptor, to look ids up in the ELF
+    uint64_t timebase;
+};
+
+#define K_TRACE_MAGIC 0x4B545243 // "KTRC"
+
+extern trace_event_t _trace_events_start[], _trace_events_end[];
+
+struct trace_buf_t;
+extern trace_buf_t *k_trace_bufs[K_CONFIG_MAX_PROCESSORS];
+extern std::atomic_bool k_trace_on;
+
+void k_trace_record(const trace_event_t *ev, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3);
+
+// Allocate the rings of every hart and start recording
+int k_trace_start();
+void k_trace_stop();
+// Write header and rings to path, recording is paused meanwhile
+int k_trace_dump(const char *path);
+
+#define K_TRACE_EVENT(ev, fmt)                                                                                         \
+    __attribute__((section(".trace.events"), used)) trace_event_t _k_trace_ev_##ev = {#ev, fmt}
+#define K_TRACE_EVENT_DECLARE(ev) extern trace_event_t _k_trace_ev_##ev
+
+#if K_CONFIG_TRACE
+template <typename... A> inline void _k_trace(const trace_event_t *ev, A... args)
+{
+    static_assert(sizeof...(A) <= 4, "K_TRACE takes up to 4 arguments");
+    if (!k_trace_on.load(std::memory_order_relaxed))
+        return;
+    uint64_t a[4] = {(uint64_t)args...};
+    k_trace_record(ev, a[0], a[1], a[2], a[3]);
+}
+#define K_TRACE(ev, ...) _k_trace(&_k_trace_ev_##ev, ##__VA_ARGS__)
+#else
+#define K_TRACE(ev, ...)                                                                                               \
+    do                                                                                                                 \
+    {                                                                                                                  \
+    } while (0)
+#endif
+
+// Events of the core kernel, defined in k_trace.cpp
+K_TRACE_EVENT_DECLARE(isr_enter);
+K_TRACE_EVENT_DECLARE(isr_exit);
+K_TRACE_EVENT_DECLARE(vfs_open);
+K_TRACE_EVENT_DECLARE(vfs_close);
+K_TRACE_EVENT_DECLARE(vfs_read);
+K_TRACE_EVENT_DECLARE(vfs_write);
+K_TRACE_EVENT_DECLARE(mmu_map);
+K_TRACE_EVENT_DECLARE(mmu_unmap);
+K_TRACE_EVENT_DECLARE(sched_add);
+K_TRACE_EVENT_DECLARE(sched_remove);
+K_TRACE_EVENT_DECLARE(sched_switch);
+K_TRACE_EVENT_DECLARE(sched_steal);
+
+#endif
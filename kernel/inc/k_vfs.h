@@ -2,17 +2,47 @@
 #define __K_VFS_H__
 
 #include <cstdio>
+#include <cstring>
 #include <string>
 #include <functional>
+#include <map>
+#include <vector>
+#include <atomic>
+#include <fcntl.h>
 #include <sys/lock.h>
+#include <sys/stat.h>
+
+#if __has_include(<sys/uio.h>)
+#include <sys/uio.h>
+#else
+// newlib does not ship <sys/uio.h> for bare-metal targets
+struct iovec
+{
+    void *iov_base;
+    size_t iov_len;
+};
+#endif
 
 // #include <filesystem>
 // #include "k_drvif.h"
 #include "k_defs.h"
 #include "k_lock.h"
+#include "k_rcu.h"
+#include "k_rwlock.h"
+#include "k_trace.h"
 
 #define FS_INSTALL_FUNC(V) __attribute__((constructor(V)))
 
+class VMemoryMgr;
+
+// Directory entry, newlib has no <dirent.h> for bare-metal targets
+struct dirent_t
+{
+    ino_t d_ino;
+    mode_t d_mode; // file type bits (S_IFMT) of the entry
+    char d_name[256];
+};
+
 class BasicFS
 {
   public:
@@ -22,16 +52,117 @@ class BasicFS
     virtual int write(int fd, const void *buf, size_t count) = 0;
     virtual int lseek(int fd, off_t offset, int whence) = 0;
     virtual int fstat(int fd, struct stat *buf) = 0;
-    // virtual int stat(const char *path, struct stat *buf) = 0;
 
-    // virtual int opendir(const char *path) = 0;
-    // virtual int readdir(int fd, struct dirent *dirp) = 0;
-    // virtual int closedir(int fd) = 0;
+    // Positional vectored I/O, the file position is left untouched.
+    // The fallbacks go through lseek + read/write, so they are NOT atomic against other users of fd;
+    // override them whenever the FS can address data directly.
+    virtual int preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+    {
+        return _rwv(fd, iov, iovcnt, offset, false);
+    }
+    virtual int pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+    {
+        return _rwv(fd, iov, iovcnt, offset, true);
+    }
+
+    // Hint that [offset, offset + count) of fd is likely to be read soon.
+    // Must not block: FS backed by slow media should queue the prefetch and return at once.
+    virtual int readahead(int fd, off_t offset, size_t count)
+    {
+        return K_ENOTSUPP;
+    }
+
+    virtual int ftruncate(int fd, off_t length)
+    {
+        return K_ENOTSUPP;
+    }
+
+    // Get the page backing offset of fd (allocated if needed) so that it can be mapped.
+    // The page stays owned by the FS, every mapping and read/write share the same data.
+    // Each call pins the page: truncating the file does not free it before putpage.
+    virtual int getpage(int fd, off_t offset, uintptr_t *page)
+    {
+        return K_ENOTSUPP;
+    }
+
+    // Drop the pin getpage took on page, once its mapping is gone
+    virtual int putpage(uintptr_t page)
+    {
+        return K_OK;
+    }
+
+    // Paths are relative to the mount point without leading or trailing slashes, "" is the root.
+    // The fallback goes through open + fstat, override it if opening has side effects.
+    virtual int stat(const char *path, struct stat *buf)
+    {
+        int fd = open(path, O_RDONLY, 0);
+        if (fd < 0)
+            return fd;
+        int rc = fstat(fd, buf);
+        close(fd);
+        return rc;
+    }
+
+    // readdir returns 1 when dirp is filled, 0 at the end of the directory, or an error
+    virtual int opendir(const char *path)
+    {
+        return K_ENOTSUPP;
+    }
+    virtual int readdir(int dd, dirent_t *dirp)
+    {
+        return K_ENOTSUPP;
+    }
+    virtual int closedir(int dd)
+    {
+        return K_ENOTSUPP;
+    }
 
     // virtual int mkdir(const char *path, mode_t mode) = 0;
     // virtual int rmdir(const char *path) = 0;
 
     virtual ~BasicFS() = default;
+
+  protected:
+    // Readahead of memory backed data: a prefetch per cache line (prefetch.r with Zicbop, nothing without) and
+    // one load per page, so the reader finds the translations in the TLB. Never blocks.
+    static void _prefetch(const void *p, size_t len)
+    {
+        constexpr uintptr_t LINE = 64, PAGE = 4096;
+        auto a = (uintptr_t)p, end = a + len;
+        for (auto l = a & ~(LINE - 1); l < end; l += LINE)
+            __builtin_prefetch((const void *)l, 0, 1);
+        for (auto pg = a & ~(PAGE - 1); pg < end; pg += PAGE)
+            (void)*(const volatile uint8_t *)(pg < a ? a : pg);
+    }
+
+  private:
+    int _rwv(int fd, const struct iovec *iov, int iovcnt, off_t offset, bool wr)
+    {
+        if (iovcnt < 0 || offset < 0)
+            return K_EINVAL;
+        int cur = lseek(fd, 0, SEEK_CUR);
+        if (cur < 0)
+            return cur;
+        int rc = lseek(fd, offset, SEEK_SET);
+        if (rc < 0)
+            return rc;
+        int total = 0;
+        for (int i = 0; i < iovcnt; i++)
+        {
+            rc = wr ? write(fd, iov[i].iov_base, iov[i].iov_len) : read(fd, iov[i].iov_base, iov[i].iov_len);
+            if (rc < 0)
+            {
+                if (!total)
+                    total = rc;
+                break;
+            }
+            total += rc;
+            if ((size_t)rc < iov[i].iov_len)
+                break;
+        }
+        lseek(fd, cur, SEEK_SET);
+        return total;
+    }
 };
 
 constexpr int FILE_STDIN = 0;
@@ -53,11 +184,13 @@ class VirtualFS
         {
             return K_EINVAL;
         }
+        rw_write_guard_t g(_fs_rw);
         _fs_factories.push_back(std::make_tuple(fs_name, nf, df));
         return 0;
     }
     static int unregisterFS(const std::string &fs_name)
     {
+        rw_write_guard_t g(_fs_rw);
         for (auto it = _fs_factories.begin(); it != _fs_factories.end(); it++)
         {
             if (std::get<0>(*it) == fs_name)
@@ -70,56 +203,9 @@ class VirtualFS
     }
 
     // POSIX-like functionss
-    static int open(const char *path, int flags, int mode)
-    {
-        // printf("Open %s", path);
-        _fs_lock.lock();
-        BasicFS *fs = nullptr;
-        size_t max_len = 0;
-        for (auto x : _fs_map)
-        {
-            if (std::string_view(path).find(x.first) == 0)
-            {
-                if (max_len < x.first.size())
-                {
-                    max_len = x.first.size();
-                    fs = x.second.first;
-                }
-            }
-        }
-        if (fs)
-        {
-            int ret = fs->open(path+max_len, flags, mode);
-            if (ret >= 0)
-            {
-                auto fd = _global_fd_counter++;
-                _global_fd_map.insert(std::make_pair(fd, std::make_pair(fs, ret)));
-                _fs_lock.unlock();
-                return fd;
-            }
+    static int open(const char *path, int flags, int mode);
+    static int close(int fd);
 
-            _fs_lock.unlock();
-            return ret;
-        }
-        // printf("Failed!\n");
-        _fs_lock.unlock();
-        return K_ENOENT;
-    }
-    static int close(int fd)
-    {
-        _fs_lock.lock();
-        auto it = _global_fd_map.find(fd);
-        if (it != _global_fd_map.end())
-        {
-            int ret = it->second.first->close(it->second.second);
-            if (ret == K_OK)
-                _global_fd_map.erase(it);
-            _fs_lock.unlock();
-            return ret;
-        }
-        _fs_lock.unlock();
-        return K_ENOENT;
-    }
     static int read(int fd, void *buf, int count)
     {
         if (fd == FILE_STDIN)
@@ -128,16 +214,20 @@ class VirtualFS
             return 0;
         }
 
-        _fs_lock.lock();
-        auto it = _global_fd_map.find(fd);
-        _fs_lock.unlock();
-
-        if (it != _global_fd_map.end())
+        auto f = _get(fd);
+        if (!f)
+            return K_ENOENT;
+        f->lock.lock();
+        int ret = f->mnt->fs->read(f->fd, buf, count);
+        if (ret > 0)
         {
-            return it->second.first->read(it->second.second, buf, count);
+            _readahead(*f, f->pos, ret);
+            f->pos += ret;
         }
-
-        return K_ENOENT;
+        f->lock.unlock();
+        _put(f);
+        K_TRACE(vfs_read, fd, count, ret);
+        return ret;
     }
 
     static int write(int fd, const void *buf, int count)
@@ -147,16 +237,17 @@ class VirtualFS
             return _write_stdout((const char *)buf, count);
         }
 
-        _fs_lock.lock();
-        auto it = _global_fd_map.find(fd);
-        _fs_lock.unlock();
-
-        if (it != _global_fd_map.end())
-        {
-            return it->second.first->write(it->second.second, buf, count);
-        }
-
-        return K_ENOENT;
+        auto f = _get(fd);
+        if (!f)
+            return K_ENOENT;
+        f->lock.lock();
+        int ret = f->mnt->fs->write(f->fd, buf, count);
+        if (ret > 0)
+            f->pos += ret;
+        f->lock.unlock();
+        _put(f);
+        K_TRACE(vfs_write, fd, count, ret);
+        return ret;
     }
 
     static int lseek(int fd, off_t offset, int whence)
@@ -164,77 +255,239 @@ class VirtualFS
         if(fd == FILE_STDIN || fd == FILE_STDOUT || fd == FILE_STDERR)
             return K_ENOTSUPP;
 
-        _fs_lock.lock();
-        auto it = _global_fd_map.find(fd);
-        _fs_lock.unlock();
-        
-        if (it != _global_fd_map.end())
+        auto f = _get(fd);
+        if (!f)
+            return K_ENOENT;
+        f->lock.lock();
+        int ret = f->mnt->fs->lseek(f->fd, offset, whence);
+        if (ret >= 0)
+            f->pos = ret;
+        f->lock.unlock();
+        _put(f);
+        return ret;
+    }
+
+    static int fstat(int fd, struct stat *buf)
+    {
+        if (!buf)
+            return K_EINVAL;
+        if (fd == FILE_STDIN || fd == FILE_STDOUT || fd == FILE_STDERR)
         {
-            return it->second.first->lseek(it->second.second, offset, whence);
+            memset(buf, 0, sizeof(*buf));
+            buf->st_mode = S_IFCHR | 0620;
+            return K_OK;
         }
 
-        return K_ENOENT;
+        auto f = _get(fd);
+        if (!f)
+            return K_ENOENT;
+        memset(buf, 0, sizeof(*buf));
+        int ret = f->mnt->fs->fstat(f->fd, buf);
+        _put(f);
+        return ret;
     }
-    static int fstat(int fd, struct stat *buf)
+
+    static int readv(int fd, const struct iovec *iov, int iovcnt)
     {
-        return -1;
+        return _rwv(fd, iov, iovcnt, false);
     }
 
-    static int mount(const char *path, const char *devicePath, int flags, int mode, const char *fs_name = nullptr)
+    static int writev(int fd, const struct iovec *iov, int iovcnt)
     {
-        _fs_lock.lock();
-        for (auto &fs : _fs_factories)
-        {
-            if ((fs_name && std::get<0>(fs) == fs_name) || !fs_name)
-            {
-                auto [ret, fs_instance] = std::get<1>(fs)(devicePath);
-                if (ret == K_OK)
-                {
-                    _fs_map.insert(std::make_pair(path, std::make_pair(fs_instance, std::get<2>(fs))));
-                    _fs_lock.unlock();
-                    return 0;
-                }
-                if (ret != K_ENOTSUPP) // Something other than not supported happened
-                {
-                    _fs_lock.unlock();
-                    return ret;
-                }
-            }
-        }
-        _fs_lock.unlock();
-        return K_ENOTSUPP; // No FS could be mounted
+        return _rwv(fd, iov, iovcnt, true);
     }
 
-    static int umount(const char *path) // After unmounting, the FS instance is deleted
+    // Positional calls leave the file position alone and do not take the file lock
+    static int preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
     {
-        _fs_lock.lock();
-        auto it = _fs_map.find(path);
-        if (it != _fs_map.end())
+        if (fd == FILE_STDIN || fd == FILE_STDOUT || fd == FILE_STDERR)
+            return K_ENOTSUPP;
+
+        auto f = _get(fd);
+        if (!f)
+            return K_ENOENT;
+        int ret = f->mnt->fs->preadv(f->fd, iov, iovcnt, offset);
+        if (ret > 0)
         {
-            it->second.second(it->second.first);
-            _fs_map.erase(it);
-            _fs_lock.unlock();
-            return 0;
+            f->lock.lock();
+            _readahead(*f, offset, ret);
+            f->lock.unlock();
         }
-        _fs_lock.unlock();
-        return K_ENOTSUPP;
+        _put(f);
+        return ret;
     }
 
-    // int stat(const char *path, struct stat *buf);
+    static int pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+    {
+        if (fd == FILE_STDIN || fd == FILE_STDOUT || fd == FILE_STDERR)
+            return K_ENOTSUPP;
 
-    // int opendir(const char *path);
-    // int readdir(int fd, struct dirent *dirp);
-    // int closedir(int fd);
+        auto f = _get(fd);
+        if (!f)
+            return K_ENOENT;
+        int ret = f->mnt->fs->pwritev(f->fd, iov, iovcnt, offset);
+        _put(f);
+        return ret;
+    }
+
+    static int ftruncate(int fd, off_t length)
+    {
+        if (fd == FILE_STDIN || fd == FILE_STDOUT || fd == FILE_STDERR)
+            return K_EINVAL;
+
+        auto f = _get(fd);
+        if (!f)
+            return K_ENOENT;
+        int ret = f->mnt->fs->ftruncate(f->fd, length);
+        _put(f);
+        return ret;
+    }
+
+    // Map [offset, offset + len) of fd at vaddr, sharing the FS pages. The caller confirms vmm.
+    static int mmap(VMemoryMgr *vmm, uintptr_t vaddr, size_t len, int prot, int fd, off_t offset);
+    // Undo mmap of fd at vaddr. Confirms vmm (pending maps of the caller included) before the pages are unpinned.
+    static int munmap(VMemoryMgr *vmm, uintptr_t vaddr, size_t len, int prot, int fd);
+
+    static int pread(int fd, void *buf, int count, off_t offset)
+    {
+        struct iovec iov = {buf, (size_t)count};
+        return preadv(fd, &iov, 1, offset);
+    }
+
+    static int pwrite(int fd, const void *buf, int count, off_t offset)
+    {
+        struct iovec iov = {(void *)buf, (size_t)count};
+        return pwritev(fd, &iov, 1, offset);
+    }
+
+    // Only mount and umount are exclusive, everything else runs against a snapshot of the mount table
+    static int mount(const char *path, const char *devicePath, int flags, int mode, const char *fs_name = nullptr);
+    static int umount(const char *path); // After unmounting, the FS instance is deleted
+
+    static int stat(const char *path, struct stat *buf)
+    {
+        if (!path || !buf)
+            return K_EINVAL;
+        std::string rel;
+        auto mnt = _lookup(path, rel);
+        if (!mnt)
+            return K_ENOENT;
+        memset(buf, 0, sizeof(*buf));
+        int ret = mnt->fs->stat(rel.c_str(), buf);
+        _put(mnt);
+        return ret;
+    }
+
+    // Directory handles share the fd number space but are only valid for readdir/closedir
+    static int opendir(const char *path);
+
+    // Returns 1 when dirp is filled, 0 at the end of the directory
+    static int readdir(int dd, dirent_t *dirp)
+    {
+        if (!dirp)
+            return K_EINVAL;
+        auto f = _get(dd, true);
+        if (!f)
+            return K_ENOENT;
+        f->lock.lock();
+        int ret = f->mnt->fs->readdir(f->fd, dirp);
+        f->lock.unlock();
+        _put(f);
+        return ret;
+    }
+
+    static int closedir(int dd)
+    {
+        return _release(dd, true);
+    }
 
   private:
-    static std::map<std::string, std::pair<BasicFS *, deleteInstanceFunc_t>> _fs_map;
+    // Sequential readahead state, the window grows on sequential hits and collapses on random access
+    struct readahead_t
+    {
+        off_t prev_end = 0;    // where the last read stopped, so a read from the start is sequential
+        off_t marker = 0;      // end of the window already requested from the FS
+        size_t window = 0;     // 0 if collapsed
+        bool disabled = false; // FS does not support readahead
+    };
+
+    // Freed by whoever drops the last reference, the mount table holds one while mounted
+    struct mount_t
+    {
+        std::string path;
+        BasicFS *fs;
+        deleteInstanceFunc_t del;
+        std::atomic<int> refs = 1;
+        lock_t lock; // serializes open/close into the FS, I/O does not take it
+    };
+
+    // Immutable once published, lookups read it under rcu_read_lock: mount/umount swap in a new copy and free the old
+    // one after a grace period (call_rcu, synchronize_rcu)
+    struct mount_table_t : rcu_head_t, std::map<std::string, mount_t *>
+    {
+    };
+
+    // Slots are never freed, so a stale pointer can always be probed through refs.
+    // refs == 0 means free; the table holds one reference while open is set.
+    struct file_t
+    {
+        std::atomic<int> refs = 0;
+        std::atomic_bool open = false;
+        bool dir = false;
+        mount_t *mnt = nullptr;
+        int fd = -1; // fd inside the FS
+        lock_t lock; // file position and readahead
+        off_t pos = 0;
+        readahead_t ra;
+    };
+
     static std::vector<std::tuple<std::string, newInstanceFunc_t, deleteInstanceFunc_t>>
         _fs_factories; // fs-name, new-instance-func, delete-instance-func
-    static lock_t _fs_lock;
-    static std::map<int, std::pair<BasicFS *, int>> _global_fd_map;
-    static int _global_fd_counter;
+    static rwlock_t _fs_rw;    // _fs_factories
+    static lock_t _mount_lock; // serializes mount and umount
+    static std::atomic<mount_table_t *> _mounts;
+    static file_t _files[K_CONFIG_VFS_MAX_FILES];
+    static constexpr int FD_BASE = 3; // 0, 1, 2 are reserved for stdin, stdout, stderr of system
+
+    static file_t *_get(int fd, bool dir = false)
+    {
+        if (fd < FD_BASE || fd >= FD_BASE + K_CONFIG_VFS_MAX_FILES)
+            return nullptr;
+        auto f = &_files[fd - FD_BASE];
+        int r = f->refs.load(std::memory_order_relaxed);
+        do
+        {
+            if (!r)
+                return nullptr;
+        } while (!f->refs.compare_exchange_weak(r, r + 1, std::memory_order_acquire));
+        if (!f->open.load(std::memory_order_acquire) || f->dir != dir)
+        {
+            _put(f);
+            return nullptr;
+        }
+        return f;
+    }
+
+    static void _put(file_t *f);
+    static void _put(mount_t *mnt)
+    {
+        if (mnt->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            mnt->del(mnt->fs);
+            delete mnt;
+        }
+    }
+
+    // Find the FS mounted closest to path and the path inside it, the mount is returned referenced
+    static mount_t *_lookup(const char *path, std::string &rel);
+    static mount_table_t *_publish(mount_table_t *tbl);
+    static void _retire(mount_table_t *tbl);
+    static int _install(mount_t *mnt, int fd, bool dir);
+    static int _release(int fd, bool dir);
 
     static int _write_stdout(const char *buf, int size);
+    static int _rwv(int fd, const struct iovec *iov, int iovcnt, bool wr);
+    static void _readahead(file_t &f, off_t pos, size_t count);
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -2,6 +2,7 @@
 #define __K_VMMGR_H__
 
 #include "k_mmu.h"
+#include "k_rwlock.h"
 
 
 class VMemoryMgr
@@ -9,6 +10,7 @@ class VMemoryMgr
   public:
     VMemoryMgr(MMUBase *mmu) : _mmu(mmu)
     {
+        rw_read_guard_t g(_global_lock);
         _maps = _global_maps;
     }
 
@@ -16,21 +18,22 @@ class VMemoryMgr
     {
         // Todo: check compatibility, global mappings sync
         if(prot & MMUBase::PROT_G)
+        {
+            rw_write_guard_t g(_global_lock);
             _global_maps.push_back({vaddr, paddr, size, prot, map_t::MAP});
+        }
         _maps.push_back({vaddr, paddr, size, prot, map_t::MAP});
     }
 
-    void removeMap(uintptr_t vaddr, size_t size, int prot)
+    // Returns the physical address the range was mapped to, 0 when it was not
+    uintptr_t removeMap(uintptr_t vaddr, size_t size, int prot)
     {
-        auto & mm = (prot & MMUBase::PROT_G) ? _global_maps : _maps;
-        for(auto it = mm.begin(); it != mm.end(); it++)
+        if(prot & MMUBase::PROT_G)
         {
-            if(it->vaddr == vaddr && it->size == size)
-            {
-                it->pending = map_t::UNMAP;
-                return;
-            }
+            rw_write_guard_t g(_global_lock);
+            return _markUnmap(_global_maps, vaddr, size);
         }
+        return _markUnmap(_maps, vaddr, size);
     }
 
     // Actually do the map and unmap, note that we don't call apply() here
@@ -78,7 +81,21 @@ class VMemoryMgr
     };
     std::vector<map_t> _maps;
 
-    static std::vector<map_t> _global_maps;
+    static uintptr_t _markUnmap(std::vector<map_t> &mm, uintptr_t vaddr, size_t size)
+    {
+        for(auto it = mm.begin(); it != mm.end(); it++)
+        {
+            if(it->vaddr == vaddr && it->size == size)
+            {
+                it->pending = map_t::UNMAP;
+                return it->paddr;
+            }
+        }
+        return 0;
+    }
+
+    static std::vector<map_t> _global_maps; // copied by every new address space, rarely changed
+    static rwlock_t _global_lock;
     MMUBase *_mmu;
 };
 
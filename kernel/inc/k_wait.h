@@ -0,0 +1,82 @@
+#ifndef __K_WAIT_H__
+#define __K_WAIT_H__
+
+#include <cstdint>
+
+#include "k_lock.h"
+#include "k_thread.h"
+
+/**
+ * @brief Wait queues and futexes
+ *
+ * A waiter queues itself and marks itself blocked (k_wait_prepare) before it checks its condition, a waker
+ * changes the condition before k_wake: either the waiter sees the change, or the waker finds it queued and
+ * blocked, so no wakeup is lost between the check and k_thread_block. A woken entry is off the queue, the waiter
+ * prepares again before the next check. k_wait_event wraps the loop.
+ * Queue locks are also taken by timeout callbacks, they are held with interrupts off.
+ *
+ * Futexes are wait queues hashed by the physical address of a 32 bit word: k_futex_wait only blocks while the
+ * word holds the expected value, checked after queueing. The same calls back the SYSCALL_FUTEX ecall. Words are
+ * addresses of the sysmmu space, which every task runs in; from a hart on another page table they are invalid.
+ * Between k_wait_prepare and k_thread_block or k_wait_finish the task is not preempted: keep the check short.
+ */
+
+struct waitq_t;
+
+struct wait_entry_t
+{
+    thread_t *task = nullptr;
+    waitq_t *q = nullptr; // queued on, moves with a futex requeue
+    wait_entry_t *prev = nullptr;
+    wait_entry_t *next = nullptr;
+    uintptr_t key = 0; // futex word, 0 on plain wait queues
+    bool queued = false;
+    bool woken = false;    // by k_wake
+    bool timedout = false; // by its timeout
+};
+
+struct waitq_t
+{
+    lock_t lock;
+    wait_entry_t *head = nullptr;
+    wait_entry_t *tail = nullptr;
+};
+
+// Queue w (at the tail, once) and mark the caller blocked. False on harts without threads: poll instead.
+bool k_wait_prepare(waitq_t *q, wait_entry_t *w);
+// Running again and off its queue. A waiter claimed by a waker meanwhile is switched out until enqueued.
+void k_wait_finish(wait_entry_t *w);
+// Wake up to n waiters in FIFO order, only the ones waiting on key unless it is 0. Returns how many.
+int k_wake(waitq_t *q, int n, uintptr_t key = 0);
+
+// Block the calling thread until cond holds; cond is evaluated again after each wakeup
+#define k_wait_event(q, cond)                                                                                          \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        wait_entry_t __w;                                                                                              \
+        if (!k_wait_prepare((q), &__w))                                                                                \
+        {                                                                                                              \
+            while (!(cond))                                                                                            \
+                ;                                                                                                      \
+            break;                                                                                                     \
+        }                                                                                                              \
+        while (!(cond))                                                                                                \
+        {                                                                                                              \
+            k_thread_block();                                                                                          \
+            k_wait_prepare((q), &__w);                                                                                 \
+        }                                                                                                              \
+        k_wait_finish(&__w);                                                                                           \
+    } while (0)
+
+// Block while *uaddr == val, for at most timeout_us (0: no limit). K_EAGAIN when the value differed,
+// K_ETIMEDOUT, K_ENOTSUPP on harts without threads.
+int k_futex_wait(volatile uint32_t *uaddr, uint32_t val, uint64_t timeout_us = 0);
+// Wake up to n waiters on uaddr, returns how many
+int k_futex_wake(volatile uint32_t *uaddr, int n);
+// Wake up to n waiters on uaddr, then move up to nmove of the others to uaddr2 (two steps, not atomic).
+// Returns how many were woken or moved.
+int k_futex_requeue(volatile uint32_t *uaddr, int n, volatile uint32_t *uaddr2, int nmove);
+// SYSCALL_FUTEX from the ecall handler, on the calling thread's stack
+long k_futex_syscall(uintptr_t uaddr, int op, uint32_t val, uint64_t arg, uintptr_t uaddr2);
+
+#endif
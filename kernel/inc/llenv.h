@@ -38,6 +38,12 @@ __always_inline struct sbiret sbi_ecall(int ext, int fid, unsigned long arg0, un
     return ret;
 }
 
+// Spin loop hint: Zihintpause pause, a fence w,0 that cores without the extension run as a plain fence
+__always_inline void k_cpu_relax()
+{
+    asm volatile(".insn i 0x0F, 0, x0, x0, 0x010");
+}
+
 // extern uint8_t k_fdt[K_FDT_MAX_SIZE];
 extern void *k_fdt;
 
@@ -5,6 +5,12 @@
 #define BASIC_SYSCALL 0
 
 #define SYSCALL_PRINTF 0xFF
+#define SYSCALL_FUTEX 0x10 // a1 = uaddr, a2 = op, a3 = val, a4 = timeout in us or count to requeue, a5 = uaddr2
+
+// SYSCALL_FUTEX operations, Linux numbering
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+#define FUTEX_REQUEUE 3
 
 
 #endif
\ No newline at end of file
@@ -10,11 +10,16 @@
 #include "k_mem.hpp"
 #include "k_vmmgr.hpp"
 #include "k_vfs.h"
+#include "k_log.h"
+#include "k_thread.h"
 
 std::vector<VMemoryMgr::map_t> VMemoryMgr::_global_maps;
+rwlock_t VMemoryMgr::_global_lock;
 
 std::function<int(const char *, int size)> k_stdout_func;
 bool k_stdout_switched = false;
+int k_boot_hartid = -1;
+static std::function<void()> stdout_flush;
 
 SysRoot *sysroot = nullptr;
 SysCPU *syscpu = nullptr;
@@ -32,6 +37,7 @@ std::atomic_int k_hart_state[K_CONFIG_MAX_PROCESSORS] = {0};
 int k_boot_sysdev(int hartid, void **boothart_stack)
 {
     k_stage = K_BOOT;
+    k_boot_hartid = hartid;
 #ifdef DEBUG
     std::cout << "Dumping Device tree..." << std::endl;
     fdt_print_node(k_fdt, 0, 0);
@@ -252,6 +258,7 @@ int k_boot_perip()
                 // uart->write(stdouthdl, "- ", 2);
                 return uart->write(stdouthdl, buf, size);
             };
+            stdout_flush = [stdouthdl, uart]() { uart->ioctl(stdouthdl, DRV_IOCTL_FLUSH, nullptr); };
             k_stdout_switched = true;
             std::cout << "Hello from local driver!" << std::endl;
         }
@@ -275,15 +282,30 @@ int k_boot_perip()
         std::cout << "[I] Rootfs mounted successfully!" << std::endl;
     }
 
+    // Device nodes and scratch space
+    auto rc = VirtualFS::mount("/dev/", "devfs", 0, 0, "devfs");
+    if (rc < 0)
+        std::cout << "[W] Failed to mount devfs: " << rc << std::endl;
+    rc = VirtualFS::mount("/proc/", "procfs", 0, 0, "procfs");
+    if (rc < 0)
+        std::cout << "[W] Failed to mount procfs: " << rc << std::endl;
+    rc = VirtualFS::mount("/tmp/", "tmpfs", 0, 0, "tmpfs");
+    if (rc < 0)
+        std::cout << "[W] Failed to mount tmpfs: " << rc << std::endl;
+
     return 0;
 }
 
 int k_boot_harts(int boot_hartid)
 {
+    ::hartid = boot_hartid; // hart locals are up, k_current_hart reads them from now on
     k_stage = K_BOOT_HARTS;
     extern uintptr_t _entry_hart_addr;
     extern uintptr_t _start_hart;
     printf("> Booting harts... (Boot hart = %i)\n", boot_hartid);
+    auto trc = k_thread_setup();
+    if (trc != K_OK)
+        printf("[W] Scheduler setup failed (%d), harts run without threads\n", trc);
     auto cpus = syscpu->CPUs();
     for (auto x : cpus)
     {
@@ -329,6 +351,9 @@ int k_boot_harts(int boot_hartid)
     k_hart_state[boot_hartid] = 1;
     printf("> Switching to multicore mode\n");
     k_stage = K_MULTICORE;
+    for (auto x : cpus)
+        if ((int)x.hid != boot_hartid && k_hart_state[x.hid] == 2)
+            SBIF::IPI::sendIPI(1UL << x.hid, 0); // parked in wfi
     return 0;
 }
 
@@ -337,9 +362,12 @@ void k_before_cleanup()
     if (k_stage == K_MULTICORE)
     {
         printf("\n> Waiting for other harts to return...\n");
+        csr_clear(CSR_SSTATUS, SSTATUS_SIE); // each one sends an IPI when done: enabled for wfi, not taken
+        csr_set(CSR_SIE, SIP_SSIP);
         int flag = 0;
         do // a timeout can be added here
         {
+            csr_clear(CSR_SIP, SIP_SSIP);
             flag = 0;
             for (int i = 0; i < K_CONFIG_MAX_PROCESSORS; ++i)
             {
@@ -353,8 +381,15 @@ void k_before_cleanup()
                 if (k_hart_state[i] == 3 || k_hart_state[i] == 0)
                     continue;
             }
+            if (flag)
+                asm volatile("wfi");
         } while (flag);
+        csr_clear(CSR_SIE, SIP_SSIP);
+        csr_clear(CSR_SIP, SIP_SSIP);
     }
+    k_log_flush();
+    if (stdout_flush)
+        stdout_flush(); // the driver may still hold queued output
     k_stdout_switched = false;
     k_stage = K_CLEARUP;
 }
\ No newline at end of file
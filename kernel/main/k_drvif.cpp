@@ -11,6 +11,7 @@
 __attribute__((init_priority(K_PR_INIT_DRV_LIST))) std::vector<DriverBase *> DriverManager::_drvlist;
 __attribute__((init_priority(K_PR_INIT_DRV_LIST))) std::map<int, std::tuple<DriverBase *, int, long>>
     DriverManager::_devhdl;
+rwlock_t DriverManager::_lock;
 
 int DriverManager::probe(const void *fdt, dev_type_t type, int node)
 {
@@ -49,9 +50,12 @@ int DriverManager::probe(const void *fdt, dev_type_t type, int node)
 int DriverManager::_try(const void *fdt, int node, dev_type_t type)
 {
     // Already installed
-    auto fnd = _devhdl.find(node);
-    if (fnd != _devhdl.end())
-        return std::get<1>(fnd->second);
+    {
+        rw_read_guard_t g(_lock);
+        auto fnd = _devhdl.find(node);
+        if (fnd != _devhdl.end())
+            return std::get<1>(fnd->second);
+    }
 
     const char *node_name = fdt_get_name(fdt, node, NULL);
     if (!node_name)
@@ -68,6 +72,7 @@ int DriverManager::_try(const void *fdt, int node, dev_type_t type)
     fflush(stdout);
 
     int rc = 0;
+    _lock.read_lock(); // not across addDevice, drivers look each other up from there
     auto drv = std::find_if(_drvlist.begin(), _drvlist.end(), [&rc, node_name, compatible, type](DriverBase *drv) {
         auto dt = drv->getDeviceType();
         if ((type == DEV_TYPE_PERIP && dt > type) || (type == DEV_TYPE_NONE && dt > type) || type == dt)
@@ -76,7 +81,10 @@ int DriverManager::_try(const void *fdt, int node, dev_type_t type)
             return false;
     });
 
-    if (drv == _drvlist.end())
+    bool found = drv != _drvlist.end();
+    auto driver = found ? *drv : nullptr;
+    _lock.read_unlock();
+    if (!found)
     {
         // printf("Failed\n");
         return 0;
@@ -85,10 +93,13 @@ int DriverManager::_try(const void *fdt, int node, dev_type_t type)
     printf("Installing #%i %s [%s]... ",node,node_name,compatible);
     fflush(stdout);
 
-    auto hdl = (*drv)->addDevice(fdt, node);
+    auto hdl = driver->addDevice(fdt, node);
     if (hdl >= 0)
     {
-        _devhdl.insert(std::make_pair(node, std::make_tuple(*drv, rc, hdl)));
+        {
+            rw_write_guard_t g(_lock);
+            _devhdl.insert(std::make_pair(node, std::make_tuple(driver, rc, hdl)));
+        }
         printf("OK, handler: %ld\n", hdl);
     }
     else
@@ -104,6 +115,7 @@ long DriverManager::getDrvByPath(const void *fdt, const char *path, void **drv)
     auto rc = fdt_path_offset(fdt, path);
     if (rc < 0)
         return K_ENODEV;
+    rw_read_guard_t g(_lock);
     auto ret = _devhdl.find(rc);
     if (ret == _devhdl.end())
         return K_ENODEV;
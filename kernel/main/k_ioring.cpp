@@ -0,0 +1,158 @@
+#include <climits>
+#include <new>
+
+#include "k_ioring.h"
+#include "k_mem.hpp"
+#include "k_vfs.h"
+#include "k_thread.h"
+
+IORing IORing::_pool[K_CONFIG_IORING_MAX];
+std::atomic<bool> IORing::_worker_on = false;
+
+IORing *IORing::create()
+{
+    for (auto &ring : _pool)
+    {
+        bool expected = false;
+        if (ring._used.load(std::memory_order_relaxed) || !ring._used.compare_exchange_strong(expected, true))
+            continue;
+        auto sh = alignedMalloc<shared_t>(sizeof(shared_t), 4096);
+        if (!sh)
+        {
+            ring._used = false;
+            return nullptr;
+        }
+        ring._sh.store(new (sh) shared_t(), std::memory_order_release);
+        return &ring;
+    }
+    return nullptr;
+}
+
+int IORing::destroy(IORing *ring)
+{
+    if (!ring || !ring->_used)
+        return K_EINVAL;
+    while (ring->_busy.test_and_set(std::memory_order_acquire)) // wait for the servicing hart to leave
+        ;
+    auto sh = ring->_sh.exchange(nullptr);
+    ring->_busy.clear(std::memory_order_release);
+    sh->~shared_t();
+    alignedFree(sh);
+    ring->_used = false;
+    return K_OK;
+}
+
+int IORing::_exec(const io_sqe_t &sqe)
+{
+    switch (sqe.op)
+    {
+    case IO_OP_NOP:
+        return K_OK;
+    case IO_OP_READ:
+        if (sqe.off < 0)
+            return VirtualFS::read(sqe.fd, (void *)sqe.addr, sqe.len);
+        return VirtualFS::pread(sqe.fd, (void *)sqe.addr, sqe.len, sqe.off);
+    case IO_OP_WRITE:
+        if (sqe.off < 0)
+            return VirtualFS::write(sqe.fd, (const void *)sqe.addr, sqe.len);
+        return VirtualFS::pwrite(sqe.fd, (const void *)sqe.addr, sqe.len, sqe.off);
+    case IO_OP_READV:
+        if (sqe.off < 0)
+            return VirtualFS::readv(sqe.fd, (const struct iovec *)sqe.addr, sqe.len);
+        return VirtualFS::preadv(sqe.fd, (const struct iovec *)sqe.addr, sqe.len, sqe.off);
+    case IO_OP_WRITEV:
+        if (sqe.off < 0)
+            return VirtualFS::writev(sqe.fd, (const struct iovec *)sqe.addr, sqe.len);
+        return VirtualFS::pwritev(sqe.fd, (const struct iovec *)sqe.addr, sqe.len, sqe.off);
+    default:
+        return K_ENOSYS;
+    }
+}
+
+int IORing::process(int budget)
+{
+    if (_busy.test_and_set(std::memory_order_acquire))
+        return 0; // another hart is on it
+    int done = 0;
+    auto sh = _sh.load(std::memory_order_acquire);
+    io_sqe_t sqe;
+    // Stop when the CQ is full, the SQEs stay queued until the owner reaps
+    while (sh && done != budget && !sh->cq.full() && sh->sq.pop(sqe))
+    {
+        sh->cq.push({sqe.user_data, _exec(sqe), 0});
+        done++;
+    }
+    _passes.fetch_add(1, std::memory_order_release);
+    _busy.clear(std::memory_order_release);
+    k_wake(&_done, INT_MAX);
+    return done;
+}
+
+int IORing::wait(uint32_t min_complete)
+{
+    auto sh = _sh.load(std::memory_order_relaxed);
+    while (sh->cq.size() < min_complete)
+    {
+        auto pass = _passes.load(std::memory_order_acquire); // before the flag: a pass ending after it wakes us
+        if (_busy.test_and_set(std::memory_order_acquire))
+        {
+            k_wait_event(&_done, _passes.load(std::memory_order_acquire) != pass); // the worker is on it
+            continue;
+        }
+        bool idle = sh->sq.empty();
+        _busy.clear(std::memory_order_release);
+        if (idle)
+            break; // nothing else will complete
+        process();
+    }
+    return sh->cq.size();
+}
+
+// Some ring has SQEs queued and room for their CQEs, a full CQ waits for reap()
+bool IORing::_pending()
+{
+    for (auto &ring : _pool)
+    {
+        auto sh = ring._sh.load(std::memory_order_acquire);
+        if (sh && !sh->sq.empty() && !sh->cq.full())
+            return true;
+    }
+    return false;
+}
+
+// After a push to the SQ or a pop from the CQ: start the worker unless it runs. Either it sees _worker_on
+// cleared, or the worker sees the change when it checks once more before leaving.
+void IORing::_kick()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool off = false;
+    if (_worker_on.load(std::memory_order_relaxed) || !_worker_on.compare_exchange_strong(off, true))
+        return;
+    if (!k_thread_create(_worker, nullptr, "ioring"))
+        _worker_on = false; // no threads on this hart, wait() services the ring
+}
+
+void IORing::_worker(void *)
+{
+    for (;;)
+    {
+        while (processAll() > 0)
+            ;
+        _worker_on.store(false);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool off = false;
+        if (!_pending() || !_worker_on.compare_exchange_strong(off, true))
+            return; // nothing left, or a new worker took over
+    }
+}
+
+int IORing::processAll(int budget)
+{
+    int done = 0;
+    for (int i = 0; i < K_CONFIG_IORING_MAX && done != budget; i++)
+    {
+        if (_pool[i]._sh.load(std::memory_order_relaxed))
+            done += _pool[i].process(budget < 0 ? -1 : budget - done);
+    }
+    return done;
+}
@@ -0,0 +1,107 @@
+#include <cstdio>
+
+#include "k_main.h"
+#include "k_irq.h"
+
+#include "libfdt.h"
+
+// Filled while probing on the boot hart, read-only once interrupts are on
+std::vector<IRQManager::intc_t> IRQManager::_intcs;
+
+int IRQManager::_resolve(const void *fdt, int node, int index, intc_t &intc, uint32_t &hwirq)
+{
+    int parent = -1;
+    struct fdt_phandle_args args;
+    if (fdt_parse_phandle_with_args(fdt, node, "interrupts-extended", "#interrupt-cells", index, &args) == 0)
+    {
+        parent = args.node_offset;
+        hwirq = args.args[0];
+    }
+    else
+    {
+        int len;
+        auto irqs = (const fdt32_t *)fdt_getprop(fdt, node, "interrupts", &len);
+        if (!irqs)
+            return K_ENOENT;
+
+        // interrupt-parent is inherited from the closest ancestor that has one
+        const fdt32_t *ph = nullptr;
+        for (int n = node; n >= 0 && !ph; n = fdt_parent_offset(fdt, n))
+            ph = (const fdt32_t *)fdt_getprop(fdt, n, "interrupt-parent", nullptr);
+        if (!ph)
+            return K_ENOENT;
+        parent = fdt_node_offset_by_phandle(fdt, fdt32_to_cpu(*ph));
+        if (parent < 0)
+            return K_ENOENT;
+
+        auto cells = (const fdt32_t *)fdt_getprop(fdt, parent, "#interrupt-cells", nullptr);
+        int ncells = cells ? fdt32_to_cpu(*cells) : 1;
+        if (ncells <= 0 || (index + 1) * ncells * (int)sizeof(fdt32_t) > len)
+            return K_EINVAL;
+        hwirq = fdt32_to_cpu(irqs[index * ncells]);
+    }
+
+    void *drv = nullptr;
+    long hdl = DriverManager::getDrvByNode(parent, &drv);
+    if (hdl < 0)
+    {
+        DriverManager::probe(fdt, DEV_TYPE_PERIP, parent); // not reached by the probe walk yet
+        hdl = DriverManager::getDrvByNode(parent, &drv);
+    }
+    if (hdl < 0 || ((DriverBase *)drv)->getDeviceType() != DEV_TYPE_INTC)
+        return K_ENODEV;
+
+    intc = {(DriverIntc *)drv, hdl};
+    for (auto &x : _intcs)
+        if (x.drv == intc.drv && x.hdl == intc.hdl)
+            return K_OK;
+    _intcs.push_back(intc);
+    return K_OK;
+}
+
+int IRQManager::request_irq(const void *fdt, int node, irq_handler_t handler, void *ctx, int index, uint32_t prio,
+                            unsigned long affinity)
+{
+    if (!handler)
+        return K_EINVAL;
+    intc_t intc;
+    uint32_t hwirq;
+    auto rc = _resolve(fdt, node, index, intc, hwirq);
+    if (rc < 0)
+        return rc;
+    rc = intc.drv->attach(intc.hdl, hwirq, handler, ctx, prio);
+    if (rc < 0)
+        return rc;
+    if (!affinity)
+        affinity = 1UL << (k_stage < K_MULTICORE ? k_boot_hartid : hartid);
+    rc = intc.drv->setAffinity(intc.hdl, hwirq, affinity);
+    if (rc < 0)
+        intc.drv->detach(intc.hdl, hwirq);
+    return rc;
+}
+
+int IRQManager::free_irq(const void *fdt, int node, int index)
+{
+    intc_t intc;
+    uint32_t hwirq;
+    auto rc = _resolve(fdt, node, index, intc, hwirq);
+    if (rc < 0)
+        return rc;
+    return intc.drv->detach(intc.hdl, hwirq);
+}
+
+int IRQManager::setAffinity(const void *fdt, int node, unsigned long mask, int index)
+{
+    intc_t intc;
+    uint32_t hwirq;
+    auto rc = _resolve(fdt, node, index, intc, hwirq);
+    if (rc < 0)
+        return rc;
+    return intc.drv->setAffinity(intc.hdl, hwirq, mask);
+}
+
+void IRQManager::handleExternal()
+{
+    for (auto &x : _intcs)
+        x.drv->dispatch(x.hdl, hartid);
+}
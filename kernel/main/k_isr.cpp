@@ -1,11 +1,23 @@
 
 #include <stdio.h>
+#include <algorithm>
 
 #include "k_defs.h"
 #include "k_main.h"
 #include "k_umode.h"
 #include "syscall.h"
 #include "k_sbif.hpp"
+#include "k_irq.h"
+#include "k_log.h"
+#include "k_trace.h"
+#include "k_prof.h"
+#include "k_perf.h"
+#include "k_stats.h"
+#include "k_thread.h"
+#include "k_timer.h"
+#include "k_timeout.h"
+#include "k_rcu.h"
+#include "k_wait.h"
 
 #define SAVE_SPACE 32 // the max space used for saving context
 #if __riscv_xlen == 64
@@ -68,7 +80,14 @@
         REG_S " s10, " _VSTR(28 * REG_SIZE) "(sp) \n" \
         REG_S " s11, " _VSTR(29 * REG_SIZE) "(sp) \n" \
         
-    
+
+// Slots 30/31 are what RESTORE_ADDITIONAL puts back in sscratch/sepc: sscratch is the U-mode sp, or 0 from S-mode
+#define _K_ISR_SAVE_SP_PC \
+        "csrr tp, sscratch \n" \
+        REG_S " tp, " _VSTR(30 * REG_SIZE) "(sp) \n" /* SP */ \
+        "csrr tp, sepc \n" \
+        REG_S " tp, " _VSTR(31 * REG_SIZE) "(sp) \n" /* PC */ \
+
 #define _K_ISR_SAVE_RECALC_PTRS \
         "mv tp, sp \n" \
         "li gp, " _VSTR(K_CONFIG_KERNEL_STACK_SIZE - 1) "\n" \
@@ -103,6 +122,7 @@
         REG_S " tp, " _VSTR(2 * REG_SIZE) "(sp) \n" \
         _K_ISR_SAVE_CONTEXT_NORMAL \
         _K_ISR_SAVE_CONTEXT_ADDITIONAL \
+        _K_ISR_SAVE_SP_PC \
         _K_ISR_SAVE_RECALC_PTRS \
     )
 
@@ -182,52 +202,106 @@
         asm volatile("sret");                                                                                          \
     }
 
-K_ISR void k_isr_softirq(saved_context_t *ctx)
+// Same with a full frame, func returns the frame to resume: its argument, or the one of another task to switch to
+#define K_ISR_ENTRY_SWITCH_IMPL(name, func)                                                                            \
+    K_ISR_ENTRY void name()                                                                                            \
+    {                                                                                                                  \
+        K_ISR_SWITCH_SP();                                                                                             \
+        K_ISR_SAVE_CONTEXT_ADDITIONAL();                                                                               \
+        asm volatile("mv a0, sp \n"                                                                                    \
+                     "call " #func "\n"                                                                               \
+                     "mv sp, a0 \n"                                                                                    \
+                     "call k_thread_finish \n");                                                                       \
+        K_ISR_RESTORE_CONTEXT_ADDITIONAL();                                                                            \
+        K_ISR_SWITCH_SP();                                                                                             \
+        asm volatile("sret");                                                                                          \
+    }
+
+// Accounting around a handler: per-hart counts by cause and isr_enter/isr_exit trace records
+struct isr_acct_t
+{
+    unsigned long cause;
+
+    isr_acct_t()
+    {
+        cause = csr_read(CSR_SCAUSE);
+        auto code = std::min(cause & ~MCAUSE_IRQ_MASK, (unsigned long)K_STATS_CAUSES - 1);
+        if (cause & MCAUSE_IRQ_MASK)
+            K_STAT_INC(irq[code]);
+        else
+            K_STAT_INC(exc[code]);
+        K_TRACE(isr_enter, cause, csr_read(CSR_SEPC));
+    }
+    ~isr_acct_t()
+    {
+        K_TRACE(isr_exit, cause);
+    }
+};
+
+// Expired timers of this hart, then what the scheduler wants; shared by the timer ISR and IPIs
+static umode_basic_ctx_t *_timer_events(umode_basic_ctx_t *uctx)
 {
-    printf("Software interrupt for hart %i\n", hartid);
-    extern thread_local bool k_halt;
-    k_halt = true;
+    auto time = csr_read(CSR_TIME);
+    auto hk = k_timer_get(K_TIMER_HOUSEKEEPING);
+    if (hk && time >= hk)
+    {
+        k_perf_publish();
+        k_timer_set(K_TIMER_HOUSEKEEPING, time + k_cpuclock);
+    }
+    k_timer_set(K_TIMER_PROF, k_prof_tick(uctx, time));
+    k_timer_set(K_TIMER_TIMEOUTS, k_timeout_run(time)); // before the scheduler, callbacks wake tasks
+    k_timer_set(K_TIMER_RCU, k_rcu_tick(time));
+    k_timer_set(K_TIMER_SCHED, k_thread_tick(time));
+    k_timer_program();
+    return k_thread_preempt(uctx);
+}
+
+// IPIs only ask the hart to look at its timers and run queue again (k_timer_kick)
+K_ISR umode_basic_ctx_t *k_isr_softirq(umode_basic_ctx_t *uctx)
+{
+    isr_acct_t acct;
     csr_clear(CSR_SIP, SIP_SSIP);
     if (k_local_resume)
     {
-        csr_write(CSR_SEPC, k_local_resume);
+        extern thread_local volatile bool k_halt;
+        k_halt = true;
+        uctx->pc = (uintptr_t)k_local_resume;
+        uctx->sp = 0; // sscratch, back in S-mode
         csr_set(CSR_SSTATUS, SSTATUS_SPP);
         csr_clear(CSR_SIE, SIP_SSIP);
-        csr_write(CSR_SSCRATCH, 0);
         printf("Prepare to resume from U-mode\n");
+        return uctx;
     }
+    return _timer_events(uctx);
 }
 
-K_ISR void k_isr_timer(umode_basic_ctx_t *uctx)
+K_ISR umode_basic_ctx_t *k_isr_timer(umode_basic_ctx_t *uctx)
 {
-    auto time = csr_read(CSR_TIME);
-    printf("Timer interrupt for hart %i\n", hartid);
-    printf("Current Time: %ld\n", time);
-    if (time > 10 * k_cpuclock)
-    {
-        SBIF::IPI::sendIPI(-1, 0);
-        SBIF::Timer::clearTimer();
-        return;
-    }
-    auto rc = SBIF::Timer::setTimer(time + k_cpuclock);
-    if (rc)
-        printf("Cannot reset timer: %ld\n", rc);
+    isr_acct_t acct;
+    return _timer_events(uctx);
 }
 
 K_ISR void k_isr_extirq(saved_context_t *ctx)
 {
-    printf("External interrupt for hart %i\n", hartid);
+    isr_acct_t acct;
+    IRQManager::handleExternal();
 }
 
 K_ISR void k_esr_ecall(umode_basic_ctx_t *uctx)
 {
-    printf("ECall from U-mode at 0x%lx\n", csr_read(CSR_SEPC));
+    isr_acct_t acct;
+    K_STAT_INC(syscalls);
     auto ctx = (saved_context_t *)uctx;
-    if (ctx->a0 == SYSCALL_PRINTF)
+    if (ctx->a0 == SYSCALL_FUTEX) // hot path, no logging
+        ctx->a0 = k_futex_syscall(ctx->a1, ctx->a2, ctx->a3, ctx->a4, ctx->a5);
+    else if (ctx->a0 == SYSCALL_PRINTF)
     {
+        printf("ECall from U-mode at 0x%lx\n", csr_read(CSR_SEPC));
         printf("[UMODE] ");
         printf((const char *)(ctx->a1), ctx->a2, ctx->a3, ctx->a4); // only for test, not safe at all!
     }
+    else
+        printf("ECall from U-mode at 0x%lx\n", csr_read(CSR_SEPC));
     uctx->pc += 4; // ECall instruction takes 4 bytes
 }
 
@@ -258,6 +332,7 @@ K_ISR void k_esr_ecall(umode_basic_ctx_t *uctx)
 
 K_ISR void k_esr_break(saved_context_t *ctx)
 {
+    isr_acct_t acct;
     bool volatile conti = false;
     printf("=== Breakpoint at 0x%lx ===\n", csr_read(CSR_SEPC));
     _DUMP_CTX(ctx);
@@ -269,6 +344,7 @@ K_ISR void k_esr_break(saved_context_t *ctx)
 
 K_ISR void k_other_exception(saved_context_t *ctx)
 {
+    isr_acct_t acct;
     printf("=== Unhandled exception (0x%lx) at 0x%lx ===\n", csr_read(CSR_SCAUSE), csr_read(CSR_SEPC));
     _DUMP_CTX(ctx);
     printf("STVAL = %lx\n", csr_read(CSR_STVAL));
@@ -365,9 +441,7 @@ K_ISR_ENTRY void k_exception_entry(){
         /* ra, tp , gp already saved, skipped */
         _K_ISR_SAVE_CONTEXT_NORMAL
         _K_ISR_SAVE_CONTEXT_ADDITIONAL
-        REG_S " sp, " _VSTR(30 * REG_SIZE) "(sp) \n"
-        "csrr tp, sepc \n"
-        REG_S " tp, " _VSTR(31 * REG_SIZE) "(sp) \n" // PC
+        _K_ISR_SAVE_SP_PC
         _K_ISR_SAVE_RECALC_PTRS
         "ret \n" 
     );
@@ -388,10 +462,47 @@ K_ISR_ENTRY void k_exception_entry(){
 }
 // clang-format on
 
-K_ISR_ENTRY_IMPL(NORMAL, k_softirq_entry, k_isr_softirq)
-K_ISR_ENTRY_IMPL(ADDITIONAL, k_timer_entry, k_isr_timer)
+K_ISR_ENTRY_SWITCH_IMPL(k_softirq_entry, k_isr_softirq)
+K_ISR_ENTRY_SWITCH_IMPL(k_timer_entry, k_isr_timer)
 K_ISR_ENTRY_IMPL(NORMAL, k_extirq_entry, k_isr_extirq)
 
+// clang-format off
+
+// Resume the frame at sp like a trap return, into S-mode with interrupts on. Interrupts must be off.
+K_ISR_ENTRY void _k_thread_resume()
+{
+    asm volatile(
+        "call k_thread_finish \n"
+        "li t0, 0x120 \n" /* SSTATUS_SPP | SSTATUS_SPIE */
+        "csrs sstatus, t0 \n"
+    );
+    K_ISR_RESTORE_CONTEXT_ADDITIONAL();
+    K_ISR_SWITCH_SP();
+    asm volatile("sret");
+}
+
+// _k_thread_switch(save, next): push a frame that resumes at our return address, store it to *save
+// and resume next. Only callee-saved registers matter, the caller expects the others clobbered.
+K_ISR_ENTRY void _k_thread_switch()
+{
+    asm volatile(
+        "add sp, sp, -" _VSTR(SAVE_SPACE * REG_SIZE) " \n"
+        REG_S " ra, " _VSTR(0 * REG_SIZE) "(sp) \n"
+        REG_S " gp, " _VSTR(1 * REG_SIZE) "(sp) \n"
+        REG_S " tp, " _VSTR(2 * REG_SIZE) "(sp) \n"
+        _K_ISR_SAVE_CONTEXT_ADDITIONAL
+        REG_S " zero, " _VSTR(30 * REG_SIZE) "(sp) \n" /* sscratch: S-mode */
+        "lla t0, 1f \n"
+        REG_S " t0, " _VSTR(31 * REG_SIZE) "(sp) \n" /* PC */
+        REG_S " sp, (a0) \n"
+        "mv sp, a1 \n"
+        "j _k_thread_resume \n"
+        "1: \n"
+        "ret \n"
+    );
+}
+// clang-format on
+
 #define _EXCTABLE_JUMP_HELPER(x) ".align 2 \n j " #x " \n"
 #define _EXCTABLE_JUMP_HELPER2(x) _EXCTABLE_JUMP_HELPER(x) _EXCTABLE_JUMP_HELPER(x)
 #define _EXCTABLE_JUMP_HELPER4(x) _EXCTABLE_JUMP_HELPER2(x) _EXCTABLE_JUMP_HELPER2(x)
@@ -404,7 +515,8 @@ K_ISR_ENTRY __attribute__((aligned(4))) void _exctable()
                  _EXCTABLE_JUMP_HELPER(_start_hang) _EXCTABLE_JUMP_HELPER2(_start_hang) // 2 - 4 Reserved
 
                  _EXCTABLE_JUMP_HELPER(k_timer_entry)  // 0x5 Supervisor timer interrupt
-                 _EXCTABLE_JUMP_HELPER(k_extirq_entry) // 0x6 Supervisor external interrupt
-                 _EXCTABLE_JUMP_HELPER(_start_hang) _EXCTABLE_JUMP_HELPER8(_start_hang) // 0x7 - 0x1F Reserved
+                 _EXCTABLE_JUMP_HELPER(_start_hang) _EXCTABLE_JUMP_HELPER2(_start_hang) // 0x6 - 0x8 Reserved
+                 _EXCTABLE_JUMP_HELPER(k_extirq_entry) // 0x9 Supervisor external interrupt
+                 _EXCTABLE_JUMP_HELPER2(_start_hang) _EXCTABLE_JUMP_HELPER4(_start_hang) // 0xA - 0xF Reserved
     );
 }
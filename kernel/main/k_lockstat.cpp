@@ -0,0 +1,111 @@
+#include <initializer_list>
+
+#include "k_lockstat.h"
+
+#if K_CONFIG_LOCKSTAT
+
+static lockstat_class_t classes[K_CONFIG_LOCKSTAT_CLASSES];
+static lockstat_class_t overflow; // every class once the table is full, key stays 0
+
+static void _max(std::atomic<uint64_t> &m, uint64_t v)
+{
+    auto cur = m.load(std::memory_order_relaxed);
+    while (v > cur && !m.compare_exchange_weak(cur, v, std::memory_order_relaxed))
+        ;
+}
+
+// Open addressing, slots are claimed with a CAS on the key and never freed
+static lockstat_class_t *_class(uintptr_t key, const char *name, uintptr_t site)
+{
+    constexpr uintptr_t BUSY = 1; // claimed, being filled in; names and code addresses are never 1
+    auto h = (key >> 2) * 0x9E3779B97F4A7C15ULL >> 32;
+    for (int i = 0; i < K_CONFIG_LOCKSTAT_CLASSES; i++)
+    {
+        auto &c = classes[(h + i) % K_CONFIG_LOCKSTAT_CLASSES];
+        auto k = c.key.load(std::memory_order_acquire);
+        if (!k && c.key.compare_exchange_strong(k, BUSY, std::memory_order_acquire))
+        {
+            c.name = name;
+            c.site = site;
+            c.key.store(key, std::memory_order_release);
+            return &c;
+        }
+        while (k == BUSY)
+        {
+            k_cpu_relax();
+            k = c.key.load(std::memory_order_acquire);
+        }
+        if (k == key)
+            return &c;
+    }
+    return &overflow;
+}
+
+static lockstat_site_t *_site(lockstat_class_t *c, uintptr_t ra)
+{
+    for (auto &s : c->sites)
+    {
+        auto r = s.ra.load(std::memory_order_relaxed);
+        if (!r && s.ra.compare_exchange_strong(r, ra, std::memory_order_relaxed))
+            return &s;
+        if (r == ra)
+            return &s;
+    }
+    return nullptr;
+}
+
+void lockstat_t::acquired(void *ra, uint64_t wait_start)
+{
+    since = now();
+    if (!cls)
+        cls = name ? _class((uintptr_t)name, name, (uintptr_t)ra) : _class((uintptr_t)ra, nullptr, (uintptr_t)ra);
+    auto s = _site(cls, (uintptr_t)ra);
+    cls->acquired.fetch_add(1, std::memory_order_relaxed);
+    if (s)
+        s->acquired.fetch_add(1, std::memory_order_relaxed);
+    if (!wait_start)
+        return;
+    auto w = since - wait_start;
+    cls->contended.fetch_add(1, std::memory_order_relaxed);
+    cls->wait.fetch_add(w, std::memory_order_relaxed);
+    _max(cls->wait_max, w);
+    if (s)
+    {
+        s->contended.fetch_add(1, std::memory_order_relaxed);
+        s->wait.fetch_add(w, std::memory_order_relaxed);
+    }
+}
+
+void lockstat_t::released()
+{
+    if (!cls)
+        return;
+    auto h = now() - since;
+    cls->hold.fetch_add(h, std::memory_order_relaxed);
+    _max(cls->hold_max, h);
+}
+
+void k_lockstat_foreach(void (*fn)(const lockstat_class_t *c, void *arg), void *arg)
+{
+    for (auto &c : classes)
+        if (c.key.load(std::memory_order_acquire) > 1)
+            fn(&c, arg);
+    if (overflow.acquired.load(std::memory_order_relaxed))
+        fn(&overflow, arg);
+}
+
+void k_lockstat_reset()
+{
+    auto zero = [](lockstat_class_t &c) {
+        for (auto p : {&c.acquired, &c.contended, &c.wait, &c.wait_max, &c.hold, &c.hold_max})
+            p->store(0, std::memory_order_relaxed);
+        for (auto &s : c.sites)
+            for (auto p : {&s.acquired, &s.contended, &s.wait})
+                p->store(0, std::memory_order_relaxed);
+    };
+    for (auto &c : classes)
+        zero(c);
+    zero(overflow);
+}
+
+#endif
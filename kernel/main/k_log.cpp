@@ -0,0 +1,158 @@
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <atomic>
+
+#include "k_main.h"
+#include "k_log.h"
+#include "k_ring.hpp"
+#include "k_thread.h"
+#include "k_vfs.h"
+
+namespace
+{
+constexpr uint16_t LOG_CONT = 1; // continues the previous record of the same hart
+
+struct logrec_t
+{
+    uint64_t time;
+    uint16_t flags;
+    uint16_t len;
+    char text[K_CONFIG_LOG_RECORD_SIZE - 12];
+};
+
+struct hartlog_t
+{
+    SPSCRing<logrec_t, K_CONFIG_LOG_RECORDS> ring;
+    std::atomic<unsigned long> dropped = 0;
+};
+
+hartlog_t logs[K_CONFIG_MAX_PROCESSORS];
+std::atomic_flag flushing = ATOMIC_FLAG_INIT;
+
+// Before multicore there are no idle harts to flush and no interrupts, after it not from a context that could
+// deadlock on the console
+bool can_flush()
+{
+    return k_stage < K_MULTICORE || (csr_read(CSR_SSTATUS) & SSTATUS_SIE);
+}
+
+void emit(int hart, const logrec_t &r)
+{
+    char prefix[48];
+    int n = 0;
+    if (!(r.flags & LOG_CONT))
+    {
+        unsigned long clk = k_cpuclock ? k_cpuclock : 1;
+        n = snprintf(prefix, sizeof(prefix), "[%5lu.%06lu][%d] ", r.time / clk, (r.time % clk) * 1000000 / clk, hart);
+        VirtualFS::write(FILE_STDOUT, prefix, n);
+    }
+    VirtualFS::write(FILE_STDOUT, r.text, r.len);
+}
+} // namespace
+
+void k_log_flush()
+{
+    if (flushing.test_and_set(std::memory_order_acquire))
+        return; // the current flusher will pick our records up
+
+    for (int h = 0; h < K_CONFIG_MAX_PROCESSORS; h++)
+    {
+        auto lost = logs[h].dropped.exchange(0, std::memory_order_relaxed);
+        if (lost)
+        {
+            char msg[64];
+            int n = snprintf(msg, sizeof(msg), "[%d] %lu log records dropped\n", h, lost);
+            VirtualFS::write(FILE_STDOUT, msg, n);
+        }
+    }
+
+    // Merge by timestamp, a message split over several records is emitted in one go
+    logrec_t r;
+    while (true)
+    {
+        int best = -1;
+        uint64_t best_time = 0;
+        for (int h = 0; h < K_CONFIG_MAX_PROCESSORS; h++)
+        {
+            if (logs[h].ring.peek(r) && (best < 0 || r.time < best_time))
+            {
+                best = h;
+                best_time = r.time;
+            }
+        }
+        if (best < 0)
+            break;
+        logs[best].ring.pop(r);
+        emit(best, r);
+        while (logs[best].ring.peek(r) && (r.flags & LOG_CONT))
+        {
+            logs[best].ring.pop(r);
+            emit(best, r);
+        }
+    }
+
+    flushing.clear(std::memory_order_release);
+}
+
+bool k_log_pending()
+{
+    for (auto &log : logs)
+        if (!log.ring.empty())
+            return true;
+    return false;
+}
+
+int k_printk(const char *fmt, ...)
+{
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (len < 0)
+        return len;
+    if (len >= (int)sizeof(buf))
+        len = sizeof(buf) - 1;
+
+    int hart = k_current_hart();
+    if (hart < 0 || hart >= K_CONFIG_MAX_PROCESSORS)
+        return VirtualFS::write(FILE_STDOUT, buf, len); // nowhere to queue it
+
+    auto &log = logs[hart];
+    constexpr int chunk = sizeof(logrec_t::text);
+    int nrec = len ? (len + chunk - 1) / chunk : 1;
+    bool flush = can_flush();
+
+    // The ring has one producer per hart: keep ISRs out while pushing
+    bool sie = csr_read_clear(CSR_SSTATUS, SSTATUS_SIE) & SSTATUS_SIE;
+    if (K_CONFIG_LOG_RECORDS - log.ring.size() < (uint32_t)nrec && flush)
+    {
+        if (sie)
+            csr_set(CSR_SSTATUS, SSTATUS_SIE);
+        k_log_flush();
+        sie = csr_read_clear(CSR_SSTATUS, SSTATUS_SIE) & SSTATUS_SIE;
+    }
+    if (K_CONFIG_LOG_RECORDS - log.ring.size() < (uint32_t)nrec)
+        log.dropped.fetch_add(1, std::memory_order_relaxed);
+    else
+    {
+        logrec_t r;
+        r.time = csr_read(CSR_TIME);
+        for (int off = 0; off < len || off == 0; off += chunk)
+        {
+            r.flags = off ? LOG_CONT : 0;
+            r.len = len - off < chunk ? len - off : chunk;
+            memcpy(r.text, buf + off, r.len);
+            log.ring.push(r);
+        }
+    }
+    if (sie)
+        csr_set(CSR_SSTATUS, SSTATUS_SIE);
+
+    if (k_stage < K_MULTICORE)
+        k_log_flush();
+    else
+        k_thread_kick_idle(); // the console write is for an idle hart
+    return len;
+}
@@ -12,15 +12,23 @@
 #include "k_mem.hpp"
 #include "k_vmmgr.hpp"
 #include "k_vfs.h"
+#include "k_log.h"
+#include "k_perf.h"
+#include "k_thread.h"
+#include "k_timer.h"
+#include "k_timeout.h"
+#include "k_rcu.h"
 
 thread_local _reent hl_reent;
 thread_local int hartid;
 thread_local volatile bool k_halt = false;
 thread_local volatile void *k_local_resume = nullptr;
+thread_local int k_preempt_count = 0;
 
 // to be run by each hart
 int k_pre_main(int hartid)
 {
+    ::hartid = hartid; // first: k_current_hart reads it while the other harts still boot
     if (k_hart_state[hartid] != 1) // Not desired to be bootup, maybe timeout, or failed
         return K_ENOSPC;
 
@@ -32,19 +40,34 @@ int k_pre_main(int hartid)
         k_hart_state[hartid] = 3; // mark as failed
         return K_EFAIL;
     }
+    SBIF::Timer::clearTimer(); // tickless, programmed on demand
 
     // Init hart locals
     _REENT_INIT_PTR(&hl_reent);
-    ::hartid = hartid;
 
     // set up exception table
     extern char _exctable;
     set_stvec((unsigned long)&_exctable, 1);
     csr_set(CSR_SIE, SIP_STIP | SIP_SSIP); // This cannot be moved to main or other place, not known why
+    csr_set(CSR_SIE, MIP_SEIP);            // external interrupts, routed by the PLIC
+
+    if (k_perf_init(hartid) != K_OK && hartid == k_boot_hartid)
+        printf("SBI PMU not available, performance counters read as 0\n");
+
+    if (k_timeout_hart_init(hartid) != K_OK)
+        printf("Hart %d runs without timeouts\n", hartid);
+
+    k_rcu_hart_init(hartid);
+
+    auto trc = k_thread_init(hartid);
+    if (trc != K_OK)
+        printf("Hart %d runs without threads: %d\n", hartid, trc);
 
     k_hart_state[hartid] = 2;
     while (k_stage != K_MULTICORE)
-        ; // wait for the boot core to finish
+        asm volatile("wfi"); // wait for the boot core to finish, it sends an IPI
+    k_timer_set(K_TIMER_HOUSEKEEPING, csr_read(CSR_TIME) + k_cpuclock);
+    k_timer_program();
     csr_set(CSR_SSTATUS, SSTATUS_SIE);
     return 0;
 }
@@ -131,10 +154,16 @@ int k_main()
 
 int k_after_main(int main_ret)
 {
+    k_thread_drain(); // the hart stops with its boot task, let the others finish first
+    k_rcu_hart_offline();
+
     // Disable all interrupts
     csr_clear(CSR_SIE, (uint64_t)-1);
     printf("Hart %i has returned with %d\n", ::hartid, main_ret);
+    k_log_flush(); // records queued from ISRs
     while (k_hart_state[::hartid] != 3)
         k_hart_state[::hartid] = 3;
+    if (::hartid != k_boot_hartid)
+        SBIF::IPI::sendIPI(1UL << k_boot_hartid, 0); // waiting in k_before_cleanup
     return main_ret; // pass to the lower
 }
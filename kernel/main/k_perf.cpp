@@ -0,0 +1,111 @@
+#include <cstring>
+
+#include "k_main.h"
+#include "k_perf.h"
+#include "k_sbif.hpp"
+#include "k_log.h"
+#include "k_rwlock.h"
+#include "k_thread.h"
+
+const char *const k_perf_names[PERF_EVENT_MAX] = {"cycles",      "instret",     "cache-refs",
+                                                  "cache-misses", "branch-misses", "l1d-misses",
+                                                  "l1i-misses",  "dtlb-misses", "itlb-misses"};
+
+static constexpr unsigned long perf_events[PERF_EVENT_MAX] = {
+    SBIF::PMU::eventHW(SBI_PMU_HW_CPU_CYCLES),
+    SBIF::PMU::eventHW(SBI_PMU_HW_INSTRUCTIONS),
+    SBIF::PMU::eventHW(SBI_PMU_HW_CACHE_REFERENCES),
+    SBIF::PMU::eventHW(SBI_PMU_HW_CACHE_MISSES),
+    SBIF::PMU::eventHW(SBI_PMU_HW_BRANCH_MISSES),
+    SBIF::PMU::eventCache(SBI_PMU_HW_CACHE_L1D, SBI_PMU_HW_CACHE_OP_READ, SBI_PMU_HW_CACHE_RESULT_MISS),
+    SBIF::PMU::eventCache(SBI_PMU_HW_CACHE_L1I, SBI_PMU_HW_CACHE_OP_READ, SBI_PMU_HW_CACHE_RESULT_MISS),
+    SBIF::PMU::eventCache(SBI_PMU_HW_CACHE_DTLB, SBI_PMU_HW_CACHE_OP_READ, SBI_PMU_HW_CACHE_RESULT_MISS),
+    SBIF::PMU::eventCache(SBI_PMU_HW_CACHE_ITLB, SBI_PMU_HW_CACHE_OP_READ, SBI_PMU_HW_CACHE_RESULT_MISS),
+};
+
+struct perf_hart_t
+{
+    int ctr[PERF_EVENT_MAX]; // SBI counter index, -1 when not counted
+    SBIF::PMU::counter_info_t info[PERF_EVENT_MAX];
+    unsigned supported;
+    alignas(64) seqcount_t seq; // published is only written by its own hart
+    perf_counters_t published;
+};
+
+static perf_hart_t perf_harts[K_CONFIG_MAX_PROCESSORS];
+
+int k_perf_init(int hartid)
+{
+    auto &h = perf_harts[hartid];
+    h.supported = 0;
+    for (auto &c : h.ctr)
+        c = -1;
+    if (!SBIF::PMU::available())
+        return K_ENOSYS;
+
+    long n = SBIF::PMU::numCounters();
+    unsigned long mask = n >= (long)(sizeof(long) * 8) ? -1UL : (1UL << n) - 1;
+    for (int i = 0; i < PERF_EVENT_MAX; i++)
+    {
+        // Count in S- and U-mode only, firmware time is not ours to optimize
+        long idx = SBIF::PMU::configMatch(0, mask,
+                                          SBI_PMU_CFG_FLAG_CLEAR_VALUE | SBI_PMU_CFG_FLAG_AUTO_START |
+                                              SBI_PMU_CFG_FLAG_SET_MINH,
+                                          perf_events[i]);
+        if (idx < 0 || SBIF::PMU::getInfo(idx, h.info[i]))
+            continue;
+        mask &= ~(1UL << idx); // one event per counter
+        h.ctr[i] = idx;
+        h.supported |= 1U << i;
+    }
+    return K_OK;
+}
+
+unsigned k_perf_supported()
+{
+    return perf_harts[k_current_hart()].supported;
+}
+
+uint64_t k_perf_read(perf_event_t ev)
+{
+    auto &h = perf_harts[k_current_hart()];
+    if (h.ctr[ev] < 0)
+        return 0;
+    if (h.info[ev].firmware)
+        return SBIF::PMU::fwRead(h.ctr[ev]);
+    return SBIF::PMU::hwRead(h.info[ev].csr);
+}
+
+void k_perf_read(perf_counters_t &c)
+{
+    for (int i = 0; i < PERF_EVENT_MAX; i++)
+        c.v[i] = k_perf_read((perf_event_t)i);
+}
+
+void k_perf_publish()
+{
+    perf_counters_t c;
+    k_perf_read(c);
+    irq_guard_t g; // the tick publishes too, writes must not nest
+    auto &h = perf_harts[k_current_hart()];
+    h.seq.write_begin();
+    for (int i = 0; i < PERF_EVENT_MAX; i++)
+        __atomic_store_n(&h.published.v[i], c.v[i], __ATOMIC_RELAXED);
+    h.seq.write_end();
+}
+
+int k_perf_hart(int hart, perf_counters_t &c)
+{
+    if (hart < 0 || hart >= K_CONFIG_MAX_PROCESSORS)
+        return K_EINVAL;
+    // One snapshot: all counters from the same publish
+    auto &h = perf_harts[hart];
+    uint32_t s;
+    do
+    {
+        s = h.seq.read_begin();
+        for (int i = 0; i < PERF_EVENT_MAX; i++)
+            c.v[i] = __atomic_load_n(&h.published.v[i], __ATOMIC_RELAXED);
+    } while (h.seq.read_retry(s));
+    return K_OK;
+}
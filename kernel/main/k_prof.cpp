@@ -0,0 +1,186 @@
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <vector>
+#include <fcntl.h>
+
+#include "k_main.h"
+#include "k_prof.h"
+#include "k_sbif.hpp"
+#include "k_mem.hpp"
+#include "k_vfs.h"
+#include "k_log.h"
+
+struct prof_buf_t
+{
+    std::atomic<uint32_t> count; // published samples, only the owning hart adds
+    uint32_t dropped;
+    uint64_t next; // time of the next sample
+    alignas(64) prof_sample_t samples[K_CONFIG_PROF_SAMPLES];
+};
+
+static prof_buf_t *prof_bufs[K_CONFIG_MAX_PROCESSORS];
+static uint64_t prof_interval;
+std::atomic_bool k_prof_on = false;
+
+static void prof_walk(prof_sample_t &s, umode_basic_ctx_t *uctx)
+{
+    s.frames[s.depth++] = uctx->pc;
+#if K_CONFIG_PROF_FP_WALK
+    // s0 points right above the {prev fp, ra} record of each frame; stay on the interrupted kernel stack
+    uintptr_t lo = (uintptr_t)uctx + sizeof(*uctx);
+    uintptr_t hi = (lo + K_CONFIG_STACK_SIZE - 1) & ~(uintptr_t)(K_CONFIG_STACK_SIZE - 1);
+    uintptr_t fp = uctx->s[0];
+    while (s.depth < K_CONFIG_PROF_DEPTH && fp > lo + 2 * sizeof(uintptr_t) && fp <= hi &&
+           !(fp & (sizeof(uintptr_t) - 1)))
+    {
+        uintptr_t ra = ((uintptr_t *)fp)[-1];
+        uintptr_t prev = ((uintptr_t *)fp)[-2];
+        if (!ra)
+            break;
+        s.frames[s.depth++] = ra;
+        if (prev <= fp)
+            break;
+        fp = prev;
+    }
+#else
+    // Without frame pointers ra is the only caller we know of, it is stale once a non-leaf function made a call
+    s.frames[s.depth++] = uctx->ra;
+#endif
+}
+
+uint64_t k_prof_tick(umode_basic_ctx_t *uctx, uint64_t now)
+{
+    if (!k_prof_on.load(std::memory_order_relaxed))
+        return 0;
+    int hart = k_current_hart();
+    auto b = hart >= 0 && hart < K_CONFIG_MAX_PROCESSORS ? prof_bufs[hart] : nullptr;
+    if (!b)
+        return 0;
+    if (now < b->next)
+        return b->next;
+    b->next = now + prof_interval; // a late tick is not caught up on, it would skew the profile
+
+    auto n = b->count.load(std::memory_order_relaxed);
+    if (n >= K_CONFIG_PROF_SAMPLES)
+    {
+        b->dropped++;
+        return b->next;
+    }
+    auto &s = b->samples[n];
+    s.depth = 0;
+    s.flags = 0;
+    if (csr_read(CSR_SSTATUS) & SSTATUS_SPP)
+        prof_walk(s, uctx);
+    else
+    {
+        s.flags = PROF_SAMPLE_USER;
+        s.frames[s.depth++] = uctx->pc;
+        s.frames[s.depth++] = uctx->ra;
+    }
+    b->count.store(n + 1, std::memory_order_release);
+    return b->next;
+}
+
+int k_prof_start(unsigned hz)
+{
+    if (!hz)
+        hz = K_CONFIG_PROF_HZ;
+    prof_interval = std::max(k_cpuclock / hz, 1UL);
+    for (auto &cpu : syscpu->CPUs())
+    {
+        if (cpu.hid >= K_CONFIG_MAX_PROCESSORS || prof_bufs[cpu.hid])
+            continue;
+        auto b = alignedMalloc<prof_buf_t>(sizeof(prof_buf_t), 64);
+        if (!b)
+            return K_ENOMEM;
+        memset((void *)b, 0, sizeof(prof_buf_t));
+        prof_bufs[cpu.hid] = b;
+    }
+    // Every hart arms its sampling timer when it takes the IPI
+    k_prof_on = true;
+    for (auto &cpu : syscpu->CPUs())
+        if (cpu.hid < K_CONFIG_MAX_PROCESSORS)
+            SBIF::IPI::sendIPI(1UL << cpu.hid, 0);
+    return K_OK;
+}
+
+void k_prof_stop()
+{
+    k_prof_on = false;
+}
+
+void k_prof_reset()
+{
+    bool was_on = k_prof_on.exchange(false);
+    for (auto b : prof_bufs)
+        if (b)
+        {
+            b->count.store(0, std::memory_order_relaxed);
+            b->dropped = 0;
+        }
+    k_prof_on = was_on;
+}
+
+int k_prof_dump(const char *path)
+{
+    bool was_on = k_prof_on.exchange(false);
+    std::vector<const prof_sample_t *> all;
+    uint64_t dropped = 0;
+    for (auto b : prof_bufs)
+    {
+        if (!b)
+            continue;
+        auto n = b->count.load(std::memory_order_acquire);
+        for (uint32_t i = 0; i < n; i++)
+            all.push_back(&b->samples[i]);
+        dropped += b->dropped;
+    }
+
+    // Identical stacks end up next to each other, each run becomes one line
+    auto less = [](const prof_sample_t *a, const prof_sample_t *b) {
+        if (a->flags != b->flags)
+            return a->flags < b->flags;
+        return std::lexicographical_compare(a->frames, a->frames + a->depth, b->frames, b->frames + b->depth);
+    };
+    auto same = [](const prof_sample_t *a, const prof_sample_t *b) {
+        return a->flags == b->flags && a->depth == b->depth &&
+               !memcmp(a->frames, b->frames, a->depth * sizeof(a->frames[0]));
+    };
+    std::sort(all.begin(), all.end(), less);
+
+    int fd = -1;
+    if (path && (fd = VirtualFS::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    {
+        k_prof_on = was_on;
+        return fd;
+    }
+
+    int rc = K_OK;
+    char line[32 + K_CONFIG_PROF_DEPTH * 20];
+    for (size_t i = 0; rc >= 0 && i < all.size();)
+    {
+        size_t j = i + 1;
+        while (j < all.size() && same(all[i], all[j]))
+            j++;
+        auto s = all[i];
+        int len = 0;
+        if (s->flags & PROF_SAMPLE_USER)
+            len += snprintf(line + len, sizeof(line) - len, "[user];");
+        for (int f = s->depth - 1; f >= 0; f--) // folded stacks go from the root to the leaf
+            len += snprintf(line + len, sizeof(line) - len, "0x%lx%c", s->frames[f], f ? ';' : ' ');
+        len += snprintf(line + len, sizeof(line) - len, "%lu\n", j - i);
+        if (fd >= 0)
+            rc = VirtualFS::write(fd, line, len);
+        else
+            printf("%s", line);
+        i = j;
+    }
+    if (dropped)
+        k_printk("Profiler: %lu samples dropped, buffers full\n", dropped);
+
+    if (fd >= 0)
+        VirtualFS::close(fd);
+    k_prof_on = was_on;
+    return rc < 0 ? rc : K_OK;
+}
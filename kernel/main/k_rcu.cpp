@@ -0,0 +1,184 @@
+#include <atomic>
+
+#include "k_main.h"
+#include "k_rcu.h"
+#include "k_thread.h"
+#include "k_timer.h"
+
+namespace
+{
+struct alignas(64) rcu_hart_t
+{
+    std::atomic<uint64_t> qs = 0;  // latest grace period started when the hart was last quiescent
+    std::atomic<bool> online = false;
+    std::atomic<bool> idle = false; // quiescent until it is cleared
+    rcu_head_t *head = nullptr;     // callbacks, by grace period, interrupts off
+    rcu_head_t **tail = &head;
+};
+
+// Indexed, not hart locals: ISRs run with the hart locals of the interrupted task
+rcu_hart_t harts[K_CONFIG_MAX_PROCESSORS];
+std::atomic<uint64_t> gp_started = 0;
+std::atomic<uint64_t> gp_done = 0;
+
+uint64_t _pollTime(uint64_t now)
+{
+    return now + k_cpuclock * K_CONFIG_RCU_POLL_US / 1000000;
+}
+
+// Get grace period gp going, unless the one running now has to end first
+void _request(uint64_t gp)
+{
+    auto s = gp_started.load();
+    if (s < gp && gp_done.load() >= s)
+        gp_started.compare_exchange_strong(s, s + 1);
+}
+
+// End the running grace period if every hart went through a quiescent state since it started. With kick, the
+// harts still missing one are interrupted to report it. True when no grace period is running anymore.
+bool _advance(bool kick)
+{
+    auto target = gp_started.load();
+    auto done = gp_done.load();
+    if (done >= target)
+        return true;
+    bool all = true;
+    int self = k_current_hart();
+    for (int h = 0; h < K_CONFIG_MAX_PROCESSORS; h++)
+    {
+        auto &r = harts[h];
+        if (!r.online.load() || r.idle.load() || r.qs.load() >= target)
+            continue;
+        all = false;
+        if (!kick)
+            break;
+        if (h != self)
+            k_timer_kick(h); // its timer ISR reports, unless it is inside a read section
+    }
+    if (!all)
+        return false;
+    while (done < target && !gp_done.compare_exchange_weak(done, target))
+        ;
+    return true;
+}
+
+// Run the callbacks of this hart whose grace period ended, interrupts off
+void _runCallbacks(rcu_hart_t &r)
+{
+    if (!r.head)
+        return;
+    _advance(true);
+    auto done = gp_done.load(std::memory_order_acquire);
+    while (r.head && r.head->gp <= done)
+    {
+        auto cb = r.head;
+        r.head = cb->next;
+        if (!r.head)
+            r.tail = &r.head;
+        cb->fn(cb);
+    }
+    if (r.head)
+        _request(r.head->gp);
+}
+} // namespace
+
+void k_rcu_hart_init(int hartid)
+{
+    auto &r = harts[hartid];
+    r.qs = gp_started.load();
+    r.online = true;
+}
+
+void k_rcu_hart_offline()
+{
+    auto &r = harts[k_current_hart()];
+    if (k_stage != K_MULTICORE || !r.online)
+        return;
+    for (;;)
+    {
+        k_rcu_qs();
+        irq_guard_t g;
+        _runCallbacks(r);
+        if (!r.head)
+            break;
+        k_cpu_relax();
+    }
+    r.online = false;
+}
+
+void k_rcu_qs()
+{
+    auto &r = harts[k_current_hart()];
+    r.qs.store(gp_started.load());
+}
+
+uint64_t k_rcu_tick(uint64_t now)
+{
+    auto &r = harts[k_current_hart()];
+    if (k_stage != K_MULTICORE || !r.online)
+        return 0;
+    // k_preempt_count is the one of the interrupted task: 0 means no read section, and no lock held either
+    if (!k_preempt_count)
+    {
+        k_rcu_qs();
+        _runCallbacks(r);
+    }
+    return r.head ? _pollTime(now) : 0;
+}
+
+void k_rcu_idle_enter()
+{
+    auto &r = harts[k_current_hart()];
+    if (k_stage != K_MULTICORE || !r.online)
+        return;
+    k_rcu_qs();
+    _runCallbacks(r);
+    r.idle.store(true);
+}
+
+void k_rcu_idle_exit()
+{
+    auto &r = harts[k_current_hart()];
+    r.idle.store(false);
+    std::atomic_thread_fence(std::memory_order_seq_cst); // readers from now on see what was published before
+}
+
+void synchronize_rcu()
+{
+    if (k_stage != K_MULTICORE)
+        return;
+    // Readers that may hold the old version started before now, a grace period starting later covers them
+    uint64_t gp = gp_started.load() + 1;
+    for (bool kick = false;; kick = true)
+    {
+        k_rcu_qs();
+        _request(gp);
+        if (_advance(kick) && gp_done.load() >= gp)
+            break;
+        k_thread_sleep_us(K_CONFIG_RCU_POLL_US / 10); // spins on harts without threads
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+}
+
+void call_rcu(rcu_head_t *head, void (*fn)(rcu_head_t *))
+{
+    auto &r = harts[k_current_hart()];
+    if (k_stage != K_MULTICORE || !r.online)
+    {
+        synchronize_rcu(); // nothing would run the callback on this hart
+        fn(head);
+        return;
+    }
+    irq_guard_t g;
+    head->fn = fn;
+    head->next = nullptr;
+    head->gp = gp_started.load() + 1;
+    *r.tail = head;
+    r.tail = &head->next;
+    _request(head->gp);
+    if (!k_timer_get(K_TIMER_RCU))
+    {
+        k_timer_set(K_TIMER_RCU, _pollTime(csr_read(CSR_TIME)));
+        k_timer_program();
+    }
+}
@@ -0,0 +1,51 @@
+#include "k_main.h"
+#include "k_lock.h"
+#include "k_rwlock.h"
+
+void rwlock_t::read_lock()
+{
+    k_lock_preempt_off(); // the counter belongs to this hart until read_unlock
+    auto &r = readers[k_current_hart()].n;
+    if (r.load(std::memory_order_relaxed) > 0)
+    {
+        r.fetch_add(1, std::memory_order_relaxed); // nested, a waiting writer already counts this hart
+        return;
+    }
+    for (;;)
+    {
+        r.fetch_add(1, std::memory_order_seq_cst);
+        if (!writer.load(std::memory_order_seq_cst))
+            return;
+        r.fetch_sub(1, std::memory_order_relaxed); // a writer got in first, let it drain us
+        while (writer.load(std::memory_order_relaxed))
+            k_cpu_relax();
+    }
+}
+
+void rwlock_t::read_unlock()
+{
+    readers[k_current_hart()].n.fetch_sub(1, std::memory_order_release);
+    if (k_stage == K_MULTICORE)
+        k_preempt_count--; // read sides do not straddle the switch to K_MULTICORE
+}
+
+void rwlock_t::write_lock()
+{
+    k_lock_preempt_off(); // readers spin unpreempted while the flag is up
+    bool free = false;
+    while (!writer.compare_exchange_weak(free, true, std::memory_order_seq_cst))
+    {
+        free = false;
+        k_cpu_relax();
+    }
+    for (auto &r : readers)
+        while (r.n.load(std::memory_order_acquire))
+            k_cpu_relax();
+}
+
+void rwlock_t::write_unlock()
+{
+    writer.store(false, std::memory_order_release);
+    if (k_stage == K_MULTICORE)
+        k_preempt_count--;
+}
@@ -0,0 +1,29 @@
+#include <cstring>
+
+#include "k_main.h"
+#include "k_stats.h"
+
+kstats_t k_stats[K_CONFIG_MAX_PROCESSORS];
+
+// Every field is a uint64_t, walk the block as an array of them
+static constexpr int STATS_WORDS = sizeof(kstats_t) / sizeof(uint64_t);
+
+void k_stats_hart(int hart, kstats_t &out)
+{
+    auto src = (const volatile uint64_t *)&k_stats[hart];
+    auto dst = (uint64_t *)&out;
+    for (int i = 0; i < STATS_WORDS; i++)
+        dst[i] = src[i];
+}
+
+void k_stats_sum(kstats_t &sum)
+{
+    memset((void *)&sum, 0, sizeof(sum));
+    auto dst = (uint64_t *)&sum;
+    for (auto &h : k_stats)
+    {
+        auto src = (const volatile uint64_t *)&h;
+        for (int i = 0; i < STATS_WORDS; i++)
+            dst[i] += src[i];
+    }
+}
@@ -0,0 +1,514 @@
+#include <cstring>
+#include <atomic>
+
+#include "k_main.h"
+#include "k_thread.h"
+#include "k_umode.h"
+#include "k_mem.hpp"
+#include "k_stats.h"
+#include "k_trace.h"
+#include "k_lock.h"
+#include "k_timer.h"
+#include "k_timeout.h"
+#include "k_rcu.h"
+#include "k_log.h"
+
+extern "C" char _tdata_start[], _tdata_end[], _tbss_start[], _tbss_end[], _tls_len[];
+
+// In k_isr.cpp: save the caller as a frame in *save, then resume next
+extern "C" void _k_thread_switch(umode_basic_ctx_t **save, umode_basic_ctx_t *next);
+
+struct alignas(64) hart_sched_t
+{
+    thread_t *curr = nullptr;
+    thread_t *boot = nullptr;
+    thread_t *idle = nullptr;
+    thread_t *zombie = nullptr; // exited, freed once the hart is off its stack
+    thread_t *prev = nullptr;   // switched out, still on_cpu until k_thread_finish
+    bool requeue = false;       // prev was preempted, k_thread_finish queues it again
+    long hdl = -1;
+    volatile bool need_resched = false; // set by wakers on any hart
+    uint64_t next_tick = 0;  // 0 while no task waits for the hart: tickless
+    uint64_t next_event = 0; // asked for by the scheduler, see SysScheduler::nextEvent
+};
+
+static hart_sched_t harts[K_CONFIG_MAX_PROCESSORS];
+static std::atomic<uint32_t> next_tid = 1;
+static std::atomic<int> live_threads = 0; // created and not exited yet, boot and idle tasks excluded
+static lock_t threads_lock;               // the list of every thread, for k_thread_foreach
+static thread_t *threads = nullptr;
+static std::atomic<unsigned long> idle_mask = 0; // harts parked in their idle task
+
+static SysScheduler *sched()
+{
+    return sysroot->scheduler();
+}
+
+static uintptr_t _tp()
+{
+    uintptr_t tp;
+    asm volatile("mv %0, tp" : "=r"(tp));
+    return tp;
+}
+
+// The instance of a hart local in another task
+template <typename T> static T &_tlsOf(thread_t *t, T &var)
+{
+    return *(T *)(t->tls + ((uintptr_t)&var - _tp()));
+}
+
+static void _link(thread_t *t)
+{
+    threads_lock.lock();
+    t->list_next = threads;
+    if (threads)
+        threads->list_prev = t;
+    threads = t;
+    threads_lock.unlock();
+}
+
+static void _unlink(thread_t *t)
+{
+    threads_lock.lock();
+    (t->list_prev ? t->list_prev->list_next : threads) = t->list_next;
+    if (t->list_next)
+        t->list_next->list_prev = t->list_prev;
+    threads_lock.unlock();
+}
+
+static void _fpSwitch(thread_t *prev, thread_t *next)
+{
+#if K_CONFIG_THREAD_FP
+    using fp_ctx_t = umode_float_ctx_t<__riscv_flen>;
+    constexpr unsigned long FS_INITIAL = 1UL << 13, FS_CLEAN = 2UL << 13;
+    // Only a task that touched the FPU since it was switched in (FS dirty) pays for a save
+    if ((csr_read(CSR_SSTATUS) & SSTATUS_FS) == SSTATUS_FS)
+    {
+        ((fp_ctx_t *)prev->fp)->save();
+        prev->fp_used = true;
+    }
+    csr_clear(CSR_SSTATUS, SSTATUS_FS);
+    if (next->fp_used)
+    {
+        csr_set(CSR_SSTATUS, FS_CLEAN);
+        ((fp_ctx_t *)next->fp)->restore();
+        csr_clear(CSR_SSTATUS, SSTATUS_FS);
+        csr_set(CSR_SSTATUS, FS_CLEAN);
+    }
+    else
+        csr_set(CSR_SSTATUS, FS_INITIAL);
+#else
+    (void)prev;
+    (void)next;
+#endif
+}
+
+// The periodic tick only runs while tasks wait for the hart (prev about to be requeued counts), the events of
+// the scheduler always. Returns when the hart wants its next timer interrupt for them, 0 for never.
+static uint64_t _schedTimer(hart_sched_t &hs, uint64_t now)
+{
+    if (hs.curr != hs.idle && (hs.requeue || sched()->queued(hs.hdl)))
+    {
+        if (!hs.next_tick)
+            hs.next_tick = now + k_cpuclock / K_CONFIG_SCHED_HZ;
+    }
+    else
+        hs.next_tick = 0;
+    hs.next_event = sched()->nextEvent(hs.hdl);
+    if (!hs.next_tick || (hs.next_event && hs.next_event < hs.next_tick))
+        return hs.next_event;
+    return hs.next_tick;
+}
+
+// Get a parked hart to look at the run queues, for schedulers that steal work
+static void _kickIdle()
+{
+    auto m = idle_mask.load(std::memory_order_relaxed) & ~(1UL << hartid);
+    if (m)
+        k_timer_kick(__builtin_ctzl(m));
+}
+
+// Everything but the register switch itself, interrupts are off. A still runnable prev is queued again only once
+// the hart is off its stack (k_thread_finish), so another hart can not resume it early.
+static void _prepare(hart_sched_t &hs, thread_t *prev, thread_t *next)
+{
+    // Only a task woken by an ISR of its own hart before it switched away can still be on_cpu here, its hart
+    // is a few instructions away from k_thread_finish with interrupts off
+    while (next->on_cpu.load(std::memory_order_acquire))
+        ;
+    next->on_cpu.store(true, std::memory_order_relaxed);
+    k_rcu_qs(); // prev is switched out between read sections
+    hs.requeue = prev != hs.idle && prev->state == SysScheduler::TASK_RUNNING;
+    if (hs.requeue)
+        prev->state = SysScheduler::TASK_READY;
+    hs.prev = prev;
+    _fpSwitch(prev, next);
+    _tlsOf(next, hartid) = hartid;
+    next->hart = hartid;
+    next->state = SysScheduler::TASK_RUNNING;
+    hs.curr = next;
+    K_STAT_INC(ctx_switches);
+    K_TRACE(sched_switch, prev->tid, next->tid);
+    k_timer_set(K_TIMER_SCHED, _schedTimer(hs, csr_read(CSR_TIME)));
+    k_timer_program();
+}
+
+static void _reap(hart_sched_t &hs)
+{
+    auto z = hs.zombie;
+    if (!z || z == hs.curr)
+        return;
+    hs.zombie = nullptr;
+    _unlink(z);
+    alignedFree(z->stack);
+    alignedFree(z->fp);
+    delete z->dl;
+    delete z;
+}
+
+// Switch to the next task, the current one stays queued if it is still runnable. Interrupts are off.
+static void _schedule(hart_sched_t &hs)
+{
+    auto prev = hs.curr;
+    bool runnable = prev->state == SysScheduler::TASK_RUNNING;
+    auto next = sched()->pickNext(hs.hdl);
+    if (!next)
+    {
+        if (runnable && !sched()->throttled(hs.hdl, prev))
+            return;
+        next = hs.idle;
+    }
+    hs.need_resched = false;
+    if (next == prev) // woken up before it got switched out
+    {
+        prev->state = SysScheduler::TASK_RUNNING;
+        return;
+    }
+    _prepare(hs, prev, next);
+    _k_thread_switch(&prev->ctx, next->ctx);
+    // Back on prev, possibly much later
+    _reap(hs);
+}
+
+static void _threadStart(thread_t *t)
+{
+    ((void (*)(void *))t->start)(t->arg);
+    k_thread_exit();
+}
+
+static void _idle(void *)
+{
+    auto &hs = harts[hartid];
+    auto bit = 1UL << hartid;
+    while (true)
+    {
+        k_yield();
+        k_log_flush(); // idle harts are the log flusher
+        irq_guard_t g; // a wakeup between the check and the wfi leaves its interrupt pending
+        if (hs.need_resched || sched()->queued(hs.hdl) || k_log_pending())
+            continue;
+        idle_mask |= bit;
+        k_timer_idle();
+        idle_mask &= ~bit;
+    }
+}
+
+void k_thread_kick_idle()
+{
+    if (k_stage == K_MULTICORE)
+        _kickIdle();
+}
+
+static thread_t *_create(void (*fn)(void *), void *arg, const char *name, int priority, int hart)
+{
+    auto stack = alignedMalloc<uint8_t>(K_CONFIG_STACK_SIZE, K_CONFIG_STACK_SIZE);
+    if (!stack)
+        return nullptr;
+    void *fp = nullptr;
+#if K_CONFIG_THREAD_FP
+    fp = alignedMalloc<void>(sizeof(umode_float_ctx_t<__riscv_flen>), 16);
+    if (!fp)
+    {
+        alignedFree(stack);
+        return nullptr;
+    }
+#endif
+    auto t = new thread_t{priority, (uintptr_t)fn};
+    t->arg = arg;
+    t->name = name;
+    t->tid = next_tid++;
+    t->hart = hart;
+    t->stack = stack;
+    t->fp = fp;
+
+    // Hart locals at the top, as _setup_hart lays them out
+    uintptr_t top = (uintptr_t)stack + K_CONFIG_STACK_SIZE;
+    t->tls = top - (uintptr_t)_tls_len;
+    memcpy((void *)t->tls, _tdata_start, _tdata_end - _tdata_start);
+    memset((void *)(t->tls + (_tdata_end - _tdata_start)), 0, _tbss_end - _tbss_start);
+    _REENT_INIT_PTR(&_tlsOf(t, hl_reent));
+    _tlsOf(t, hartid) = hart;
+
+    // First frame: "return" from a trap into _threadStart(t)
+    auto ctx = (umode_basic_ctx_t *)((t->tls & ~15UL) - sizeof(umode_basic_ctx_t));
+    memset(ctx, 0, sizeof(*ctx));
+    asm volatile("mv %0, gp" : "=r"(ctx->gp));
+    ctx->tp = t->tls;
+    ctx->a[0] = (uintptr_t)t;
+    ctx->pc = (uintptr_t)_threadStart;
+    ctx->sp = 0; // sscratch, 0 for S-mode
+    t->ctx = ctx;
+    _link(t);
+    return t;
+}
+
+int k_thread_setup()
+{
+    for (auto &cpu : syscpu->CPUs())
+    {
+        if (cpu.hid >= K_CONFIG_MAX_PROCESSORS)
+            continue;
+        harts[cpu.hid].hdl = sched()->addDevice(nullptr, cpu.hid);
+        if (harts[cpu.hid].hdl < 0)
+            return harts[cpu.hid].hdl;
+    }
+    return K_OK;
+}
+
+int k_thread_init(int hartid)
+{
+    auto &hs = harts[hartid];
+    if (hs.hdl < 0)
+        return K_ENODEV;
+
+    auto boot = new thread_t{0, 0};
+    boot->name = "boot";
+    boot->tid = next_tid++;
+    boot->hart = hartid;
+    boot->affinity = 1UL << hartid; // k_after_main has to run on the hart it stops
+    boot->tls = _tp();
+    boot->state = SysScheduler::TASK_RUNNING;
+    boot->on_cpu = true;
+#if K_CONFIG_THREAD_FP
+    boot->fp = alignedMalloc<void>(sizeof(umode_float_ctx_t<__riscv_flen>), 16);
+#endif
+    hs.boot = hs.curr = boot;
+    _link(boot);
+
+    hs.idle = _create(_idle, nullptr, "idle", 0, hartid);
+    if (!hs.idle)
+        return K_ENOMEM;
+    hs.idle->state = SysScheduler::TASK_READY; // never queued, picked when nothing else is
+    return K_OK;
+}
+
+thread_t *k_thread_create(void (*fn)(void *), void *arg, const char *name, int priority, int hart)
+{
+    if (hart < 0)
+        hart = k_current_hart();
+    if (hart >= K_CONFIG_MAX_PROCESSORS || !harts[hart].idle)
+        return nullptr; // the hart does not run threads
+    auto t = _create(fn, arg, name, priority, hart);
+    if (!t)
+        return nullptr;
+    live_threads++;
+    t->state = SysScheduler::TASK_READY;
+    irq_guard_t g;
+    sched()->addTask(harts[hart].hdl, t);
+    harts[hart].need_resched = true;
+    k_timer_kick(hart);
+    return t;
+}
+
+thread_t *k_thread_self()
+{
+    return harts[hartid].curr;
+}
+
+void k_yield()
+{
+    irq_guard_t g;
+    _schedule(harts[hartid]);
+}
+
+void k_thread_block()
+{
+    irq_guard_t g; // SIE as it was: off from an ecall, whose nested interrupts would run on the user stack
+    _schedule(harts[hartid]);
+}
+
+static void _sleepDone(timeout_t *, void *arg)
+{
+    k_thread_wake((thread_t *)arg);
+}
+
+void k_thread_sleep_us(uint64_t us)
+{
+    uint64_t until = csr_read(CSR_TIME) + k_cpuclock * us / 1000000;
+    auto self = harts[hartid].curr;
+    timeout_t to;
+    k_timeout_init(&to, _sleepDone, self);
+    // Blocked before the timeout is armed, it may fire before the switch: k_thread_wake copes with that. Not
+    // preempted in between, k_thread_preempt leaves tasks that are not running alone.
+    if (self)
+        self->state = SysScheduler::TASK_BLOCKED;
+    if (!self || k_timeout_add(&to, until, K_TIMEOUT_HRES) != K_OK)
+    {
+        if (self)
+            self->state = SysScheduler::TASK_RUNNING;
+        while (csr_read(CSR_TIME) < until)
+            ;
+        return;
+    }
+    k_thread_block();
+    k_timeout_cancel_sync(&to); // woken by someone else, to lives on this stack
+}
+
+bool k_thread_claim(thread_t *t)
+{
+    int expected = SysScheduler::TASK_BLOCKED;
+    return t->state.compare_exchange_strong(expected, SysScheduler::TASK_READY);
+}
+
+void k_thread_enqueue(thread_t *t)
+{
+    // Still switching away on another hart, queue it once that hart is off its stack
+    while (t->on_cpu.load(std::memory_order_acquire) && t != harts[hartid].curr)
+        ;
+    irq_guard_t g;
+    sched()->addTask(harts[t->hart].hdl, t);
+    harts[t->hart].need_resched = true;
+    k_timer_kick(t->hart);
+}
+
+bool k_thread_wake(thread_t *t)
+{
+    if (!k_thread_claim(t))
+        return false;
+    k_thread_enqueue(t);
+    return true;
+}
+
+void k_thread_exit()
+{
+    csr_clear(CSR_SSTATUS, SSTATUS_SIE);
+    auto &hs = harts[hartid];
+    auto self = hs.curr;
+    _reap(hs);
+    if (self->dl)
+        sched()->setDeadline(hs.hdl, self, 0, 0, 0); // give the bandwidth back
+    self->state = SysScheduler::TASK_DEAD;
+    hs.zombie = self;
+    if (--live_threads == 0)
+        for (int h = 0; h < K_CONFIG_MAX_PROCESSORS; h++)
+            if (harts[h].idle && h != hartid)
+                k_timer_kick(h); // boot tasks parked in k_thread_drain
+    _schedule(hs);
+    __builtin_unreachable();
+}
+
+void k_thread_drain()
+{
+    auto &hs = harts[hartid];
+    while (hs.idle && live_threads > 0)
+    {
+        k_yield();
+        irq_guard_t g;
+        if (live_threads > 0 && !hs.need_resched && !sched()->queued(hs.hdl))
+            k_timer_idle(); // everything else is blocked or on other harts, wait for a wakeup
+    }
+}
+
+void k_thread_set_affinity(thread_t *t, unsigned long mask)
+{
+    t->affinity = mask;
+}
+
+int k_thread_set_deadline(uint64_t runtime_us, uint64_t deadline_us, uint64_t period_us)
+{
+    auto &hs = harts[hartid];
+    auto self = hs.curr;
+    if (!hs.idle || self == hs.idle)
+        return K_EINVAL;
+    if (!self->dl)
+        self->dl = new SysScheduler::dl_t();
+    irq_guard_t g;
+    auto us = [](uint64_t v) { return k_cpuclock * v / 1000000; };
+    return sched()->setDeadline(hs.hdl, self, us(runtime_us), us(deadline_us), us(period_us));
+}
+
+void k_thread_dl_wait()
+{
+    auto &hs = harts[hartid];
+    irq_guard_t g;
+    if (hs.curr->dl && hs.curr->dl->runtime)
+        hs.curr->dl->done = true;
+    _schedule(hs);
+}
+
+void k_thread_foreach(void (*fn)(const thread_t *t, void *arg), void *arg)
+{
+    threads_lock.lock();
+    for (auto t = threads; t; t = t->list_next)
+        fn(t, arg);
+    threads_lock.unlock();
+}
+
+// Called with sp on the frame of the next task, before it is restored: the previous one is off the hart now.
+// tp is still the one of prev, nothing may touch hart locals once prev is released.
+K_ISR void k_thread_finish()
+{
+    auto &hs = harts[hartid];
+    auto prev = hs.prev;
+    if (!prev)
+        return;
+    hs.prev = nullptr;
+    if (hs.requeue)
+        sched()->addTask(hs.hdl, prev);
+    prev->on_cpu.store(false, std::memory_order_release);
+}
+
+uint64_t k_thread_tick(uint64_t now)
+{
+    auto &hs = harts[hartid];
+    if (!hs.idle)
+        return 0;
+    if (hs.next_event && now >= hs.next_event)
+        hs.need_resched = true; // a release or the end of a budget
+    if (hs.next_tick && now >= hs.next_tick)
+    {
+        hs.next_tick = 0;
+        if (hs.curr == hs.idle || sched()->tick(hs.hdl, hs.curr))
+            hs.need_resched = true;
+    }
+    if (sched()->queued(hs.hdl))
+    {
+        if (hs.curr == hs.idle)
+            hs.need_resched = true;
+        else if (sched()->stealsWork())
+            _kickIdle();
+    }
+    return _schedTimer(hs, now);
+}
+
+umode_basic_ctx_t *k_thread_preempt(umode_basic_ctx_t *uctx)
+{
+    auto &hs = harts[hartid];
+    auto prev = hs.curr;
+    // k_preempt_count is the one of the interrupted task, the ISR runs on its stack. A task that is not running
+    // marked itself blocked and is about to call k_thread_block: switched out now, it would be on no run queue
+    // and a wake that already claimed it would be lost. It switches away itself, need_resched stays for later.
+    if (!hs.need_resched || k_preempt_count || prev->state != SysScheduler::TASK_RUNNING)
+        return uctx;
+    hs.need_resched = false;
+    auto next = sched()->pickNext(hs.hdl);
+    if (!next)
+    {
+        if (!sched()->throttled(hs.hdl, prev))
+            return uctx;
+        next = hs.idle;
+    }
+    prev->ctx = uctx;
+    _prepare(hs, prev, next);
+    return next->ctx;
+}
@@ -0,0 +1,314 @@
+#include <new>
+
+#include "k_main.h"
+#include "k_mem.hpp"
+#include "k_lock.h"
+#include "k_thread.h"
+#include "k_timer.h"
+#include "k_timeout.h"
+
+namespace
+{
+constexpr int BITS = 6;
+constexpr int SLOTS = 1 << BITS;
+constexpr int LEVELS = K_CONFIG_TIMER_WHEEL_LEVELS;
+constexpr uint64_t SPAN = 1ULL << (BITS * LEVELS); // jiffies the wheel covers
+constexpr int16_t EXPIRING = LEVELS * SLOTS;        // slot of the bucket being run
+
+enum
+{
+    TIMEOUT_IDLE = 0,
+    TIMEOUT_WHEEL,
+    TIMEOUT_TREE,
+};
+
+struct expires_less
+{
+    bool operator()(const timeout_t &a, const timeout_t &b) const
+    {
+        return (int64_t)(a.expires - b.expires) < 0;
+    }
+};
+
+struct alignas(64) timeout_base_t
+{
+    lock_t lock;
+    uint64_t clk = 0; // next jiffy to run, the ones before are done
+    uint64_t occupied[LEVELS] = {};
+    timeout_t *buckets[LEVELS * SLOTS + 1] = {}; // + the one being run
+    RBTree<timeout_t, &timeout_t::rb, expires_less> hres;
+    std::atomic<timeout_t *> running = nullptr;
+};
+
+// Indexed, not hart locals: ISRs run with the hart locals of the interrupted task
+timeout_base_t *bases[K_CONFIG_MAX_PROCESSORS];
+uint64_t jiffy = 1; // CSR_TIME ticks
+
+void _link(timeout_base_t &b, timeout_t *t, int slot)
+{
+    t->slot = slot;
+    t->prev = nullptr;
+    t->next = b.buckets[slot];
+    if (t->next)
+        t->next->prev = t;
+    b.buckets[slot] = t;
+    if (slot < EXPIRING)
+        b.occupied[slot / SLOTS] |= 1ULL << (slot % SLOTS);
+}
+
+void _unlink(timeout_base_t &b, timeout_t *t)
+{
+    int slot = t->slot;
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        b.buckets[slot] = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+    if (!b.buckets[slot] && slot < EXPIRING)
+        b.occupied[slot / SLOTS] &= ~(1ULL << (slot % SLOTS));
+    t->prev = t->next = nullptr;
+    t->slot = -1;
+}
+
+// Bucket of the lowest level the distance to the expiry fits in. Upper level buckets are reached (and cascaded)
+// at the start of their range, before any of their timeouts is due.
+void _place(timeout_base_t &b, timeout_t *t)
+{
+    uint64_t when = (t->expires + jiffy - 1) / jiffy; // never early
+    if ((int64_t)(when - b.clk) < 0)
+        when = b.clk; // already due, next run
+    uint64_t delta = when - b.clk;
+    if (delta >= SPAN)
+        when = b.clk + SPAN - 1, delta = SPAN - 1; // placed again when cascaded
+    int level = 0;
+    while (delta >= 1ULL << (BITS * (level + 1)))
+        level++;
+    _link(b, t, level * SLOTS + ((when >> (BITS * level)) & (SLOTS - 1)));
+}
+
+// First jiffy from clk on with a bucket to run or cascade, ~0 for an empty wheel
+uint64_t _nextJiffy(const timeout_base_t &b)
+{
+    uint64_t next = ~0ULL;
+    for (int level = 0; level < LEVELS; level++)
+    {
+        auto bits = b.occupied[level];
+        if (!bits)
+            continue;
+        int shift = BITS * level;
+        uint64_t k = (b.clk + (1ULL << shift) - 1) >> shift;
+        int rot = k & (SLOTS - 1);
+        bits = rot ? (bits >> rot) | (bits << (SLOTS - rot)) : bits;
+        uint64_t j = (k + __builtin_ctzll(bits)) << shift;
+        if (j < next)
+            next = j;
+    }
+    return next;
+}
+
+uint64_t _next(const timeout_base_t &b)
+{
+    uint64_t j = _nextJiffy(b);
+    uint64_t next = j == ~0ULL ? 0 : j * jiffy;
+    if (auto t = b.hres.first())
+        if (!next || t->expires < next)
+            next = t->expires;
+    return next;
+}
+
+// Locked on entry and exit, released around the callback
+void _expire(timeout_base_t &b, timeout_t *t)
+{
+    t->state = TIMEOUT_IDLE;
+    b.running = t;
+    b.lock.unlock();
+    t->fn(t, t->arg);
+    b.lock.lock();
+    b.running = nullptr;
+}
+
+// Locks the base t is queued on, interrupts off; nullptr when t is on none
+timeout_base_t *_lockBase(timeout_t *t)
+{
+    for (;;)
+    {
+        int h = t->hart;
+        if (h < 0)
+            return nullptr;
+        auto &b = *bases[h];
+        b.lock.lock();
+        if (t->hart == h)
+            return &b;
+        b.lock.unlock(); // moved meanwhile
+    }
+}
+
+int _dequeue(timeout_base_t &b, timeout_t *t)
+{
+    switch (t->state)
+    {
+    case TIMEOUT_WHEEL:
+        _unlink(b, t);
+        break;
+    case TIMEOUT_TREE:
+        b.hres.erase(t);
+        break;
+    default:
+        return K_EALREADY;
+    }
+    t->state = TIMEOUT_IDLE;
+    return K_OK;
+}
+} // namespace
+
+int k_timeout_hart_init(int hartid)
+{
+    if (bases[hartid])
+        return K_EALREADY;
+    auto mem = alignedMalloc<void>(sizeof(timeout_base_t), alignof(timeout_base_t));
+    if (!mem)
+        return K_ENOMEM;
+    jiffy = k_cpuclock * K_CONFIG_TIMER_WHEEL_US / 1000000;
+    if (!jiffy)
+        jiffy = 1;
+    auto b = new (mem) timeout_base_t();
+    b->clk = csr_read(CSR_TIME) / jiffy;
+    bases[hartid] = b;
+    return K_OK;
+}
+
+void k_timeout_init(timeout_t *t, timeout_fn_t fn, void *arg)
+{
+    new (t) timeout_t();
+    t->fn = fn;
+    t->arg = arg;
+}
+
+int k_timeout_add(timeout_t *t, uint64_t expires, int flags)
+{
+    irq_guard_t g;
+    auto bp = bases[hartid];
+    if (!bp)
+        return K_ENODEV;
+    if (auto old = _lockBase(t))
+    {
+        _dequeue(*old, t);
+        t->hart = -1;
+        old->lock.unlock();
+    }
+
+    auto &b = *bp;
+    b.lock.lock();
+    t->expires = expires;
+    t->hart = hartid;
+    if (flags & K_TIMEOUT_HRES)
+    {
+        b.hres.insert(t);
+        t->state = TIMEOUT_TREE;
+    }
+    else
+    {
+        _place(b, t);
+        t->state = TIMEOUT_WHEEL;
+    }
+    uint64_t next = _next(b);
+    b.lock.unlock();
+
+    auto armed = k_timer_get(K_TIMER_TIMEOUTS);
+    if (!armed || next < armed)
+    {
+        k_timer_set(K_TIMER_TIMEOUTS, next);
+        k_timer_program();
+    }
+    return K_OK;
+}
+
+int k_timeout_cancel(timeout_t *t)
+{
+    irq_guard_t g;
+    auto b = _lockBase(t);
+    if (!b)
+        return K_EALREADY;
+    int rc = _dequeue(*b, t);
+    b->lock.unlock();
+    return rc;
+}
+
+int k_timeout_cancel_sync(timeout_t *t)
+{
+    int h = t->hart;
+    int rc = k_timeout_cancel(t);
+    if (h >= 0)
+        while (bases[h]->running.load(std::memory_order_acquire) == t)
+            ;
+    return rc;
+}
+
+bool k_timeout_pending(const timeout_t *t)
+{
+    return t->state != TIMEOUT_IDLE;
+}
+
+uint64_t k_timeout_run(uint64_t now)
+{
+    auto bp = bases[hartid];
+    if (!bp)
+        return 0;
+    auto &b = *bp;
+    uint64_t target = now / jiffy;
+    b.lock.lock();
+
+    while ((int64_t)(target - b.clk) >= 0)
+    {
+        uint64_t j = _nextJiffy(b);
+        if (j == ~0ULL || (int64_t)(j - target) > 0)
+        {
+            b.clk = target + 1; // nothing in between, skip the empty buckets
+            break;
+        }
+        b.clk = j;
+        // Upper levels first, a timeout may fall through several of them
+        for (int level = LEVELS - 1; level > 0; level--)
+        {
+            int shift = BITS * level;
+            if (j & ((1ULL << shift) - 1))
+                continue;
+            int slot = level * SLOTS + ((j >> shift) & (SLOTS - 1));
+            auto t = b.buckets[slot];
+            b.buckets[slot] = nullptr;
+            b.occupied[level] &= ~(1ULL << (slot % SLOTS));
+            while (t)
+            {
+                auto next = t->next;
+                _place(b, t);
+                t = next;
+            }
+        }
+        // The due bucket moves aside, so callbacks adding again cannot land in it, and runs one at a time
+        int slot = j & (SLOTS - 1);
+        while (auto t = b.buckets[slot])
+        {
+            _unlink(b, t);
+            _link(b, t, EXPIRING);
+        }
+        b.clk = j + 1;
+        while (auto t = b.buckets[EXPIRING])
+        {
+            _unlink(b, t);
+            _expire(b, t);
+        }
+    }
+
+    while (auto t = b.hres.first())
+    {
+        if ((int64_t)(t->expires - now) > 0)
+            break;
+        b.hres.erase(t);
+        _expire(b, t);
+    }
+
+    uint64_t next = _next(b);
+    b.lock.unlock();
+    return next;
+}
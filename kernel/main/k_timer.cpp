@@ -0,0 +1,72 @@
+#include <atomic>
+
+#include "k_main.h"
+#include "k_sbif.hpp"
+#include "k_timer.h"
+#include "k_perf.h"
+#include "k_rcu.h"
+
+struct alignas(64) hart_timer_t
+{
+    uint64_t when[K_TIMER_SOURCES];
+    uint64_t armed; // programmed compare value, 0 when the timer is off
+};
+
+// Indexed, not hart locals: ISRs run with the hart locals of the interrupted task
+static hart_timer_t timers[K_CONFIG_MAX_PROCESSORS];
+static std::atomic<int> hsm_suspend = -1; // SBI HSM available, probed on first use
+
+void k_timer_set(int src, uint64_t when)
+{
+    timers[hartid].when[src] = when;
+}
+
+uint64_t k_timer_get(int src)
+{
+    return timers[hartid].when[src];
+}
+
+void k_timer_program()
+{
+    auto &t = timers[hartid];
+    uint64_t next = 0;
+    for (auto w : t.when)
+        if (w && (!next || w < next))
+            next = w;
+    if (next == t.armed)
+        return;
+    auto rc = next ? SBIF::Timer::setTimer(next) : SBIF::Timer::clearTimer();
+    if (rc)
+        k_printk("Cannot reset timer: %ld\n", rc);
+    else
+        t.armed = next;
+}
+
+void k_timer_idle()
+{
+    k_perf_publish(); // readers get this hart's counters while it sleeps
+    k_rcu_idle_enter(); // quiescent while parked, due callbacks run first
+    k_timer_set(K_TIMER_HOUSEKEEPING, 0);
+    k_timer_program();
+#if K_CONFIG_IDLE_SUSPEND
+    if (hsm_suspend < 0)
+        hsm_suspend = SBIF::HSM::available() != 0;
+    if (!hsm_suspend || SBIF::HSM::suspendHart(SBI_HSM_SUSPEND_RET_DEFAULT, 0, 0) != 0)
+        asm volatile("wfi");
+#else
+    asm volatile("wfi");
+#endif
+    k_rcu_idle_exit();
+    k_timer_set(K_TIMER_HOUSEKEEPING, csr_read(CSR_TIME) + k_cpuclock);
+}
+
+void k_timer_kick(int hart)
+{
+    if (hart == hartid)
+    {
+        timers[hart].when[K_TIMER_SCHED] = csr_read(CSR_TIME);
+        k_timer_program();
+    }
+    else
+        SBIF::IPI::sendIPI(1UL << hart, 0);
+}
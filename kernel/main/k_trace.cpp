@@ -0,0 +1,103 @@
+#include <cstring>
+#include <fcntl.h>
+
+#include "k_main.h"
+#include "k_trace.h"
+#include "k_mem.hpp"
+#include "k_vfs.h"
+
+K_TRACE_EVENT(isr_enter, "cause=%lx epc=%lx");
+K_TRACE_EVENT(isr_exit, "cause=%lx");
+K_TRACE_EVENT(vfs_open, "fd=%ld flags=%lx");
+K_TRACE_EVENT(vfs_close, "fd=%ld ret=%ld");
+K_TRACE_EVENT(vfs_read, "fd=%ld count=%lu ret=%ld");
+K_TRACE_EVENT(vfs_write, "fd=%ld count=%lu ret=%ld");
+K_TRACE_EVENT(mmu_map, "vaddr=%lx paddr=%lx size=%lx prot=%lx");
+K_TRACE_EVENT(mmu_unmap, "vaddr=%lx size=%lx");
+K_TRACE_EVENT(sched_add, "group=%ld task=%lu prio=%ld");
+K_TRACE_EVENT(sched_remove, "group=%ld task=%lu");
+K_TRACE_EVENT(sched_switch, "prev=%lu next=%lu");
+K_TRACE_EVENT(sched_steal, "victim=%ld thief=%ld count=%lu");
+
+struct trace_buf_t
+{
+    std::atomic<uint32_t> next;
+    alignas(64) trace_rec_t recs[K_CONFIG_TRACE_RECORDS];
+};
+
+trace_buf_t *k_trace_bufs[K_CONFIG_MAX_PROCESSORS];
+std::atomic_bool k_trace_on = false;
+
+void k_trace_record(const trace_event_t *ev, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3)
+{
+    int hart = k_current_hart();
+    if (hart < 0 || hart >= K_CONFIG_MAX_PROCESSORS)
+        return;
+    auto b = k_trace_bufs[hart];
+    if (!b)
+        return;
+    // Only this hart writes here, the atomic add keeps a nested ISR from taking the same slot
+    uint32_t seq = b->next.fetch_add(1, std::memory_order_relaxed);
+    auto &r = b->recs[seq & (K_CONFIG_TRACE_RECORDS - 1)];
+    r.seq = 0;
+    r.time = csr_read(CSR_TIME);
+    r.hart = hart;
+    r.event = ev - _trace_events_start;
+    r.args[0] = a0;
+    r.args[1] = a1;
+    r.args[2] = a2;
+    r.args[3] = a3;
+    std::atomic_thread_fence(std::memory_order_release);
+    r.seq = seq + 1;
+}
+
+int k_trace_start()
+{
+    for (auto &cpu : syscpu->CPUs())
+    {
+        if (cpu.hid >= K_CONFIG_MAX_PROCESSORS || k_trace_bufs[cpu.hid])
+            continue;
+        auto b = alignedMalloc<trace_buf_t>(sizeof(trace_buf_t), 64);
+        if (!b)
+            return K_ENOMEM;
+        memset((void *)b, 0, sizeof(trace_buf_t));
+        k_trace_bufs[cpu.hid] = b;
+    }
+    k_trace_on = true;
+    return K_OK;
+}
+
+void k_trace_stop()
+{
+    k_trace_on = false;
+}
+
+int k_trace_dump(const char *path)
+{
+    bool was_on = k_trace_on.exchange(false);
+    int fd = VirtualFS::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        k_trace_on = was_on;
+        return fd;
+    }
+
+    trace_dump_hdr_t hdr = {K_TRACE_MAGIC,
+                            1,
+                            sizeof(trace_rec_t),
+                            0,
+                            K_CONFIG_TRACE_RECORDS,
+                            (uint64_t)_trace_events_start,
+                            (uint64_t)k_cpuclock};
+    for (int h = 0; h < K_CONFIG_MAX_PROCESSORS; h++)
+        if (k_trace_bufs[h])
+            hdr.harts++;
+
+    int rc = VirtualFS::write(fd, &hdr, sizeof(hdr));
+    for (int h = 0; rc >= 0 && h < K_CONFIG_MAX_PROCESSORS; h++)
+        if (k_trace_bufs[h])
+            rc = VirtualFS::write(fd, k_trace_bufs[h]->recs, sizeof(k_trace_bufs[h]->recs));
+    VirtualFS::close(fd);
+    k_trace_on = was_on;
+    return rc < 0 ? rc : K_OK;
+}
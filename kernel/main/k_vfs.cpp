@@ -1,18 +1,15 @@
 #include "k_main.h"
 #include "k_vfs.h"
 
-/* __attribute__((
-    init_priority(K_PR_INIT_FS_LIST)))  */
-std::map<std::string, std::pair<BasicFS *, VirtualFS::deleteInstanceFunc_t>> VirtualFS::_fs_map;
-
 __attribute__((init_priority(K_PR_INIT_FS_LIST)))
 std::vector<std::tuple<std::string, VirtualFS::newInstanceFunc_t, VirtualFS::deleteInstanceFunc_t>>
     VirtualFS::_fs_factories;
 
-__attribute__((init_priority(K_PR_INIT_FS_LIST))) lock_t VirtualFS::_fs_lock;
+__attribute__((init_priority(K_PR_INIT_FS_LIST))) lock_t VirtualFS::_mount_lock;
 
-std::map<int, std::pair<BasicFS *, int>> VirtualFS::_global_fd_map;
-int VirtualFS::_global_fd_counter = 3; // 0, 1, 2 are reserved for stdin, stdout, stderr of system
+std::atomic<VirtualFS::mount_table_t *> VirtualFS::_mounts = nullptr;
+__attribute__((init_priority(K_PR_INIT_FS_LIST))) rwlock_t VirtualFS::_fs_rw;
+VirtualFS::file_t VirtualFS::_files[K_CONFIG_VFS_MAX_FILES];
 
 int VirtualFS::_write_stdout(const char *buf, int size)
 {
@@ -33,4 +30,358 @@ int VirtualFS::_write_stdout(const char *buf, int size)
         }
     }
     return size;
-}
\ No newline at end of file
+}
+VirtualFS::mount_t *VirtualFS::_lookup(const char *path, std::string &rel)
+{
+    mount_t *mnt = nullptr;
+    size_t max_len = 0;
+    std::string_view p(path);
+
+    // A replaced table is freed after a grace period, the mount found is referenced before this one ends
+    rcu_read_lock();
+    auto tbl = _mounts.load(std::memory_order_acquire);
+    if (tbl)
+    {
+        for (auto &x : *tbl)
+        {
+            // "/tmp" also names the root of the FS mounted at "/tmp/"
+            std::string_view mp(x.first);
+            bool match = p.find(mp) == 0 || (mp.back() == '/' && p == mp.substr(0, mp.size() - 1));
+            if (match && max_len < x.first.size())
+            {
+                max_len = x.first.size();
+                mnt = x.second;
+            }
+        }
+        if (mnt)
+            mnt->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    rcu_read_unlock();
+    if (!mnt)
+        return nullptr;
+
+    p.remove_prefix(max_len < p.size() ? max_len : p.size());
+    while (!p.empty() && p.front() == '/')
+        p.remove_prefix(1);
+    while (!p.empty() && p.back() == '/')
+        p.remove_suffix(1);
+    rel = p;
+    return mnt;
+}
+
+int VirtualFS::mount(const char *path, const char *devicePath, int flags, int mode, const char *fs_name)
+{
+    _mount_lock.lock();
+    auto old = _mounts.load(std::memory_order_relaxed);
+    if (old && old->count(path))
+    {
+        _mount_lock.unlock();
+        return K_EALREADY;
+    }
+    rw_read_guard_t g(_fs_rw); // factories must not register or unregister FSes
+    for (auto &fs : _fs_factories)
+    {
+        if ((fs_name && std::get<0>(fs) == fs_name) || !fs_name)
+        {
+            auto [ret, fs_instance] = std::get<1>(fs)(devicePath);
+            if (ret == K_OK)
+            {
+                auto mnt = new mount_t{path, fs_instance, std::get<2>(fs)};
+                auto tbl = old ? new mount_table_t(*old) : new mount_table_t();
+                tbl->insert(std::make_pair(path, mnt));
+                old = _publish(tbl);
+                _mount_lock.unlock();
+                if (old)
+                    _retire(old);
+                return 0;
+            }
+            if (ret != K_ENOTSUPP) // Something other than not supported happened
+            {
+                _mount_lock.unlock();
+                return ret;
+            }
+        }
+    }
+    _mount_lock.unlock();
+    return K_ENOTSUPP; // No FS could be mounted
+}
+
+int VirtualFS::umount(const char *path)
+{
+    _mount_lock.lock();
+    auto old = _mounts.load(std::memory_order_relaxed);
+    auto it = old ? old->find(path) : mount_table_t::iterator();
+    if (!old || it == old->end())
+    {
+        _mount_lock.unlock();
+        return K_ENOTSUPP;
+    }
+    auto mnt = it->second;
+    if (mnt->refs.load() != 1) // open files, or an operation in flight
+    {
+        _mount_lock.unlock();
+        return K_EDENIED;
+    }
+    auto tbl = new mount_table_t(*old);
+    tbl->erase(path);
+    _publish(tbl);
+    _mount_lock.unlock();
+    synchronize_rcu(); // no lookup can find mnt from here on
+    delete old;
+    _put(mnt); // a lookup racing with us may still hold it, the last one out deletes the FS
+    return 0;
+}
+
+// Swap in a new mount table, _mount_lock held. Returns the old one, lookups may still read it.
+VirtualFS::mount_table_t *VirtualFS::_publish(mount_table_t *tbl)
+{
+    return _mounts.exchange(tbl, std::memory_order_acq_rel);
+}
+
+// Free a replaced table once no lookup can see it
+void VirtualFS::_retire(mount_table_t *tbl)
+{
+    call_rcu(tbl, [](rcu_head_t *head) { delete static_cast<mount_table_t *>(head); });
+}
+
+int VirtualFS::_install(mount_t *mnt, int fd, bool dir)
+{
+    for (int i = 0; i < K_CONFIG_VFS_MAX_FILES; i++)
+    {
+        auto &f = _files[i];
+        int expected = 0;
+        if (f.refs.load(std::memory_order_relaxed) || !f.refs.compare_exchange_strong(expected, 1))
+            continue;
+        // The slot is ours, _get() ignores it until open is set
+        f.dir = dir;
+        f.mnt = mnt;
+        f.fd = fd;
+        f.pos = 0;
+        f.ra = readahead_t();
+        f.open.store(true, std::memory_order_release);
+        return FD_BASE + i;
+    }
+    return K_ENOMEM;
+}
+
+// Drop the table reference, the FS side is closed once in-flight I/O lets go of the file
+int VirtualFS::_release(int fd, bool dir)
+{
+    auto f = _get(fd, dir);
+    if (!f)
+        return K_ENOENT;
+    bool was_open = f->open.exchange(false, std::memory_order_acq_rel);
+    if (was_open)
+        _put(f);
+    _put(f);
+    return was_open ? K_OK : K_ENOENT;
+}
+
+void VirtualFS::_put(file_t *f)
+{
+    // Stable while we hold a reference, the slot may be reused as soon as refs reaches 0
+    auto mnt = f->mnt;
+    int fd = f->fd;
+    bool dir = f->dir;
+    if (f->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+
+    mnt->lock.lock();
+    if (dir)
+        mnt->fs->closedir(fd);
+    else
+        mnt->fs->close(fd);
+    mnt->lock.unlock();
+    _put(mnt);
+}
+
+int VirtualFS::open(const char *path, int flags, int mode)
+{
+    std::string rel;
+    auto mnt = _lookup(path, rel);
+    if (!mnt)
+        return K_ENOENT;
+    mnt->lock.lock();
+    int ret = mnt->fs->open(rel.c_str(), flags, mode);
+    mnt->lock.unlock();
+    if (ret < 0)
+    {
+        _put(mnt);
+        return ret;
+    }
+    int fd = _install(mnt, ret, false); // the file keeps the mount reference
+    if (fd < 0)
+    {
+        mnt->lock.lock();
+        mnt->fs->close(ret);
+        mnt->lock.unlock();
+        _put(mnt);
+    }
+    K_TRACE(vfs_open, fd, flags);
+    return fd;
+}
+
+int VirtualFS::close(int fd)
+{
+    int ret = _release(fd, false);
+    K_TRACE(vfs_close, fd, ret);
+    return ret;
+}
+
+int VirtualFS::opendir(const char *path)
+{
+    if (!path)
+        return K_EINVAL;
+    std::string rel;
+    auto mnt = _lookup(path, rel);
+    if (!mnt)
+        return K_ENOENT;
+    mnt->lock.lock();
+    int ret = mnt->fs->opendir(rel.c_str());
+    mnt->lock.unlock();
+    if (ret < 0)
+    {
+        _put(mnt);
+        return ret;
+    }
+    int dd = _install(mnt, ret, true);
+    if (dd < 0)
+    {
+        mnt->lock.lock();
+        mnt->fs->closedir(ret);
+        mnt->lock.unlock();
+        _put(mnt);
+    }
+    return dd;
+}
+
+int VirtualFS::mmap(VMemoryMgr *vmm, uintptr_t vaddr, size_t len, int prot, int fd, off_t offset)
+{
+    if (!vmm || (vaddr & 0xFFF) || (len & 0xFFF) || (offset & 0xFFF))
+        return K_EINVAL;
+
+    auto f = _get(fd);
+    if (!f)
+        return K_ENOENT;
+
+    int rc = K_OK;
+    for (size_t off = 0; off < len; off += 4096)
+    {
+        uintptr_t page = 0;
+        rc = f->mnt->fs->getpage(f->fd, offset + off, &page);
+        if (rc < 0)
+            break;
+        vmm->addMap(vaddr + off, page & ~(0xFFFFFFC000000000), 4096, prot);
+    }
+    _put(f);
+    return rc < 0 ? rc : K_OK;
+}
+
+int VirtualFS::munmap(VMemoryMgr *vmm, uintptr_t vaddr, size_t len, int prot, int fd)
+{
+    if (!vmm || (vaddr & 0xFFF) || (len & 0xFFF))
+        return K_EINVAL;
+
+    auto f = _get(fd);
+    if (!f)
+        return K_ENOENT;
+
+    std::vector<uintptr_t> pages;
+    for (size_t off = 0; off < len; off += 4096)
+    {
+        auto pa = vmm->removeMap(vaddr + off, 4096, prot);
+        if (pa)
+            pages.push_back(pa | 0xFFFFFFC000000000);
+    }
+    // The FS may free a page once unpinned, nothing may map it by then
+    int rc = vmm->confirm();
+    vmm->getMMU()->apply();
+    if (rc >= 0) // otherwise they may still be mapped, they stay pinned
+        for (auto p : pages)
+            f->mnt->fs->putpage(p);
+    _put(f);
+    return rc < 0 ? rc : K_OK;
+}
+
+// readv/writev on the shared file position, the file lock makes the whole vector one operation
+int VirtualFS::_rwv(int fd, const struct iovec *iov, int iovcnt, bool wr)
+{
+    if (iovcnt < 0)
+        return K_EINVAL;
+    if (fd == FILE_STDIN || fd == FILE_STDOUT || fd == FILE_STDERR)
+    {
+        int total = 0;
+        for (int i = 0; i < iovcnt; i++)
+        {
+            int rc = wr ? write(fd, iov[i].iov_base, iov[i].iov_len) : read(fd, iov[i].iov_base, iov[i].iov_len);
+            if (rc < 0)
+                return total ? total : rc;
+            total += rc;
+            if ((size_t)rc < iov[i].iov_len)
+                break;
+        }
+        return total;
+    }
+
+    auto f = _get(fd);
+    if (!f)
+        return K_ENOENT;
+    auto fs = f->mnt->fs;
+    int total = 0;
+    f->lock.lock();
+    for (int i = 0; i < iovcnt; i++)
+    {
+        int rc = wr ? fs->write(f->fd, iov[i].iov_base, iov[i].iov_len)
+                    : fs->read(f->fd, iov[i].iov_base, iov[i].iov_len);
+        if (rc < 0)
+        {
+            if (!total)
+                total = rc;
+            break;
+        }
+        if (!wr && rc > 0)
+            _readahead(*f, f->pos, rc);
+        f->pos += rc;
+        total += rc;
+        if ((size_t)rc < iov[i].iov_len)
+            break;
+    }
+    f->lock.unlock();
+    _put(f);
+    return total;
+}
+
+void VirtualFS::_readahead(file_t &f, off_t pos, size_t count)
+{
+    auto &ra = f.ra;
+    if (ra.disabled)
+        return;
+
+    off_t end = pos + count;
+    if (pos != ra.prev_end) // random access, collapse the window
+    {
+        ra.prev_end = end;
+        ra.window = 0;
+        ra.marker = 0;
+        return;
+    }
+    ra.prev_end = end;
+
+    if (!ra.window)
+        ra.window = count > K_CONFIG_VFS_READAHEAD_MIN ? count : K_CONFIG_VFS_READAHEAD_MIN;
+    else if (ra.window < K_CONFIG_VFS_READAHEAD_MAX)
+        ra.window *= 2;
+    if (ra.window > K_CONFIG_VFS_READAHEAD_MAX)
+        ra.window = K_CONFIG_VFS_READAHEAD_MAX;
+
+    // Only ask for more once the reader has consumed half of the last window
+    if (end + (off_t)(ra.window / 2) < ra.marker)
+        return;
+    off_t start = ra.marker > end ? ra.marker : end;
+    if (f.mnt->fs->readahead(f.fd, start, ra.window) == K_ENOTSUPP)
+    {
+        ra.disabled = true;
+        return;
+    }
+    ra.marker = start + ra.window;
+}
@@ -0,0 +1,258 @@
+#include "k_main.h"
+#include "k_mmu.h"
+#include "k_timeout.h"
+#include "k_wait.h"
+#include "syscall.h"
+
+static constexpr int WAKE_BATCH = 16; // tasks claimed per pass of k_wake, enqueued once the lock is dropped
+
+static waitq_t futex_queues[K_CONFIG_FUTEX_BUCKETS];
+
+// Locked callers, interrupts off
+static void _append(waitq_t *q, wait_entry_t *w)
+{
+    w->q = q;
+    w->next = nullptr;
+    w->prev = q->tail;
+    if (q->tail)
+        q->tail->next = w;
+    else
+        q->head = w;
+    q->tail = w;
+    w->queued = true;
+}
+
+static void _remove(waitq_t *q, wait_entry_t *w)
+{
+    if (w->prev)
+        w->prev->next = w->next;
+    else
+        q->head = w->next;
+    if (w->next)
+        w->next->prev = w->prev;
+    else
+        q->tail = w->prev;
+    w->prev = w->next = nullptr;
+    w->q = nullptr;
+    w->queued = false;
+}
+
+// Locks the queue w is on, interrupts off; nullptr when it is on none
+static waitq_t *_lockQueue(wait_entry_t *w)
+{
+    for (;;)
+    {
+        auto q = *(waitq_t *volatile *)&w->q;
+        if (!q)
+            return nullptr;
+        q->lock.lock();
+        if (w->q == q)
+            return q;
+        q->lock.unlock(); // requeued meanwhile
+    }
+}
+
+bool k_wait_prepare(waitq_t *q, wait_entry_t *w)
+{
+    auto self = k_thread_self();
+    if (!self)
+        return false;
+    irq_guard_t g;
+    q->lock.lock();
+    if (!w->queued)
+    {
+        w->task = self;
+        w->woken = false;
+        _append(q, w);
+    }
+    self->state = SysScheduler::TASK_BLOCKED; // under the lock: a waker that finds w sees it blocked
+    q->lock.unlock();
+    return true;
+}
+
+void k_wait_finish(wait_entry_t *w)
+{
+    auto self = w->task;
+    if (!self)
+        return;
+    int expected = SysScheduler::TASK_BLOCKED;
+    if (!self->state.compare_exchange_strong(expected, SysScheduler::TASK_RUNNING) &&
+        expected == SysScheduler::TASK_READY)
+        k_thread_block(); // claimed, the waker enqueues it
+    irq_guard_t g;
+    if (auto q = _lockQueue(w))
+    {
+        _remove(q, w);
+        q->lock.unlock();
+    }
+}
+
+int k_wake(waitq_t *q, int n, uintptr_t key)
+{
+    int woken = 0;
+    while (woken < n)
+    {
+        thread_t *batch[WAKE_BATCH];
+        int claimed = 0, taken = 0;
+        {
+            irq_guard_t g;
+            q->lock.lock();
+            for (auto w = q->head; w && claimed < WAKE_BATCH && woken + taken < n;)
+            {
+                auto next = w->next;
+                if (!key || w->key == key)
+                {
+                    _remove(q, w);
+                    w->woken = true;
+                    taken++;
+                    // Not blocked: woken by someone else already, it checks its condition again anyway
+                    if (k_thread_claim(w->task))
+                        batch[claimed++] = w->task;
+                }
+                w = next; // w may be gone once the lock is dropped, not touched after
+            }
+            q->lock.unlock();
+        }
+        for (int i = 0; i < claimed; i++)
+            k_thread_enqueue(batch[i]);
+        woken += taken;
+        if (!taken)
+            break;
+    }
+    return woken;
+}
+
+// Futex words are addresses of the sysmmu space, the only one tasks run in: 0 for a hart on any other page table
+static uintptr_t _futexKey(volatile uint32_t *uaddr)
+{
+    auto va = (uintptr_t)uaddr;
+    if (!va || va & 3)
+        return 0;
+    if (!sysmmu)
+        return va;
+    uintptr_t satp = 0;
+    sysmmu->getSATP(&satp);
+    if (csr_read(CSR_SATP) != satp)
+        return 0;
+    return sysmmu->translate(va); // shared mappings of one word meet on its physical address
+}
+
+static waitq_t &_futexQueue(uintptr_t key)
+{
+    return futex_queues[((key >> 2) * 0x9E3779B97F4A7C15ULL >> 32) & (K_CONFIG_FUTEX_BUCKETS - 1)];
+}
+
+static uint32_t _futexLoad(volatile uint32_t *uaddr)
+{
+    auto sstatus = csr_read_set(CSR_SSTATUS, SSTATUS_SUM); // the word may be on a U-mode page
+    uint32_t val = *uaddr;
+    if (!(sstatus & SSTATUS_SUM))
+        csr_clear(CSR_SSTATUS, SSTATUS_SUM);
+    return val;
+}
+
+// Timeout ISR of the waiting hart
+static void _futexTimeout(timeout_t *, void *arg)
+{
+    auto w = (wait_entry_t *)arg;
+    auto q = _lockQueue(w);
+    if (!q)
+        return; // woken first
+    _remove(q, w);
+    w->timedout = true;
+    bool claimed = k_thread_claim(w->task);
+    q->lock.unlock();
+    if (claimed)
+        k_thread_enqueue(w->task);
+}
+
+int k_futex_wait(volatile uint32_t *uaddr, uint32_t val, uint64_t timeout_us)
+{
+    auto key = _futexKey(uaddr);
+    if (!key)
+        return K_EINVALID_ADDR;
+    wait_entry_t w;
+    w.key = key;
+    if (!k_wait_prepare(&_futexQueue(key), &w))
+        return K_ENOTSUPP;
+    if (_futexLoad(uaddr) != val) // changed before we were queued, the wake may have been missed
+    {
+        k_wait_finish(&w);
+        return K_EAGAIN;
+    }
+    timeout_t to;
+    if (timeout_us)
+    {
+        k_timeout_init(&to, _futexTimeout, &w);
+        k_timeout_add(&to, csr_read(CSR_TIME) + k_cpuclock * timeout_us / 1000000);
+    }
+    k_thread_block(); // any wakeup returns, callers check the word again
+    if (timeout_us)
+        k_timeout_cancel_sync(&to);
+    k_wait_finish(&w);
+    return w.timedout && !w.woken ? K_ETIMEDOUT : K_OK;
+}
+
+int k_futex_wake(volatile uint32_t *uaddr, int n)
+{
+    auto key = _futexKey(uaddr);
+    if (!key)
+        return K_EINVALID_ADDR;
+    return n > 0 ? k_wake(&_futexQueue(key), n, key) : 0;
+}
+
+int k_futex_requeue(volatile uint32_t *uaddr, int n, volatile uint32_t *uaddr2, int nmove)
+{
+    auto key = _futexKey(uaddr), key2 = _futexKey(uaddr2);
+    if (!key || !key2)
+        return K_EINVALID_ADDR;
+    auto q = &_futexQueue(key), q2 = &_futexQueue(key2);
+    int woken = n > 0 ? k_wake(q, n, key) : 0;
+    if (nmove <= 0 || key == key2)
+        return woken;
+
+    // Both locks in address order, once when the words share a bucket
+    irq_guard_t g;
+    auto first = q < q2 ? q : q2, second = q < q2 ? q2 : q;
+    first->lock.lock();
+    if (second != first)
+        second->lock.lock();
+    int moved = 0;
+    for (auto w = q->head; w && moved < nmove;)
+    {
+        auto next = w->next;
+        if (w->key == key)
+        {
+            _remove(q, w);
+            w->key = key2;
+            _append(q2, w);
+            moved++;
+        }
+        w = next;
+    }
+    if (second != first)
+        second->lock.unlock();
+    first->lock.unlock();
+    return woken + moved;
+}
+
+long k_futex_syscall(uintptr_t uaddr, int op, uint32_t val, uint64_t arg, uintptr_t uaddr2)
+{
+    long rc;
+    switch (op)
+    {
+    case FUTEX_WAIT:
+        rc = k_futex_wait((volatile uint32_t *)uaddr, val, arg);
+        break;
+    case FUTEX_WAKE:
+        rc = k_futex_wake((volatile uint32_t *)uaddr, val);
+        break;
+    case FUTEX_REQUEUE:
+        rc = k_futex_requeue((volatile uint32_t *)uaddr, val, (volatile uint32_t *)uaddr2, arg);
+        break;
+    default:
+        rc = K_ENOSYS;
+        break;
+    }
+    return rc;
+}
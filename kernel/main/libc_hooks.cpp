@@ -2,8 +2,12 @@
 
 #include "k_main.h"
 #include "k_vfs.h"
+#include "k_stats.h"
+#include "k_lock.h"
 
-std::atomic_uintptr_t k_malloc_lock = 0;
+std::atomic_uintptr_t k_malloc_lock = 0; // reent holding the heap
+static qlock_t malloc_qlock("malloc");   // every hart allocates, queue up instead of hammering one word
+static unsigned malloc_depth = 0;        // recursion of the holder
 
 extern "C"
 {
@@ -40,6 +44,47 @@ extern "C"
         return VirtualFS::fstat(fd, buf);
     }
 
+    int _stat(const char *path, struct stat *buf)
+    {
+        return VirtualFS::stat(path, buf);
+    }
+
+    int ftruncate(int fd, off_t length)
+    {
+        return VirtualFS::ftruncate(fd, length);
+    }
+
+    // Positional and vectored I/O, newlib has no backend for these on bare metal
+    ssize_t pread(int fd, void *buf, size_t count, off_t offset)
+    {
+        return VirtualFS::pread(fd, buf, count, offset);
+    }
+
+    ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset)
+    {
+        return VirtualFS::pwrite(fd, buf, count, offset);
+    }
+
+    ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
+    {
+        return VirtualFS::readv(fd, iov, iovcnt);
+    }
+
+    ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+    {
+        return VirtualFS::writev(fd, iov, iovcnt);
+    }
+
+    ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+    {
+        return VirtualFS::preadv(fd, iov, iovcnt, offset);
+    }
+
+    ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+    {
+        return VirtualFS::pwritev(fd, iov, iovcnt, offset);
+    }
+
 
     struct _reent *__getreent(void)
     {
@@ -53,20 +98,64 @@ extern "C"
     {
         // _write(0,(char*)"mlock\n",6);
         if (k_stage != K_MULTICORE)
-            return;
-        uintptr_t tmp = 0;
+            return; // one hart at a time, and every hart shares _GLOBAL_REENT so far
         if (k_malloc_lock == (uintptr_t)reent)
+        {
+            malloc_depth++;
             return; // recursive lock
-        while (k_malloc_lock.compare_exchange_weak(tmp, (uintptr_t)reent))
-            tmp = 0;
+        }
+        malloc_qlock.lock();
+        k_malloc_lock = (uintptr_t)reent;
+        malloc_depth = 1;
+    }
+
+    // Heap entry points, wrapped by the linker (--wrap) to count them in heap_ops. Allocations inside newlib that
+    // go to _malloc_r directly are not counted.
+    void *__real_malloc(size_t size);
+    void __real_free(void *ptr);
+    void *__real_realloc(void *ptr, size_t size);
+    void *__real_calloc(size_t n, size_t size);
+    void *__real_memalign(size_t align, size_t size);
+
+    void *__wrap_malloc(size_t size)
+    {
+        K_STAT_INC(heap_ops);
+        return __real_malloc(size);
+    }
+
+    void __wrap_free(void *ptr)
+    {
+        K_STAT_INC(heap_ops);
+        __real_free(ptr);
+    }
+
+    void *__wrap_realloc(void *ptr, size_t size)
+    {
+        K_STAT_INC(heap_ops);
+        return __real_realloc(ptr, size);
+    }
+
+    void *__wrap_calloc(size_t n, size_t size)
+    {
+        K_STAT_INC(heap_ops);
+        return __real_calloc(n, size);
+    }
+
+    void *__wrap_memalign(size_t align, size_t size)
+    {
+        K_STAT_INC(heap_ops);
+        return __real_memalign(align, size);
     }
 
     void __malloc_unlock(struct _reent *reent)
     {
         // _write(0,(char*)"munlock\n",8);
-        if (k_stage != K_MULTICORE)
+        if (k_stage != K_MULTICORE || k_malloc_lock != (uintptr_t)reent)
+            return;
+        if (--malloc_depth)
             return;
         k_malloc_lock = 0;
+        malloc_qlock.unlock();
     }
 
     /**
@@ -78,26 +167,26 @@ extern "C"
 #else
     #include "k_lock.h"
 
-    struct __lock __lock___sinit_recursive_mutex;
-    struct __lock __lock___sfp_recursive_mutex;
-    struct __lock __lock___atexit_recursive_mutex;
-    struct __lock __lock___at_quick_exit_mutex;
-    struct __lock __lock___malloc_recursive_mutex;
-    struct __lock __lock___env_recursive_mutex;
-    struct __lock __lock___tz_mutex;
-    struct __lock __lock___dd_hash_mutex;
-    struct __lock __lock___arc4random_mutex;
+    struct __lock __lock___sinit_recursive_mutex("newlib.sinit");
+    struct __lock __lock___sfp_recursive_mutex("newlib.sfp");
+    struct __lock __lock___atexit_recursive_mutex("newlib.atexit");
+    struct __lock __lock___at_quick_exit_mutex("newlib.at_quick_exit");
+    struct __lock __lock___malloc_recursive_mutex("newlib.malloc");
+    struct __lock __lock___env_recursive_mutex("newlib.env");
+    struct __lock __lock___tz_mutex("newlib.tz");
+    struct __lock __lock___dd_hash_mutex("newlib.dd_hash");
+    struct __lock __lock___arc4random_mutex("newlib.arc4random");
 
     void __retarget_lock_init(_LOCK_T *lock_ptr)
     {
         // _write(0, (char *)"__retarget_lock_init\n", 21);
-        *lock_ptr = new __lock();
+        *lock_ptr = new __lock("newlib");
     }
 
     void __retarget_lock_init_recursive(_LOCK_T *lock_ptr)
     {
         // _write(0, (char *)"__retarget_lock_init_recursive\n", 31);
-        *lock_ptr = new __lock();
+        *lock_ptr = new __lock("newlib.recursive");
     }
 
     void __retarget_lock_close(_LOCK_T lock)
@@ -127,33 +216,12 @@ extern "C"
     int __retarget_lock_try_acquire(_LOCK_T lock)
     {
         // _write(0, (char *)"__retarget_lock_try_acquire\n", 28);
-        if (k_stage != K_MULTICORE)
-            return 1;
-        int null_owner = -1;
-        if (lock->owner.compare_exchange_weak(null_owner, hartid))
-        {
-            lock->recursive_count = 1;
-            return 1;
-        }
-        return 0;
+        return lock->try_lock();
     }
 
     int __retarget_lock_try_acquire_recursive(_LOCK_T lock)
     {
-        if (k_stage != K_MULTICORE)
-            return 1;
-        if (lock->owner == hartid)
-        {
-            lock->recursive_count++;
-            return 1;
-        }
-        int null_owner = -1;
-        if (lock->owner.compare_exchange_weak(null_owner, hartid))
-        {
-            lock->recursive_count = 1;
-            return 1;
-        }
-        return 0;
+        return lock->try_lock(true);
     }
 
     void __retarget_lock_release(_LOCK_T lock)